@@ -16,6 +16,8 @@ extern "C" {
 
 struct iphdr;
 struct ib_mad_hdr;
+struct rte_rcu_qsbr;
+struct rte_ring;
 
 enum ctcm_direction {
     CTCM_FROM_HOST,
@@ -24,9 +26,224 @@ enum ctcm_direction {
 
 struct ctcm_context;
 
+/* Allow ctcm_query_ipv4/ipv6 to run on any thread concurrently with packet
+ * processing. See ctcm_rcu_qsbr_add. */
+#define CTCM_CREATE_CONCURRENT_QUERY (1ull << 0)
+/* Parse the Ethernet, VLAN/QinQ and IP headers in the library, filling in
+ * l2_len, l3_len and packet_type, so callers need not set them. A packet
+ * type whose L2 bits were set by the NIC is trusted, and anything it does not
+ * classify as UDP is rejected without touching the packet data. RoCE over
+ * VXLAN or GENEVE is parsed down to the inner headers, described by the
+ * outer_l2_len/outer_l3_len fields and RTE_PTYPE_INNER_* bits as for DPDK's
+ * tunnel offloads. */
+#define CTCM_CREATE_PARSE_L2 (1ull << 1)
+/* Drop packets that look like CM unless their ICRC, BTH, DETH and MAD
+ * header versions check out. The checks only run on CM packets, and the drops
+ * are counted by reason, see ctcm_get_validation_counters. */
+#define CTCM_CREATE_VALIDATE (1ull << 2)
+/* Keep the QPN table as a per-host directory of direct-indexed QPN pages
+ * instead of a hash table. It takes much less memory when hosts allocate QPNs
+ * from dense ranges, as NICs do, at a small cost per lookup. Cannot be
+ * combined with CTCM_CREATE_CONCURRENT_QUERY. */
+#define CTCM_CREATE_DIRECT_QPN (1ull << 3)
+/* Allocate all the tables for ctcm_config.max_flows flows when the context is
+ * created, and never allocate memory afterwards. Once max_flows flows are
+ * tracked, new ones evict old ones or are refused, as with
+ * ctcm_set_flow_limits. Only valid with ctcm_create_ex, and cannot be combined
+ * with CTCM_CREATE_DIRECT_QPN. */
+#define CTCM_CREATE_STATIC (1ull << 4)
+#define CTCM_CREATE_FLAGS_MASK (CTCM_CREATE_CONCURRENT_QUERY | \
+                                CTCM_CREATE_PARSE_L2 | \
+                                CTCM_CREATE_VALIDATE | \
+                                CTCM_CREATE_DIRECT_QPN | \
+                                CTCM_CREATE_STATIC)
+
 struct ctcm_context* ctcm_create();
+/* Create a context with CTCM_CREATE_* flags. Returns NULL and sets errno on
+ * failure. */
+struct ctcm_context* ctcm_create_flags(uint64_t flags);
+/* Like ctcm_create_flags, but allocate the context and all its tables from the
+ * hugepage memory of NUMA socket socket_id, typically that of the NIC and of
+ * the lcores processing and querying it, or from any socket with
+ * SOCKET_ID_ANY. Requires the EAL to be initialized. Returns NULL and sets
+ * errno on failure. */
+struct ctcm_context* ctcm_create_socket(uint64_t flags, int socket_id);
+
+/* Not a NUMA socket: allocate a context from the C++ heap, as
+ * ctcm_create_flags does */
+#define CTCM_SOCKET_HEAP (-2)
+
+struct ctcm_config {
+    uint32_t size;
+    /* CTCM_CREATE_* flags */
+    uint64_t flags;
+    /* Socket to allocate from as in ctcm_create_socket, or CTCM_SOCKET_HEAP */
+    int socket_id;
+    /* Number of flows to size the tables for, so that they do not grow
+     * while that many are tracked. 0 for the default, small tables. Ignored
+     * with CTCM_CREATE_STATIC. */
+    uint32_t expected_flows;
+    /* Flow limits, as set by ctcm_set_flow_limits. With CTCM_CREATE_STATIC,
+     * max_flows is required and is the capacity of the tables; the limits
+     * may then be lowered but not raised above it. */
+    uint32_t max_flows;
+    uint32_t max_flows_per_host;
+};
+
+/* Create a context as configured by config. Returns NULL and sets errno on
+ * failure. */
+struct ctcm_context* ctcm_create_ex(const struct ctcm_config *config);
 void ctcm_destroy(struct ctcm_context* ctcm);
 
+/* Most shards of a sharded context */
+#define CTCM_MAX_SHARDS 128
+
+/* Split connection tracking across n contexts, the shards, so that n lcores
+ * can process CM packets in parallel. Each shard tracks the flows whose
+ * initiator's comm ID hashes to it: the local comm ID for flows the local
+ * host starts, and the remote address and comm ID for those a remote host
+ * starts. RX code steers every CM packet to its shard with ctcm_shard_of, and
+ * each shard is processed and polled on a single lcore (an EAL thread, or one
+ * registered with rte_thread_register).
+ *
+ * Queries through any shard resolve through one QPN table, shared by all of
+ * them, which may be queried from any thread as with
+ * CTCM_CREATE_CONCURRENT_QUERY; attach the RCU variable through one of the
+ * shards. Flow limits, counters and SIDR mappings are per shard.
+ * CTCM_CREATE_DIRECT_QPN is not supported.
+ *
+ * Fills shards[0..n-1] and returns 0, or returns -1 and sets errno. Destroy
+ * every shard with ctcm_destroy. */
+int ctcm_create_sharded(uint64_t flags, unsigned n, struct ctcm_context **shards);
+
+/* The shard that must process packet, parsed with ctcm_parse_packet or
+ * ctcm_parse_burst, coming in direction dir. ctcm is any of the shards. May
+ * be called from any thread. Returns -1 if packet is not a CM packet, and 0
+ * for every CM packet of a context that is not sharded. */
+int ctcm_shard_of(const struct ctcm_context *ctcm, enum ctcm_direction dir,
+                  const struct rte_mbuf *packet);
+
+/* Attach an RCU QSBR variable to a context created with
+ * CTCM_CREATE_CONCURRENT_QUERY, or to any one shard of a sharded one, before
+ * processing packets. Threads calling ctcm_query_ipv4 must be registered on v
+ * and report quiescent states; QPN table entries removed by the processing
+ * thread are reclaimed only after all of them did. Queries themselves never
+ * block. Without a variable, removed entries are freed right away, so a query
+ * that races the teardown of its flow may see the entry of a flow added in
+ * its place. */
+int ctcm_rcu_qsbr_add(struct ctcm_context *ctcm, struct rte_rcu_qsbr *v);
+
+struct ctcm_flow_limits {
+    uint32_t size;
+    /* Maximum number of tracked flows, 0 for no limit. When full, a new
+     * flow evicts a least recently used one, preferring half-open
+     * handshakes over established connections. SIDR requests and mappings
+     * are bounded separately by the same number, and refused when full. */
+    uint32_t max_flows;
+    /* Maximum number of flows a single remote IPv4 or IPv6 address (with
+     * its VNI, in overlay builds) may open, 0 for no limit. Flows started by
+     * the local host are not refused. */
+    uint32_t max_flows_per_host;
+};
+
+/* Bound the memory used for tracking flows. Returns 0 on success, or -1 and
+ * sets errno, e.g. when max_flows exceeds the capacity of a
+ * CTCM_CREATE_STATIC context. */
+int ctcm_set_flow_limits(struct ctcm_context *ctcm,
+                         const struct ctcm_flow_limits *limits);
+
+struct ctcm_flow_counters {
+    uint32_t size;
+    /* Flows currently tracked */
+    uint64_t flows;
+    /* Flows evicted to make room for new ones */
+    uint64_t evicted;
+    /* New flows refused because no flow could be evicted */
+    uint64_t refused_full;
+    /* New flows refused because of max_flows_per_host */
+    uint64_t refused_host_quota;
+    /* UD service mappings learned through SIDR */
+    uint64_t sidr_mappings;
+};
+
+int ctcm_get_flow_counters(const struct ctcm_context *ctcm,
+                           struct ctcm_flow_counters *counters);
+
+/* CM packets dropped by CTCM_CREATE_VALIDATE */
+struct ctcm_validation_counters {
+    uint32_t size;
+    /* Truncated, or not carrying exactly one MAD */
+    uint64_t bad_length;
+    /* Unknown BTH transport version, or non-zero pad count */
+    uint64_t bad_bth;
+    /* Not from QP1 with the GSI Q_Key */
+    uint64_t bad_deth;
+    /* Unknown MAD base or class version, or not a Send */
+    uint64_t bad_mad;
+    uint64_t bad_icrc;
+};
+
+int ctcm_get_validation_counters(const struct ctcm_context *ctcm,
+                                 struct ctcm_validation_counters *counters);
+
+/* CM attribute IDs counted by ctcm_stats, from REQ (0x0010) to APR (0x001a) */
+#define CTCM_STATS_ATTR_FIRST 0x0010
+#define CTCM_STATS_ATTRS 11
+
+struct ctcm_stats {
+    uint32_t size;
+    /* CM messages processed, by attribute ID - CTCM_STATS_ATTR_FIRST and by
+     * ctcm_direction */
+    uint64_t packets[CTCM_STATS_ATTRS][2];
+    /* CM messages of other attribute IDs, which the tracker ignores */
+    uint64_t unknown_attr;
+    /* Messages that moved their flow to another state */
+    uint64_t transitions;
+    /* Messages ignored as unexpected in their flow's state */
+    uint64_t unexpected;
+    /* Retransmissions of a message the flow already went past */
+    uint64_t duplicates;
+    /* As in ctcm_flow_counters */
+    uint64_t evicted;
+    uint64_t refused_full;
+    uint64_t refused_host_quota;
+    /* Messages whose comm IDs belong to two flows, or conflict with the
+     * IDs of the flow they were found by */
+    uint64_t id_conflicts;
+    /* Entries that could not be added to the comm ID, QPN or shard tables */
+    uint64_t insert_failures;
+    /* As in ctcm_validation_counters: CM packets failing the checks of
+     * CTCM_CREATE_VALIDATE, and only those. Packets the parser passes over
+     * as not RoCE, not CM, or with truncated headers are not counted. */
+    uint64_t bad_length;
+    uint64_t bad_bth;
+    uint64_t bad_deth;
+    uint64_t bad_mad;
+    uint64_t bad_icrc;
+
+    /* Occupancy of the tables when read, unaffected by ctcm_stats_reset */
+    /* Flows tracked, and those found by local and remote comm ID */
+    uint64_t flows;
+    uint64_t local_ids;
+    uint64_t remote_ids;
+    /* Remote addresses with flows they started */
+    uint64_t remote_hosts;
+    /* Established flows in the QPN tables, which the shards of a sharded
+     * context share */
+    uint64_t qpns;
+    /* Pending SIDR requests and UD service mappings */
+    uint64_t sidr_entries;
+};
+
+/* Read the statistics of ctcm since it was created or last reset. Each lcore
+ * counts its events on its own cache lines, summed here, so the counters cost
+ * processing nothing but the increments. May run on any thread, but not
+ * concurrently with ctcm_stats_reset. Returns 0, or -1 and sets errno. */
+int ctcm_stats_get(const struct ctcm_context *ctcm, struct ctcm_stats *stats);
+/* Restart the event counters of ctcm_stats_get from zero. The counters of
+ * ctcm_get_flow_counters and ctcm_get_validation_counters keep counting. */
+void ctcm_stats_reset(struct ctcm_context *ctcm);
+
 struct ctcm_dynfield_offsets {
     uint32_t size;
     int bth;
@@ -34,7 +251,12 @@ struct ctcm_dynfield_offsets {
 };
 
 /* Return the offsets of the mbuf header offset dynamic fields registered by
- * libconntrack-cm. */
+ * libconntrack-cm.
+ *
+ * The offsets are from the start of the packet data. The headers of a
+ * multi-segment packet may lie past its first segment: the pointers returned by
+ * ctcm_mbuf_get_bth() and ctcm_mbuf_get_mad() are only valid when the first
+ * segment holds the header, otherwise read it with rte_pktmbuf_read(). */
 int ctcm_dynfield_offsets(struct ctcm_context *ctcm,
                           struct ctcm_dynfield_offsets* offsets);
 
@@ -72,7 +294,7 @@ static inline void ctcm_mbuf_set_bth(
 {
     size_t offset = bth ?
         ((char *)bth - rte_pktmbuf_mtod(packet, char *)) : 0;
-    assert(offset < rte_pktmbuf_pkt_len(packet));
+    assert(!offset || offset < rte_pktmbuf_pkt_len(packet));
     *ctcm_mbuf_bth_offset(dynfield_offsets, packet) = (uint16_t)(offset);
 }
 
@@ -96,15 +318,26 @@ static inline void ctcm_mbuf_set_mad(
 {
     size_t offset = mad ?
         ((char *)mad - rte_pktmbuf_mtod(packet, char *)) : 0;
-    assert(offset < rte_pktmbuf_pkt_len(packet));
+    assert(!offset || offset < rte_pktmbuf_pkt_len(packet));
     *ctcm_mbuf_mad_offset(dynfield_offsets, packet) = (uint16_t)(offset);
 }
 
-/* Parse a packet. The packet's l2_len/l3_len needs to be valid.
- * Packets are updated with bth/mad header offset if valid. */
+/* Parse a packet. The packet's l2_len/l3_len/packet_type need to be valid,
+ * unless the context was created with CTCM_CREATE_PARSE_L2. Packets are
+ * updated with bth/mad header offset if valid. The L2/L3 headers must be in
+ * the first segment; the headers past them may span segments. */
 int ctcm_parse_packet(const struct ctcm_context *ctcm,
                        struct rte_mbuf *packet);
 
+#define CTCM_MAX_BURST 64
+
+/* Parse a burst of up to CTCM_MAX_BURST packets, like ctcm_parse_packet.
+ * Bit i of cm_mask is set if packets[i] contains a CM MAD. Returns the
+ * number of CM packets in the burst. */
+int ctcm_parse_burst(const struct ctcm_context *ctcm,
+                     struct rte_mbuf **packets, uint16_t n,
+                     uint64_t *cm_mask);
+
 /* Process a packet. dir determines whether packets are coming from the
  * local interface or the remote one. Requires that the l3 and mad offset fields
  * are valid. */
@@ -113,11 +346,102 @@ int ctcm_process_packet(
     enum ctcm_direction dir,
     const struct rte_mbuf* packet);
 
+/* Parse and process a burst of packets in one pass. Packets need valid
+ * l2_len/l3_len/packet_type as for ctcm_parse_packet, but the BTH / MAD
+ * dynfields are neither read nor updated. Returns the number of CM packets
+ * in the burst. */
+int ctcm_process_burst(struct ctcm_context *ctcm,
+                       enum ctcm_direction dir,
+                       struct rte_mbuf **packets, uint16_t n);
+
+/* A CM packet reduced to what connection tracking needs: the message type,
+ * comm IDs, QPN and timeouts, the remote address and the direction. The
+ * contents are private; events are plain data and may be copied, queued and
+ * replayed. */
+struct ctcm_event {
+    uint64_t opaque[6];
+};
+
+/* Decode packet, parsed with ctcm_parse_packet or ctcm_parse_burst and coming
+ * in direction dir, into ev. The packet is not needed after that, so data
+ * lcores can free it at once and hand ev to the lcore tracking connections,
+ * e.g. through an rte_ring of events (see ctcm_process_ring). May be called
+ * from any thread. Returns 0, or -1 if packet is not a CM packet. */
+int ctcm_make_event(const struct ctcm_context *ctcm, enum ctcm_direction dir,
+                    const struct rte_mbuf *packet, struct ctcm_event *ev);
+
+/* Process n events in order, as ctcm_process_packet would their packets.
+ * Returns n. */
+int ctcm_process_events(struct ctcm_context *ctcm,
+                        const struct ctcm_event *events, unsigned n);
+
+/* Dequeue up to max events from ring, in bursts of CTCM_MAX_BURST, and
+ * process them. ring holds struct ctcm_event elements, i.e. was created with
+ * rte_ring_create_elem(..., sizeof(struct ctcm_event), ...) and filled with
+ * rte_ring_enqueue_burst_elem. Returns the number of events processed. */
+int ctcm_process_ring(struct ctcm_context *ctcm, struct rte_ring *ring,
+                      unsigned max);
+
+/* Advance the flow timers to tsc (an rte_rdtsc() reading) and free up to
+ * budget flows whose handshake or disconnection timed out, or whose time wait
+ * is over. Flow timeouts follow the CM response timeouts in the REQ.
+ * ctcm_process_packet, ctcm_process_burst and the event functions also expire
+ * a few flows on each call; call ctcm_poll when the CM traffic is idle.
+ * Returns the number of flows freed. */
+int ctcm_poll(struct ctcm_context *ctcm, uint64_t tsc, unsigned budget);
+
 /* Return the source QP number for a given flow, determined by the 
  * destination IP and QP number */
 uint32_t ctcm_query_ipv4(const struct ctcm_context *ctcm,
                          in_addr_t dest_ip, uint32_t dqpn);
 
+/* Query the source QP numbers of n flows at once. sqpns[i] is set to the
+ * source QPN of (dest_ips[i], dqpns[i]), or 0 if not found. Returns the
+ * number of flows found. */
+int ctcm_query_ipv4_bulk(const struct ctcm_context *ctcm,
+                         const in_addr_t *dest_ips, const uint32_t *dqpns,
+                         uint32_t *sqpns, unsigned n);
+
+/* Like ctcm_query_ipv4, for flows over IPv6 RoCE v2 */
+uint32_t ctcm_query_ipv6(const struct ctcm_context *ctcm,
+                         const struct in6_addr *dest_ip, uint32_t dqpn);
+
+/* Like ctcm_query_ipv4 and ctcm_query_ipv6, for flows carried over VXLAN or
+ * GENEVE with the given VNI. The plain queries look up VNI 0, i.e. flows
+ * outside of overlays. Builds without the overlay option track overlay flows
+ * by their inner addresses alone, and find only VNI 0 here. */
+uint32_t ctcm_query_vni_ipv4(const struct ctcm_context *ctcm, uint32_t vni,
+                             in_addr_t dest_ip, uint32_t dqpn);
+uint32_t ctcm_query_vni_ipv6(const struct ctcm_context *ctcm, uint32_t vni,
+                             const struct in6_addr *dest_ip, uint32_t dqpn);
+
+/* Like ctcm_query_ipv4_bulk, for flows over IPv6 RoCE v2 */
+int ctcm_query_ipv6_bulk(const struct ctcm_context *ctcm,
+                         const struct in6_addr *dest_ips, const uint32_t *dqpns,
+                         uint32_t *sqpns, unsigned n);
+
+/* The UD service runs on the local host */
+#define CTCM_SIDR_LOCAL_SERVICE (1u << 0)
+
+struct ctcm_sidr_mapping {
+    /* Q_Key of the service */
+    uint32_t qkey;
+    /* CTCM_SIDR_* flags */
+    uint32_t flags;
+};
+
+/* Look up a UD service resolved through a SIDR_REQ/SIDR_REP exchange between
+ * the local host and remote_ip, by the QP number in its SIDR_REP. The service
+ * may run on either side. Mappings expire a minute after the last exchange.
+ * Must be called from the thread processing CM packets. Returns 0 on success,
+ * or -1 and sets errno to ENOENT. */
+int ctcm_query_sidr_ipv4(const struct ctcm_context *ctcm, in_addr_t remote_ip,
+                         uint32_t qpn, struct ctcm_sidr_mapping *mapping);
+
+int ctcm_query_sidr_ipv6(const struct ctcm_context *ctcm,
+                         const struct in6_addr *remote_ip, uint32_t qpn,
+                         struct ctcm_sidr_mapping *mapping);
+
 #define CTCM_UDP_LENGTH 8
 #define CTCM_BTH_LENGTH 12
 #define CTCM_ICRC_LENGTH 4
@@ -130,7 +454,12 @@ uint32_t ctcm_query_ipv4(const struct ctcm_context *ctcm,
 int ctcm_fill_cnp_template(const struct ctcm_context *ctcm,
                            struct rte_mbuf *cnp);
 
-/* Complete a CNP for a specific QP and calculate ICRC. */
+/* Like ctcm_fill_cnp_template, with an IPv6 header (except addresses) */
+int ctcm_fill_cnp_template_ipv6(const struct ctcm_context *ctcm,
+                                struct rte_mbuf *cnp);
+
+/* Complete a CNP for a specific QP and calculate ICRC. The CNP may be IPv4
+ * or IPv6, according to its packet_type. */
 void ctcm_generate_cnp(const struct ctcm_context *ctcm,
                        struct rte_mbuf *cnp,
                        uint32_t dest_qpn);
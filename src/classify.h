@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "parser.h"
+
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include "rxe_hdr.h"
+#include "ib_pack.h"
+#include "ib_mad.h"
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Burst classification of RoCE CM packets.
+ *
+ * Each packet is reduced to a 64-bit signature holding the header fields
+ * parse_packet() branches on. The signatures of a burst are then compared
+ * against the RoCE and CM patterns with vector instructions, so a burst of
+ * data packets is rejected without running the scalar parser on each one.
+ *
+ * Signature layout:
+ *   [15:0]  UDP destination port (network order)
+ *   [23:16] BTH opcode
+ *   [31:24] MAD management class
+ *   [55:32] BTH destination QPN
+ *   [56]    UDP length covers UDP + BTH + ICRC
+ *   [57]    UDP length covers UDP + BTH + DETH + MAD header + ICRC
+ *   [58]    Headers not in the first segment, use the scalar parser
+ */
+
+namespace classify {
+
+constexpr uint64_t SIG_DPORT_MASK = 0xffffull;
+constexpr uint64_t SIG_OPCODE_SHIFT = 16;
+constexpr uint64_t SIG_MGMT_CLASS_SHIFT = 24;
+constexpr uint64_t SIG_QPN_SHIFT = 32;
+constexpr uint64_t SIG_BTH_LEN = 1ull << 56;
+constexpr uint64_t SIG_MAD_LEN = 1ull << 57;
+constexpr uint64_t SIG_SLOW = 1ull << 58;
+
+constexpr uint64_t ROCE_MASK = SIG_DPORT_MASK | SIG_BTH_LEN;
+constexpr uint64_t ROCE_SIG =
+    uint64_t(__builtin_bswap16(UDP_PORT_ROCE_V2)) | SIG_BTH_LEN;
+
+constexpr uint64_t CM_MASK = ROCE_MASK | SIG_MAD_LEN |
+    (0xffull << SIG_OPCODE_SHIFT) |
+    (0xffull << SIG_MGMT_CLASS_SHIFT) |
+    (uint64_t(BTH_QPN_MASK) << SIG_QPN_SHIFT);
+constexpr uint64_t CM_SIG = ROCE_SIG | SIG_MAD_LEN |
+    (uint64_t(IB_OPCODE_UD_SEND_ONLY) << SIG_OPCODE_SHIFT) |
+    (uint64_t(IB_MGMT_CLASS_CM) << SIG_MGMT_CLASS_SHIFT) |
+    (1ull << SIG_QPN_SHIFT);
+
+/* Bytes following the UDP header offset needed to build a signature */
+constexpr size_t WINDOW = sizeof(udphdr) + sizeof(rxe_bth) +
+    sizeof(rxe_deth) + offsetof(ib_mad_hdr, mgmt_class) + 1;
+
+constexpr size_t BTH_UDP_LEN = sizeof(udphdr) + sizeof(rxe_bth) + 4 /* icrc */;
+constexpr size_t MAD_UDP_LEN = BTH_UDP_LEN + sizeof(rxe_deth) +
+    sizeof(ib_mad_hdr);
+
+static inline uint64_t signature(const rte_mbuf *packet)
+{
+    if (!mbuf_is_udp(packet))
+        return 0;
+
+    size_t offset = mbuf_l3_offset(packet) + packet->l3_len;
+    if (unlikely(offset + WINDOW > rte_pktmbuf_data_len(packet)))
+        return SIG_SLOW;
+
+    auto udp = rte_pktmbuf_mtod_offset(packet, const udphdr *, offset);
+    auto bth = reinterpret_cast<const rxe_bth *>(udp + 1);
+    auto mad = reinterpret_cast<const ib_mad_hdr *>(
+        reinterpret_cast<const rxe_deth *>(bth + 1) + 1);
+    size_t len = ntohs(udp->len);
+
+    return uint64_t(udp->uh_dport) |
+        (uint64_t(bth->opcode) << SIG_OPCODE_SHIFT) |
+        (uint64_t(mad->mgmt_class) << SIG_MGMT_CLASS_SHIFT) |
+        (uint64_t(be32toh(bth->qpn) & BTH_QPN_MASK) << SIG_QPN_SHIFT) |
+        (len >= BTH_UDP_LEN ? SIG_BTH_LEN : 0) |
+        (len >= MAD_UDP_LEN ? SIG_MAD_LEN : 0);
+}
+
+struct burst_masks {
+    uint64_t roce = 0;
+    uint64_t cm = 0;
+    uint64_t slow = 0;
+};
+
+static inline void classify_scalar(const uint64_t *sig, unsigned i, unsigned n,
+                                   burst_masks& masks)
+{
+    for (; i < n; ++i) {
+        masks.roce |= uint64_t((sig[i] & ROCE_MASK) == ROCE_SIG) << i;
+        masks.cm |= uint64_t((sig[i] & CM_MASK) == CM_SIG) << i;
+        masks.slow |= uint64_t((sig[i] & SIG_SLOW) != 0) << i;
+    }
+}
+
+/* Classify up to 64 signatures. */
+static inline burst_masks classify_burst(const uint64_t *sig, unsigned n)
+{
+    burst_masks masks;
+    unsigned i = 0;
+
+#if defined(__AVX2__)
+    const __m256i roce_mask = _mm256_set1_epi64x(ROCE_MASK);
+    const __m256i roce_sig = _mm256_set1_epi64x(ROCE_SIG);
+    const __m256i cm_mask = _mm256_set1_epi64x(CM_MASK);
+    const __m256i cm_sig = _mm256_set1_epi64x(CM_SIG);
+    const __m256i slow = _mm256_set1_epi64x(SIG_SLOW);
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(sig + i));
+        __m256i roce = _mm256_cmpeq_epi64(_mm256_and_si256(v, roce_mask), roce_sig);
+        __m256i cm = _mm256_cmpeq_epi64(_mm256_and_si256(v, cm_mask), cm_sig);
+        __m256i s = _mm256_cmpeq_epi64(_mm256_and_si256(v, slow), slow);
+        masks.roce |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(roce))) << i;
+        masks.cm |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(cm))) << i;
+        masks.slow |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(s))) << i;
+    }
+#elif defined(__SSE4_2__)
+    const __m128i roce_mask = _mm_set1_epi64x(ROCE_MASK);
+    const __m128i roce_sig = _mm_set1_epi64x(ROCE_SIG);
+    const __m128i cm_mask = _mm_set1_epi64x(CM_MASK);
+    const __m128i cm_sig = _mm_set1_epi64x(CM_SIG);
+    const __m128i slow = _mm_set1_epi64x(SIG_SLOW);
+
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sig + i));
+        __m128i roce = _mm_cmpeq_epi64(_mm_and_si128(v, roce_mask), roce_sig);
+        __m128i cm = _mm_cmpeq_epi64(_mm_and_si128(v, cm_mask), cm_sig);
+        __m128i s = _mm_cmpeq_epi64(_mm_and_si128(v, slow), slow);
+        masks.roce |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(roce))) << i;
+        masks.cm |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(cm))) << i;
+        masks.slow |= uint64_t(_mm_movemask_pd(_mm_castsi128_pd(s))) << i;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint64x2_t roce_mask = vdupq_n_u64(ROCE_MASK);
+    const uint64x2_t roce_sig = vdupq_n_u64(ROCE_SIG);
+    const uint64x2_t cm_mask = vdupq_n_u64(CM_MASK);
+    const uint64x2_t cm_sig = vdupq_n_u64(CM_SIG);
+    const uint64x2_t slow = vdupq_n_u64(SIG_SLOW);
+
+    for (; i + 2 <= n; i += 2) {
+        uint64x2_t v = vld1q_u64(sig + i);
+        /* Each lane is all-ones or zero; keep one bit per lane. */
+        uint64x2_t roce = vshrq_n_u64(vceqq_u64(vandq_u64(v, roce_mask), roce_sig), 63);
+        uint64x2_t cm = vshrq_n_u64(vceqq_u64(vandq_u64(v, cm_mask), cm_sig), 63);
+        uint64x2_t s = vshrq_n_u64(vandq_u64(v, slow), 58);
+        masks.roce |= (vgetq_lane_u64(roce, 0) | (vgetq_lane_u64(roce, 1) << 1)) << i;
+        masks.cm |= (vgetq_lane_u64(cm, 0) | (vgetq_lane_u64(cm, 1) << 1)) << i;
+        masks.slow |= (vgetq_lane_u64(s, 0) | (vgetq_lane_u64(s, 1) << 1)) << i;
+    }
+#endif
+
+    classify_scalar(sig, i, n, masks);
+    return masks;
+}
+
+/* Classify a burst, skipping the packets not in the candidates mask. */
+static inline burst_masks classify_packets(rte_mbuf *const *packets, unsigned n,
+                                           uint64_t candidates = ~0ull)
+{
+    uint64_t sig[CTCM_MAX_BURST];
+
+    assert(n <= CTCM_MAX_BURST);
+    for (unsigned i = 0; i < n; ++i)
+        sig[i] = (candidates >> i) & 1 ? signature(packets[i]) : 0;
+
+    return classify_burst(sig, n);
+}
+
+} // namespace classify
@@ -9,462 +9,765 @@
 
 #include <boost/current_function.hpp>
 
+#include <rte_cycles.h>
+#include <rte_prefetch.h>
+#include <rte_random.h>
+
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include <algorithm>
+
 const char *flow_state::state_names[] = {
 #define _(r, data, elem) BOOST_PP_STRINGIZE(elem) BOOST_PP_COMMA()
 	BOOST_PP_SEQ_FOR_EACH(_, , FLOW_STATES)
 #undef _
 };
 
-cm_connection_tracker::cm_connection_tracker(parser_context& parser) :
-    parser(parser)
+static unsigned tsc_tick_shift()
 {
-	host_handlers.resize(CM_MAX_ATTR_ID);
-	host_handlers[CM_REQ_ATTR_ID] = std::bind(&cm_connection_tracker::req_sent, this, std::placeholders::_1);
-	host_handlers[CM_REJ_ATTR_ID] = std::bind(&cm_connection_tracker::rej_sent, this, std::placeholders::_1);
-	host_handlers[CM_REP_ATTR_ID] = std::bind(&cm_connection_tracker::rep_sent, this, std::placeholders::_1);
-	host_handlers[CM_RTU_ATTR_ID] = std::bind(&cm_connection_tracker::rtu_sent, this, std::placeholders::_1);
-	host_handlers[CM_DREQ_ATTR_ID] = std::bind(&cm_connection_tracker::dreq_sent, this, std::placeholders::_1);
-	host_handlers[CM_DREP_ATTR_ID] = std::bind(&cm_connection_tracker::drep_sent, this, std::placeholders::_1);
+	uint64_t cycles_per_ms = rte_get_tsc_hz() / 1000;
+	return cycles_per_ms ? 63 - __builtin_clzll(cycles_per_ms) : 0;
+}
 
-	net_handlers.resize(CM_MAX_ATTR_ID);
-	net_handlers[CM_REQ_ATTR_ID] = std::bind(&cm_connection_tracker::req_received, this, std::placeholders::_1);
-	net_handlers[CM_REJ_ATTR_ID] = std::bind(&cm_connection_tracker::rej_received, this, std::placeholders::_1);
-	net_handlers[CM_REP_ATTR_ID] = std::bind(&cm_connection_tracker::rep_received, this, std::placeholders::_1);
-	net_handlers[CM_RTU_ATTR_ID] = std::bind(&cm_connection_tracker::rtu_received, this, std::placeholders::_1);
-	net_handlers[CM_DREQ_ATTR_ID] = std::bind(&cm_connection_tracker::dreq_received, this, std::placeholders::_1);
-	net_handlers[CM_DREP_ATTR_ID] = std::bind(&cm_connection_tracker::drep_received, this, std::placeholders::_1);
+cm_connection_tracker::cm_connection_tracker(parser_context& parser,
+					     std::shared_ptr<qpn_index> qpns,
+					     std::shared_ptr<shard_steering> steering,
+					     unsigned shard, const table_sizing &sizing) :
+    parser(parser),
+    hash_seed(uint32_t(rte_rand())),
+    flows(sizing),
+    local_map(1024, flow_hash(hash_seed), sizing),
+    remote_map(1024, flow_hash(hash_seed), sizing),
+    fixed_capacity(sizing.fixed ? uint32_t(sizing.entries) : 0),
+    host_flows(1024, flow_hash(hash_seed), sizing),
+    sidr(hash_seed, sizing),
+    counters(sizing.socket),
+    tick_shift(tsc_tick_shift()),
+    ns_per_tick(std::max<uint64_t>((1000000000ull << tick_shift) / rte_get_tsc_hz(), 1)),
+    timers(rte_rdtsc() >> tick_shift, sizing),
+    steering(std::move(steering)),
+    shard(shard),
+    qpns(std::move(qpns)),
+    qpn_map(this->qpns->v4),
+    qpn_map6(this->qpns->v6)
+{}
+
+cm_connection_tracker::~cm_connection_tracker()
+{
+	/* The other shards keep using the QPN tables and the steering, take
+	 * this shard's flows out of them */
+	if (!steering)
+		return;
+	for (flow_handle h = 0; h < flows.end(); ++h)
+		if (flows.allocated(h))
+			free_flow(h);
 }
 
-flow_state_ptr cm_connection_tracker::get_flow(id_t local_id, cm_flow_key remote_id)
+flow_ref cm_connection_tracker::get_flow(local_id_t local_id, cm_flow_key remote_id)
 {
-	flow_state_ptr state;
+	flow_handle h;
 
 	assert(local_id || remote_id);
 
-	if (local_id) {
-		auto it = local_map.find(local_id);
+	if (local_id)
+		h = local_map.find(local_id);
+	else
+		h = remote_map.find(remote_id);
 
-		if (it != local_map.end())
-			state = it->second;
-	} else {
-		auto it = remote_map.find(remote_id);
+	if (h == invalid_flow_handle)
+		return add_new_flow(local_id, remote_id);
+
+	flows.hot(h).referenced = true;
+	return ref(h);
+}
 
-		if (it != remote_map.end())
-			state = it->second;
+void cm_connection_tracker::free_flow(flow_handle h)
+{
+	auto state = ref(h);
+	if (state->in_qpn_map)
+		on_disconnected(state);
+	/* Remove the flow by the IDs it was added with, the packet may carry
+	 * only one of them */
+	if (state.ids->local_id) {
+		local_map.erase(state.ids->local_id);
+		if (steering && state.ids->by_remote)
+			steering->disown(state.ids->local_id, shard);
+	}
+	if (state.ids->remote_id) {
+		remote_map.erase(state.ids->remote_id);
+		release_host(state);
 	}
+	timers.cancel(h);
+	flows.free(h);
+}
 
-	if (!state)
-		return add_new_flow(local_id, remote_id);
-	else
-		return state;
+/* Only flows started by the remote host count against its quota, so that
+ * local connections to a host do not lock it out */
+void cm_connection_tracker::charge_host(flow_ref state)
+{
+	if (!state.ids->by_remote)
+		return;
+	flow_handle *host = host_flows.find_value(state.ids->remote_id.addr());
+	if (host)
+		++*host;
+	else if (!host_flows.insert(state.ids->remote_id.addr(), 1))
+		counters.add(stat_insert_failures);
 }
 
-void cm_connection_tracker::erase_flow(id_t local_id, cm_flow_key remote_id)
+void cm_connection_tracker::release_host(flow_ref state)
 {
-	assert(local_id || remote_id);
+	if (!state.ids->by_remote)
+		return;
+	flow_handle *host = host_flows.find_value(state.ids->remote_id.addr());
+	if (host && !--*host)
+		host_flows.erase(state.ids->remote_id.addr());
+}
 
-	auto f = [this, local_id, remote_id](auto &map1, auto &map2, auto id, auto id_other) {
-		auto it = map1.find(id);
-		if (it == map1.end()) {
-			log_debug("Unknown ID erased: 0x%x, 0x%x\n", local_id, remote_id.id());
-		} else {
-			auto state = it->second;
-			if (state->in_qpn_map)
-				on_disconnected(state);
-			map1.erase(it);
-			map2.erase(id_other);
+flow_handle cm_connection_tracker::pick_victim()
+{
+	flow_handle end = flows.end();
+	flow_handle fallback = invalid_flow_handle;
+	unsigned scan = std::min<unsigned>(2 * end, max_eviction_scan);
+
+	/* CLOCK: referenced flows get a second chance. Take the first
+	 * unreferenced half-open flow (or one in time wait), and fall back to
+	 * an established one only if the sweep finds none. */
+	for (unsigned i = 0; i < scan; ++i) {
+		flow_handle h = clock_hand;
+		clock_hand = clock_hand + 1 < end ? clock_hand + 1 : 0;
+
+		if (!flows.allocated(h))
+			continue;
+		flow_state &state = flows.hot(h);
+		if (state.referenced) {
+			state.referenced = false;
+			continue;
 		}
-	};
+		if (state.state != flow_state::ESTABLISHED && !state.in_qpn_map)
+			return h;
+		if (fallback == invalid_flow_handle)
+			fallback = h;
+	}
 
-	if (local_id)
-		f(local_map, remote_map, local_id, remote_id);
-	else
-		f(remote_map, local_map, remote_id, local_id);
+	return fallback;
 }
 
-flow_state_ptr cm_connection_tracker::add_new_flow(id_t local_id, cm_flow_key remote_id)
+flow_handle cm_connection_tracker::alloc_flow(const ip_addr &remote_ip, bool by_remote)
 {
-	log_debug("add_new_flow(0x%x, 0x%x)\n", local_id, remote_id.id());
+	if (by_remote && max_flows_per_host) {
+		const flow_handle *host = host_flows.find_value(remote_ip);
+		if (host && *host >= max_flows_per_host) {
+			char buf[INET6_ADDRSTRLEN];
+			log_debug("Host %s reached its flow quota\n", remote_ip.str(buf));
+			counters.add(stat_refused_host_quota);
+			return invalid_flow_handle;
+		}
+	}
+
+	if (max_flows && flows.size() >= max_flows) {
+		flow_handle victim = pick_victim();
+		if (victim == invalid_flow_handle) {
+			log_debug("%s", "Flow table full\n");
+			counters.add(stat_refused_full);
+			return invalid_flow_handle;
+		}
+		ref(victim).log(BOOST_CURRENT_FUNCTION, " evicted");
+		free_flow(victim);
+		counters.add(stat_evicted);
+	}
+
+	return flows.alloc();
+}
+
+flow_ref cm_connection_tracker::add_new_flow(local_id_t local_id, cm_flow_key remote_id)
+{
+	log_debug("add_new_flow(0x%x, 0x%x)\n", id_t(local_id), remote_id.id());
 
-	auto local_it = local_map.find(local_id);
-	auto remote_it = remote_map.find(remote_id);
+	flow_handle local_h = local_id ? local_map.find(local_id) : invalid_flow_handle;
+	flow_handle remote_h = remote_id ? remote_map.find(remote_id) : invalid_flow_handle;
 
-	flow_state_ptr state;
+	flow_ref state;
 
-	if (local_it != local_map.end() && remote_it != remote_map.end()) {
-		assert(local_it->second == remote_it->second);
-		state = local_it->second;
-		assert(state->local_id == local_id && state->remote_id == remote_id);
+	if (local_h != invalid_flow_handle && remote_h != invalid_flow_handle) {
+		if (unlikely(local_h != remote_h)) {
+			log_debug("%s", "Comm IDs of two different flows\n");
+			counters.add(stat_id_conflicts);
+			return flow_ref();
+		}
+		state = ref(local_h);
+		assert(state.ids->local_id == local_id && state.ids->remote_id == remote_id);
 		log_debug("%s", "Warning: adding an already existing entry\n");
 		return state;
-	} else if (local_it == local_map.end() && remote_it == remote_map.end()) {
+	} else if (local_h == invalid_flow_handle && remote_h == invalid_flow_handle) {
 		assert(local_id || remote_id);
-		state = std::make_shared<flow_state>();
+		flow_handle h = alloc_flow(remote_id.addr(), !local_id);
+		if (h == invalid_flow_handle)
+			return flow_ref();
+		state = ref(h);
+		state.ids->by_remote = !local_id;
+		/* Expire flows whose handshake never starts, e.g. created by
+		 * an unexpected message */
+		set_state(state, flow_state::IDLE);
 		log_debug("%s", "New flow_state{}\n");
-	} else if (local_it != local_map.end()) {
-		state = local_it->second;
+	} else if (local_h != invalid_flow_handle) {
+		state = ref(local_h);
 		log_debug("flow_state in local: local_id 0x%x, remote_id 0x%x\n",
-			state->local_id, state->remote_id.id());
-	} else if (remote_it != remote_map.end()) {
-		state = remote_it->second;
+			id_t(state.ids->local_id), state.ids->remote_id.id());
+	} else {
+		state = ref(remote_h);
 		log_debug("flow_state in remote: local_id 0x%x, remote_id 0x%x\n",
-			state->local_id, state->remote_id.id());
+			id_t(state.ids->local_id), state.ids->remote_id.id());
 	}
 
-	assert(state);
+	/* A flow found by one ID that already has another value for the
+	 * other: a peer reusing a comm ID too early, or a forged message.
+	 * Rekeying the flow would leave its old key behind in the map. */
+	if (unlikely((local_h == invalid_flow_handle && local_id &&
+		      state.ids->local_id) ||
+		     (remote_h == invalid_flow_handle && remote_id &&
+		      state.ids->remote_id))) {
+		log_debug("%s", "Comm IDs conflict with an existing flow\n");
+		counters.add(stat_id_conflicts);
+		return flow_ref();
+	}
 
-	if (local_it == local_map.end() && local_id) {
-		assert(state->local_id == 0);
-		state->local_id = local_id;
-		local_map[local_id] = state;
+	if (local_h == invalid_flow_handle && local_id) {
+		state.ids->local_id = local_id;
+		if (!local_map.insert(local_id, state.handle))
+			counters.add(stat_insert_failures);
+		if (steering && state.ids->by_remote &&
+		    !steering->own(local_id, shard)) {
+			log_debug("%s", "Shard owners table full\n");
+			counters.add(stat_insert_failures);
+		}
 	}
 
-	if (remote_it == remote_map.end() && remote_id) {
-		assert(!state->remote_id);
-		state->remote_id = remote_id;
-		remote_map[remote_id] = state;
+	if (remote_h == invalid_flow_handle && remote_id) {
+		state.ids->remote_id = remote_id;
+		if (!remote_map.insert(remote_id, state.handle))
+			counters.add(stat_insert_failures);
+		charge_host(state);
 	}
 
+	state->referenced = true;
 	return state;
 }
 
-void flow_state::log(const char *func, const char *msg)
+/* CM timeouts are 4.096us * 2^x */
+static uint64_t cm_timeout_ns(uint8_t timeout)
 {
-	log_debug("%s:%s state: %s, IDs: (0x%x, 0x%x), QPNs: (0x%x, 0x%x)\n",
-		func, msg, state_names[state], local_id, remote_id.id(),
-		local_qpn, remote_qpn);
+	return 4096ull << std::min<uint8_t>(timeout, 31);
 }
 
-uint16_t get_attr_id(parser_context& parser, const rte_mbuf *p)
+uint64_t cm_connection_tracker::state_timeout_ns(flow_ref state) const
 {
-	return be16toh(parser.mbuf_mad(p)->attr_id);
-}
+	uint8_t timeout;
+	unsigned retries = state.ids->max_cm_retries + 1;
 
-void cm_connection_tracker::req_sent(const rte_mbuf *p)
-{
-	auto msg = (cm_req_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_REQ_LOCAL_COMM_ID, msg);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
 	switch (state->state) {
-	case flow_state::IDLE:
-	case flow_state::REQ_SENT:
-		state->state = flow_state::REQ_SENT;
-		state->local_qpn = IBA_GET(CM_REQ_LOCAL_QPN, msg);
-		state->log(BOOST_CURRENT_FUNCTION);
+	case flow_state::ESTABLISHED:
+		return 0;
+	case flow_state::TIMEWAIT:
+		timeout = state.ids->ack_timeout;
+		retries = 1;
+		break;
+	case flow_state::REP_SENT:
+	case flow_state::REP_RCVD:
+		timeout = state.ids->rtu_timeout;
+		break;
+	case flow_state::MRA_REQ_SENT:
+	case flow_state::MRA_REQ_RCVD:
+		timeout = std::max(state.ids->rep_timeout, state.ids->mra_timeout);
+		break;
+	case flow_state::MRA_REP_SENT:
+	case flow_state::MRA_REP_RCVD:
+		timeout = std::max(state.ids->rtu_timeout, state.ids->mra_timeout);
+		break;
+	case flow_state::DREQ_SENT:
+	case flow_state::DREQ_RCVD:
+		timeout = std::max(state.ids->rep_timeout, state.ids->rtu_timeout);
 		break;
 	default:
-		log_debug("CM req -> unexpected state: 0x%x\n", state->state);
+		timeout = state.ids->rep_timeout;
 	}
+
+	return std::max(min_flow_timeout_ns, retries * cm_timeout_ns(timeout));
 }
 
-void cm_connection_tracker::req_received(const rte_mbuf *p)
+void cm_connection_tracker::set_state(flow_ref state, flow_state::state_t new_state)
 {
-	auto msg = (cm_req_msg *)parser.mbuf_mad(p);
-	id_t remote_id = IBA_GET(CM_REQ_LOCAL_COMM_ID, msg);
-	auto state = get_flow(0, cm_flow_key::from_src(p, remote_id));
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REQ_RCVD:
-		assert(state->remote_qpn == IBA_GET(CM_REQ_LOCAL_QPN, msg));
-		/* Fallthrough */
-	case flow_state::IDLE:
-		state->state = flow_state::REQ_RCVD;
-		state->remote_qpn = IBA_GET(CM_REQ_LOCAL_QPN, msg);
-		state->log(BOOST_CURRENT_FUNCTION);
-		break;
-	default:
-		log_debug("CM req received -> unexpected state: 0x%x\n", state->state);
-	}
+	state->state = new_state;
+
+	uint64_t timeout = state_timeout_ns(state);
+	if (timeout)
+		timers.schedule(state.handle, timers.now() + timeout / ns_per_tick + 1);
+	else
+		timers.cancel(state.handle);
 }
 
-void cm_connection_tracker::rej_sent(const rte_mbuf *p)
+void cm_connection_tracker::enter_timewait(flow_ref state)
 {
-	auto msg = (cm_rej_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_REJ_LOCAL_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_REJ_REMOTE_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_dest(p, remote_id);
-	auto state = get_flow(local_id, remote_flow);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::IDLE:
-		log_debug("CM[0x%x] rej: warning IDLE state or not found.\n",
-			local_id);
-		/* Fallthrough */
-
-	case flow_state::REQ_RCVD:
-	case flow_state::REQ_SENT:
-	case flow_state::MRA_REQ_RCVD:
-	case flow_state::MRA_REQ_SENT:
-	case flow_state::REP_RCVD:
-	case flow_state::MRA_REP_SENT:
-		erase_flow(local_id, remote_flow);
-		log_debug("CM rej -> IDLE. local ID = 0x%x\n", local_id);
-		break;
+	/* Keep the IDs around to absorb retransmissions, but stop mapping the
+	 * QPs */
+	if (state->in_qpn_map)
+		on_disconnected(state);
+	set_state(state, flow_state::TIMEWAIT);
+}
 
-	case flow_state::REP_SENT:
-	case flow_state::MRA_REP_RCVD:
-		// TODO timewait
-		erase_flow(local_id, remote_flow);
-		log_debug("CM rej -> IDLE. local ID = 0x%x\n", local_id);
-		break;
+void cm_connection_tracker::set_timeouts(flow_ref state, const cm_event &ev)
+{
+	state.ids->rep_timeout = ev.req.rep_timeout;
+	state.ids->rtu_timeout = ev.req.rtu_timeout;
+	state.ids->max_cm_retries = ev.req.max_cm_retries;
+	state.ids->ack_timeout = ev.req.ack_timeout;
+}
 
-	default:
-		log_debug("CM rej -> unexpected state: 0x%x\n", state->state);
-	}
+unsigned cm_connection_tracker::expire_flows(uint64_t tick, unsigned budget)
+{
+	sidr.sweep(uint32_t(tick), sidr_sweep_per_tick);
+	sidr.migrate(table_migrate_per_tick);
+	local_map.migrate(table_migrate_per_tick);
+	remote_map.migrate(table_migrate_per_tick);
+	host_flows.migrate(table_migrate_per_tick);
+	qpn_map.migrate(table_migrate_per_tick);
+	qpn_map6.migrate(table_migrate_per_tick);
+	return timers.advance(tick, budget, [this](flow_handle h) {
+		ref(h).log(BOOST_CURRENT_FUNCTION, " expired");
+		free_flow(h);
+	});
 }
 
-void cm_connection_tracker::rej_received(const rte_mbuf *p)
+void cm_connection_tracker::get_counters(struct ctcm_flow_counters *c) const
 {
-	auto msg = (cm_rej_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_REJ_REMOTE_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_REJ_LOCAL_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_src(p, remote_id);
-	auto state = get_flow(local_id, remote_flow);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::IDLE:
-		log_debug("CM[0x%x] rej received: warning IDLE state or not found.\n",
-			local_id);
-		/* Fallthrough */
+	uint64_t totals[num_stats];
+
+	counters.sum(totals);
+	c->flows = flows.size();
+	c->evicted = totals[stat_evicted];
+	c->refused_full = totals[stat_refused_full];
+	c->refused_host_quota = totals[stat_refused_host_quota];
+	c->sidr_mappings = sidr.mappings();
+}
 
-	case flow_state::REQ_SENT:
-	case flow_state::MRA_REQ_RCVD:
-	case flow_state::REP_SENT:
-	case flow_state::MRA_REP_RCVD:
-		// fallthrough
-	case flow_state::MRA_REQ_SENT:
-		// TODO timewait if stale
-		erase_flow(local_id, remote_flow);
-		log_debug("CM rej received -> IDLE. local ID = 0x%x\n", local_id);
-		break;
+void cm_connection_tracker::get_stats(struct ctcm_stats *s) const
+{
+	uint64_t totals[num_stats];
+
+	counters.sum_since_reset(totals);
+	for (unsigned attr = 0; attr < CTCM_STATS_ATTRS; ++attr)
+		for (unsigned dir = 0; dir < 2; ++dir)
+			s->packets[attr][dir] = totals[stat_packets + 2 * attr + dir];
+	s->unknown_attr = totals[stat_unknown_attr];
+	s->transitions = totals[stat_transitions];
+	s->unexpected = totals[stat_unexpected];
+	s->duplicates = totals[stat_duplicates];
+	s->evicted = totals[stat_evicted];
+	s->refused_full = totals[stat_refused_full];
+	s->refused_host_quota = totals[stat_refused_host_quota];
+	s->id_conflicts = totals[stat_id_conflicts];
+	s->insert_failures = totals[stat_insert_failures];
+
+	s->flows = flows.size();
+	s->local_ids = local_map.size();
+	s->remote_ids = remote_map.size();
+	s->remote_hosts = host_flows.size();
+	s->qpns = qpn_map.size() + qpn_map6.size();
+	s->sidr_entries = sidr.size();
+}
 
-	case flow_state::DREQ_SENT:
-	case flow_state::REP_RCVD:
-	case flow_state::MRA_REP_SENT:
-	case flow_state::ESTABLISHED:
-		// TODO timewait
-		erase_flow(local_id, remote_flow);
-		log_debug("CM rej received -> IDLE. local ID = 0x%x\n", local_id);
-		break;
+void flow_ref::log_state(const char *func, const char *msg) const
+{
+	rte_log(RTE_LOG_DEBUG, CTCM_LOGTYPE, CTCM_PREFIX "%s:%s state: %s, IDs: (0x%x, 0x%x), QPNs: (0x%x, 0x%x)\n",
+		func, msg, flow_state::state_names[hot->state], id_t(ids->local_id),
+		ids->remote_id.id(), hot->local_qpn, hot->remote_qpn);
+}
 
-	default:
-		log_debug("CM rej received -> unexpected state: 0x%x\n", state->state);
+static const char *attr_name(uint16_t attr_id)
+{
+	switch (attr_id) {
+	case CM_REQ_ATTR_ID: return "REQ";
+	case CM_MRA_ATTR_ID: return "MRA";
+	case CM_REJ_ATTR_ID: return "REJ";
+	case CM_REP_ATTR_ID: return "REP";
+	case CM_RTU_ATTR_ID: return "RTU";
+	case CM_DREQ_ATTR_ID: return "DREQ";
+	case CM_DREP_ATTR_ID: return "DREP";
+	case CM_SIDR_REQ_ATTR_ID: return "SIDR_REQ";
+	case CM_SIDR_REP_ATTR_ID: return "SIDR_REP";
+	case CM_LAP_ATTR_ID: return "LAP";
+	case CM_APR_ATTR_ID: return "APR";
+	default: return "unknown";
 	}
 }
 
-void cm_connection_tracker::rep_sent(const rte_mbuf *p)
+cm_event::cm_event(const ib_mad_hdr *mad, const rte_mbuf *p, enum ctcm_direction dir) :
+	attr_id(be16toh(mad->attr_id)), dir(uint8_t(dir)), sidr_rep()
 {
-	auto msg = (cm_rep_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_REP_LOCAL_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_REP_REMOTE_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_dest(p, remote_id);
-	auto state = get_flow(local_id, remote_flow);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REQ_RCVD:
-	case flow_state::MRA_REQ_SENT:
-		state->state = flow_state::REP_SENT;
-		add_new_flow(local_id, remote_flow);
-		state->local_qpn = IBA_GET(CM_REP_LOCAL_QPN, msg);
-		log_debug("CM rep -> REP_SENT. local ID = 0x%x, qpn = 0x%x\n",
-			local_id, state->local_qpn);
+	vni_t vni = ip_addr::qualified ? mbuf_vni(p) : 0;
+	bool from_host = dir == CTCM_FROM_HOST;
+
+	if (mbuf_is_ipv4(p))
+		peer = ip_addr(from_host ? mbuf_ip(p)->daddr : mbuf_ip(p)->saddr, vni);
+	else
+		peer = ip_addr(from_host ? mbuf_ip6(p)->ip6_dst : mbuf_ip6(p)->ip6_src, vni);
+
+	/* All the tracked messages start with the sender's comm ID followed
+	 * by the receiver's comm ID (zero in a REQ, and possibly in a REJ) */
+	auto any = reinterpret_cast<const cm_rej_msg *>(mad);
+	sender_id = IBA_GET(CM_REJ_LOCAL_COMM_ID, any);
+
+	switch (attr_id) {
+	case CM_REQ_ATTR_ID: {
+		auto msg = reinterpret_cast<const cm_req_msg *>(mad);
+		qpn = IBA_GET(CM_REQ_LOCAL_QPN, msg);
+		req.rep_timeout = IBA_GET(CM_REQ_REMOTE_CM_RESPONSE_TIMEOUT, msg);
+		req.rtu_timeout = IBA_GET(CM_REQ_LOCAL_CM_RESPONSE_TIMEOUT, msg);
+		req.max_cm_retries = IBA_GET(CM_REQ_MAX_CM_RETRIES, msg);
+		req.ack_timeout = IBA_GET(CM_REQ_PRIMARY_LOCAL_ACK_TIMEOUT, msg);
+		return;
+	}
+	case CM_SIDR_REQ_ATTR_ID:
+		sender_id = IBA_GET(CM_SIDR_REQ_REQUESTID,
+				    reinterpret_cast<const cm_sidr_req_msg *>(mad));
+		return;
+	case CM_SIDR_REP_ATTR_ID: {
+		auto msg = reinterpret_cast<const cm_sidr_rep_msg *>(mad);
+		sender_id = IBA_GET(CM_SIDR_REP_REQUESTID, msg);
+		qpn = IBA_GET(CM_SIDR_REP_QPN, msg);
+		sidr_rep.q_key = IBA_GET(CM_SIDR_REP_Q_KEY, msg);
+		sidr_rep.status = IBA_GET(CM_SIDR_REP_STATUS, msg);
+		return;
+	}
+	}
+
+	receiver_id = IBA_GET(CM_REJ_REMOTE_COMM_ID, any);
+	switch (attr_id) {
+	case CM_REP_ATTR_ID:
+		qpn = IBA_GET(CM_REP_LOCAL_QPN, reinterpret_cast<const cm_rep_msg *>(mad));
 		break;
-	case flow_state::REP_SENT:
-		log_debug("CM rep -> REP_SENT duplicate. local ID = 0x%x, qpn = 0x%x\n",
-			local_id, state->local_qpn);
+	case CM_MRA_ATTR_ID: {
+		auto msg = reinterpret_cast<const cm_mra_msg *>(mad);
+		responds_to = IBA_GET(CM_MRA_MESSAGE_MRAED, msg);
+		mra_timeout = IBA_GET(CM_MRA_SERVICE_TIMEOUT, msg);
+		break;
+	}
+	case CM_REJ_ATTR_ID:
+		responds_to = IBA_GET(CM_REJ_MESSAGE_REJECTED, any);
 		break;
-	default:
-		log_debug("CM rep -> unexpected state: 0x%x\n", state->state);
 	}
 }
 
-void cm_connection_tracker::rep_received(const rte_mbuf *p)
+/* Returns the local comm ID and the remote flow key of ev */
+static std::pair<local_id_t, cm_flow_key> message_ids(const cm_event &ev)
 {
-	auto msg = (cm_rep_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_REP_REMOTE_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_REP_LOCAL_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_src(p, remote_id);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REQ_SENT:
-	case flow_state::MRA_REQ_RCVD:
-		state->state = flow_state::REP_RCVD;
-		state->remote_qpn = IBA_GET(CM_REP_LOCAL_QPN, msg);
-		add_new_flow(local_id, remote_flow);
-		log_debug("CM rep received -> REP_SENT. local ID = 0x%x, remote ID = 0x%x, local qpn = 0x%x remote qpn = 0x%x\n",
-			local_id, remote_id, state->local_qpn, state->remote_qpn);
-		break;
-	default:
-		log_debug("CM rep received -> unexpected state: 0x%x\n", state->state);
-	}
+	if (ev.direction() == CTCM_FROM_HOST)
+		return {local_key(ev.sender_id, ev.vni()), cm_flow_key(ev.peer, ev.receiver_id)};
+	else
+		return {local_key(ev.receiver_id, ev.vni()), cm_flow_key(ev.peer, ev.sender_id)};
 }
 
-void cm_connection_tracker::rtu_sent(const rte_mbuf *p)
+template <ctcm_direction dir>
+void cm_connection_tracker::update_flow(flow_ref state, const cm_event &ev,
+					local_id_t local_id, cm_flow_key remote_id)
 {
-	auto msg = (cm_rtu_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_RTU_LOCAL_COMM_ID, msg);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REP_RCVD:
-	case flow_state::MRA_REP_SENT:
-		state->state = flow_state::ESTABLISHED;
-		on_established(state);
-		log_debug("CM rtu -> ESTABLISHED. local ID = 0x%x, qpn = 0x%x\n",
-			local_id, state->local_qpn);
+	switch (ev.attr_id) {
+	case CM_REQ_ATTR_ID:
+		set_timeouts(state, ev);
+		if (dir == CTCM_FROM_HOST) {
+			state->local_qpn = ev.qpn;
+		} else {
+			if (state->state == flow_state::REQ_RCVD &&
+			    state->remote_qpn != ev.qpn)
+				log_debug("%s", "REQ retry with a different QPN\n");
+			state->remote_qpn = ev.qpn;
+		}
+		break;
+	case CM_REP_ATTR_ID:
+		if (dir == CTCM_FROM_HOST)
+			state->local_qpn = ev.qpn;
+		else
+			state->remote_qpn = ev.qpn;
+		/* The flow is now known by both comm IDs */
+		add_new_flow(local_id, remote_id);
+		break;
+	case CM_MRA_ATTR_ID:
+		state.ids->mra_timeout = ev.mra_timeout;
+		/* An MRA of a REQ is the first message carrying the
+		 * responder's comm ID */
+		add_new_flow(local_id, remote_id);
 		break;
-	default:
-		log_debug("CM rtu -> unexpected state: 0x%x\n", state->state);
 	}
 }
 
-void cm_connection_tracker::rtu_received(const rte_mbuf *p)
+void cm_connection_tracker::apply(flow_ref state, const cm_event &ev,
+				  cm_transition t)
 {
-	auto msg = (cm_rtu_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_RTU_REMOTE_COMM_ID, msg);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REP_SENT:
-	case flow_state::MRA_REP_RCVD:
-		state->state = flow_state::ESTABLISHED;
+	switch (t.action) {
+	case cm_action::unexpected:
+		log_debug("CM %s -> unexpected state: %s\n", attr_name(ev.attr_id),
+			flow_state::state_names[state->state]);
+		counters.add(stat_unexpected);
+		return;
+	case cm_action::duplicate:
+		log_debug("CM %s duplicate in %s\n", attr_name(ev.attr_id),
+			flow_state::state_names[state->state]);
+		counters.add(stat_duplicates);
+		return;
+	case cm_action::transition:
+		if (state->state != t.next)
+			counters.add(stat_transitions);
+		set_state(state, t.next);
+		break;
+	case cm_action::track:
+		break;
+	case cm_action::establish:
+		set_state(state, t.next);
+		counters.add(stat_transitions);
 		on_established(state);
-		log_debug("CM rtu received -> ESTABLISHED. local ID = 0x%x, qpn = 0x%x\n",
-			local_id, state->local_qpn);
 		break;
-	default:
-		log_debug("CM rtu received -> unexpected state: 0x%x\n", state->state);
+	case cm_action::timewait:
+		enter_timewait(state);
+		counters.add(stat_transitions);
+		break;
+	case cm_action::erase:
+		state.log(BOOST_CURRENT_FUNCTION, " erased");
+		counters.add(stat_transitions);
+		free_flow(state.handle);
+		return;
 	}
+	state.log(attr_name(ev.attr_id));
 }
 
-void cm_connection_tracker::dreq_sent(const rte_mbuf *p)
+template <ctcm_direction dir>
+void cm_connection_tracker::process_sidr(const cm_event &ev)
 {
-	auto msg = (cm_dreq_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_DREQ_LOCAL_COMM_ID, msg);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::IDLE:
-		log_debug("CM[%d] dreq (IDLE): maybe we missed some states?\n",
-			local_id);
-		/* Fallthrough */
-	case flow_state::ESTABLISHED:
-	case flow_state::DREQ_SENT:
-	case flow_state::DREQ_RCVD:
-		state->state = flow_state::DREQ_SENT;
-		log_debug("CM dreq -> DREQ_SENT. local ID = 0x%x\n",
-			local_id);
-		break;
-	default:
-		log_debug("CM dreq -> unexpected state: 0x%x\n", state->state);
+	auto sender = dir == CTCM_FROM_HOST ? sidr_table::local : sidr_table::remote;
+	uint32_t request_id = ev.sender_id;
+	uint32_t now = uint32_t(timers.now());
+
+	if (ev.attr_id == CM_SIDR_REQ_ATTR_ID) {
+		uint32_t expiry = now + uint32_t(sidr_request_timeout_ns / ns_per_tick);
+
+		if (!sidr.add_request(ev.peer, request_id, sender, expiry)) {
+			log_debug("%s", "SIDR table full\n");
+			counters.add(stat_refused_full);
+		}
+		return;
 	}
+
+	uint32_t expiry = now + uint32_t(sidr_lifetime_ns / ns_per_tick);
+
+	if (!sidr.add_reply(ev.peer, request_id, sender, ev.sidr_rep.status == 0,
+			    ev.qpn, ev.sidr_rep.q_key, expiry, now))
+		log_debug("SIDR_REP 0x%x without a request\n", request_id);
 }
 
-void cm_connection_tracker::dreq_received(const rte_mbuf *p)
+bool cm_connection_tracker::get_sidr_mapping(const ip_addr &peer, qpn_t qpn,
+					     sidr_table::mapping &m) const
 {
-	auto msg = (cm_dreq_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_DREQ_REMOTE_COMM_ID, msg);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::REP_SENT:
-	case flow_state::DREQ_SENT:
-	case flow_state::ESTABLISHED:
-	case flow_state::MRA_REP_RCVD:
-	case flow_state::TIMEWAIT:
-	case flow_state::DREQ_RCVD:
-		state->state = flow_state::DREQ_RCVD;
-		log_debug("CM dreq received -> DREQ_RCVD. local ID = 0x%x\n",
-			local_id);
-		break;
-	default:
-		log_debug("CM dreq received -> unexpected state: 0x%x\n", state->state);
+	return sidr.find(peer, qpn, uint32_t(rte_rdtsc() >> tick_shift), m);
+}
+
+template <ctcm_direction dir>
+void cm_connection_tracker::process(const cm_event &ev)
+{
+	uint16_t attr_id = ev.attr_id;
+
+	/* SIDR resolves UD services, outside the connection state machine */
+	if (attr_id == CM_SIDR_REQ_ATTR_ID || attr_id == CM_SIDR_REP_ATTR_ID) {
+		process_sidr<dir>(ev);
+		return;
+	}
+
+	if (unlikely(!cm_transitions.handles(dir, attr_id))) {
+		log_debug("Unknown attr_id received in %s: 0x%x\n",
+			BOOST_CURRENT_FUNCTION, attr_id);
+		counters.add(stat_unknown_attr);
+		return;
 	}
+
+	auto [local_id, remote_id] = message_ids(ev);
+	if (unlikely(!local_id && !remote_id)) {
+		log_debug("%s without comm IDs\n", attr_name(attr_id));
+		return;
+	}
+	auto state = get_flow(local_id, remote_id);
+	if (attr_id == CM_REQ_ATTR_ID && state &&
+	    state->state == flow_state::TIMEWAIT) {
+		/* The sender reused the comm ID, so it is done waiting */
+		free_flow(state.handle);
+		state = get_flow(local_id, remote_id);
+	}
+	if (!state)
+		return;
+	state.log(attr_name(attr_id));
+
+	cm_transition t = cm_transitions.get(dir, attr_id, state->state);
+	if (t.action != cm_action::unexpected && t.action != cm_action::duplicate)
+		update_flow<dir>(state, ev, local_id, remote_id);
+	apply(state, ev, t);
 }
 
-void cm_connection_tracker::drep_sent(const rte_mbuf *p)
+void cm_connection_tracker::process(const cm_event &ev)
 {
-	auto msg = (cm_drep_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_DREP_LOCAL_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_DREP_REMOTE_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_dest(p, remote_id);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-        case flow_state::DREQ_SENT:
-	case flow_state::DREQ_RCVD:
-		// TODO timewait?
-		erase_flow(local_id, remote_flow);
-		log_debug("CM drep -> IDLE. local ID = 0x%x\n",
-			local_id);
+	unsigned attr = unsigned(ev.attr_id - CTCM_STATS_ATTR_FIRST);
+	if (likely(attr < CTCM_STATS_ATTRS))
+		counters.add(stat_packets + 2 * attr + ev.dir);
+
+	switch (ev.direction()) {
+	case CTCM_FROM_HOST:
+		process<CTCM_FROM_HOST>(ev);
+		break;
+	case CTCM_FROM_NET:
+		process<CTCM_FROM_NET>(ev);
 		break;
-	default:
-		log_debug("CM drep -> unexpected state: 0x%x\n", state->state);
 	}
 }
 
-void cm_connection_tracker::drep_received(const rte_mbuf *p)
+void cm_connection_tracker::process(const rte_mbuf *p, enum ctcm_direction dir)
 {
-	auto msg = (cm_drep_msg *)parser.mbuf_mad(p);
-	id_t local_id = IBA_GET(CM_DREP_REMOTE_COMM_ID, msg);
-	id_t remote_id = IBA_GET(CM_DREP_LOCAL_COMM_ID, msg);
-	auto remote_flow = cm_flow_key::from_src(p, remote_id);
-	auto state = get_flow(local_id);
-	state->log(BOOST_CURRENT_FUNCTION);
-	switch (state->state) {
-	case flow_state::DREQ_SENT:
-	case flow_state::DREQ_RCVD:
-		// TODO timewait?
-		erase_flow(local_id, remote_flow);
-		log_debug("CM drep received -> IDLE. local ID = 0x%x\n",
-			local_id);
+	cm_event ev;
+
+	if (make_event(p, dir, ev))
+		process(ev);
+}
+
+bool cm_connection_tracker::make_event(const rte_mbuf *p, enum ctcm_direction dir,
+				       cm_event &ev) const
+{
+	cm_mad_window buf;
+	const ib_mad_hdr *mad = parser.read_mad(p, buf);
+
+	if (!mad)
+		return false;
+	ev = cm_event(mad, p, dir);
+	return true;
+}
+
+int cm_connection_tracker::shard_of(const rte_mbuf *p, enum ctcm_direction dir) const
+{
+	cm_event ev;
+
+	if (!make_event(p, dir, ev))
+		return -1;
+	return steering ? int(steering->shard_of(ev)) : 0;
+}
+
+enum class cm_sender { initiator, responder, unknown };
+
+/* Which side of its flow sent ev, if ev tells: REQs, RTUs and SIDR_REQs come
+ * from the side that started the flow, REPs and SIDR_REPs from the other one,
+ * and MRAs and REJs from either, depending on the message they respond to. */
+static cm_sender message_sender(const cm_event &ev)
+{
+	switch (ev.attr_id) {
+	case CM_REQ_ATTR_ID:
+	case CM_RTU_ATTR_ID:
+	case CM_SIDR_REQ_ATTR_ID:
+		return cm_sender::initiator;
+	case CM_REP_ATTR_ID:
+	case CM_SIDR_REP_ATTR_ID:
+		return cm_sender::responder;
+	case CM_MRA_ATTR_ID:
+	case CM_REJ_ATTR_ID:
 		break;
 	default:
-		log_debug("CM drep received -> unexpected state: 0x%x\n", state->state);
+		return cm_sender::unknown;
+	}
+
+	switch (ev.responds_to) {
+	case CM_MSG_RESPONSE_REQ: return cm_sender::responder;
+	case CM_MSG_RESPONSE_REP: return cm_sender::initiator;
+	default: return cm_sender::unknown;
 	}
 }
 
-void cm_connection_tracker::process_packet(const std::vector<handler> &handlers, const rte_mbuf *p)
+unsigned shard_steering::shard_of(const cm_event &ev) const
 {
-	uint16_t attr_id = get_attr_id(parser, p);
-	handler h;
-	if (attr_id < CM_MAX_ATTR_ID) {
-		h = handlers[attr_id];
-	}
-	if (h) {
-		h(p);
+	cm_sender sender = message_sender(ev);
+	local_id_t local_id;
+	cm_flow_key remote_id;
+
+	if (ev.attr_id == CM_SIDR_REQ_ATTR_ID || ev.attr_id == CM_SIDR_REP_ATTR_ID) {
+		/* Keyed by the requester's ID */
+		local_id = local_key(ev.sender_id, ev.vni());
+		remote_id = cm_flow_key(ev.peer, ev.sender_id);
 	} else {
-		log_debug("Unknown attr_id received in %s: 0x%x\n",
-			BOOST_CURRENT_FUNCTION, attr_id);
-		auto hdr = parser.mbuf_mad(p);
-		log_debug("RoCE MAD packet: \n"
-			"base_version: 0x%x, "
-			"mgmt_class: 0x%x, "
-			"class_version: 0x%x, "
-			"method: 0x%x\n", hdr->base_version, hdr->mgmt_class,
-				hdr->class_version, hdr->method);
+		std::tie(local_id, remote_id) = message_ids(ev);
 	}
+
+	if (sender != cm_sender::unknown) {
+		bool local_initiator = (sender == cm_sender::initiator) ==
+				       (ev.direction() == CTCM_FROM_HOST);
+		if (local_initiator && local_id)
+			return of_local(local_id);
+		if (remote_id)
+			return of_remote(remote_id);
+	}
+	if (local_id) {
+		int owner = owners.find(local_id);
+		return owner >= 0 ? unsigned(owner) : of_local(local_id);
+	}
+	return of_remote(remote_id);
 }
 
-void cm_connection_tracker::process(const rte_mbuf *p, enum ctcm_direction dir)
+void cm_connection_tracker::prefetch_flow(const cm_event &ev) const
 {
-	switch (dir) {
-	case CTCM_FROM_HOST:
-		process_packet(host_handlers, p);
-		break;
-	case CTCM_FROM_NET:
-		process_packet(net_handlers, p);
-		break;
+	/* process() looks the flow up by the local ID if known, and by the
+	 * remote key otherwise */
+	auto [local_id, remote_id] = message_ids(ev);
+
+	if (local_id)
+		local_map.prefetch(local_id);
+	else
+		remote_map.prefetch(remote_id);
+}
+
+void cm_connection_tracker::process_events(const cm_event *events, unsigned n)
+{
+	if (n)
+		prefetch_flow(events[0]);
+	for (unsigned i = 0; i < n; ++i) {
+		if (i + 1 < n)
+			prefetch_flow(events[i + 1]);
+		process(events[i]);
 	}
 }
 
-void cm_connection_tracker::on_established(flow_state_ptr state)
+unsigned cm_connection_tracker::process_burst(rte_mbuf **packets, unsigned n,
+					      enum ctcm_direction dir)
+{
+	const ib_mad_hdr *mads[CTCM_MAX_BURST];
+	/* Only touched for MADs that straddle segments */
+	cm_mad_window bufs[CTCM_MAX_BURST];
+	unsigned cm_packets[CTCM_MAX_BURST];
+	cm_event events[CTCM_MAX_BURST];
+	unsigned count = 0;
+
+	assert(n <= CTCM_MAX_BURST);
+	uint64_t cm = parser.find_cm_burst(packets, n, mads, bufs);
+
+	/* Stage 1: gather the CM packets, and start loading the part of the MAD
+	 * past the comm IDs (QPNs, timeouts) */
+	while (cm) {
+		unsigned i = __builtin_ctzll(cm);
+		cm &= cm - 1;
+		cm_packets[count++] = i;
+		rte_prefetch0(RTE_PTR_ADD(mads[i], RTE_CACHE_LINE_SIZE));
+	}
+
+	/* Stage 2: decode them, then look up the flow of the next event while
+	 * the current one updates its state */
+	for (unsigned i = 0; i < count; ++i)
+		events[i] = cm_event(mads[cm_packets[i]], packets[cm_packets[i]], dir);
+	process_events(events, count);
+
+	return count;
+}
+
+void cm_connection_tracker::on_established(flow_ref state)
 {
 	if (!state->local_qpn || !state->remote_qpn) {
 		log_debug("Bad QPNs local: 0x%x remote: 0x%x\n", state->local_qpn,
@@ -472,21 +775,20 @@ void cm_connection_tracker::on_established(flow_state_ptr state)
 		return;
 	}
 
-	auto [it, inserted] = qpn_map.insert(state->flow_value());
-	(void) it;
-	if (!inserted) {
+	if (!map_qpns(state)) {
 		log_debug("QP already in table: 0x%x\n", state->local_qpn);
+		counters.add(stat_insert_failures);
 		return;
 	}
 
 	state->in_qpn_map = true;
 
-	in_addr remote_ip = in_addr{std::get<0>(state->remote_id)};
+	char buf[INET6_ADDRSTRLEN];
 	log_debug("Established: local: 0x%x, remote: %s:0x%x\n", state->local_qpn,
-		inet_ntoa(remote_ip), state->remote_qpn);
+		state.ids->remote_id.addr().str(buf), state->remote_qpn);
 }
 
-void cm_connection_tracker::on_disconnected(flow_state_ptr state)
+void cm_connection_tracker::on_disconnected(flow_ref state)
 {
 	if (!state->local_qpn || !state->remote_qpn) {
 		log_debug("Bad QPNs local: 0x%x remote: 0x%x\n", state->local_qpn,
@@ -494,7 +796,7 @@ void cm_connection_tracker::on_disconnected(flow_state_ptr state)
 		return;
 	}
 
-	auto erased = qpn_map.erase(state->get_flow_key());
+	auto erased = unmap_qpns(state);
 
 	if (!erased) {
 		log_debug("QP was not in table: 0x%x\n", state->local_qpn);
@@ -506,3 +808,23 @@ void cm_connection_tracker::on_disconnected(flow_state_ptr state)
 	log_debug("Disconnected: local: 0x%x, remote: 0x%x\n", state->local_qpn,
 		state->remote_qpn);
 }
+
+bool cm_connection_tracker::map_qpns(flow_ref state)
+{
+	const ip_addr &remote_ip = state.ids->remote_id.addr();
+
+	if (remote_ip.is_v4())
+		return qpn_map.insert(flow_key(remote_ip.v4_key(), state->remote_qpn),
+				      state->local_qpn);
+	return qpn_map6.insert(flow_key6(remote_ip, state->remote_qpn),
+			       state->local_qpn);
+}
+
+bool cm_connection_tracker::unmap_qpns(flow_ref state)
+{
+	const ip_addr &remote_ip = state.ids->remote_id.addr();
+
+	if (remote_ip.is_v4())
+		return qpn_map.erase(flow_key(remote_ip.v4_key(), state->remote_qpn));
+	return qpn_map6.erase(flow_key6(remote_ip, state->remote_qpn));
+}
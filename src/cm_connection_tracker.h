@@ -8,22 +8,45 @@
 #include "parser.h"
 
 #include "ib_cm.h"
+#include "ib_mad.h"
+#include "flow_slab.h"
+#include "flow_table.h"
+#include "ip_addr.h"
+#include "lcore_counters.h"
+#include "logging.h"
+#include "owner_table.h"
+#include "qpn_table.h"
+#include "sidr_table.h"
+#include "timer_wheel.h"
 
 #include <netinet/ip.h>
+#include <netinet/ip6.h>
 
-#include <unordered_map>
-#include <tuple>
-#include <functional>
-#include <vector>
+#include <initializer_list>
 #include <memory>
+#include <tuple>
 
 #include <boost/preprocessor.hpp>
-#include <boost/functional/hash.hpp>
 
 typedef uint32_t id_t;
-typedef uint32_t qpn_t;
-typedef std::tuple<in_addr_t, qpn_t> flow_key; /* Dest IP, Dest QPN */
-typedef std::unordered_map<flow_key, qpn_t, boost::hash<flow_key>> qpn_map_t;
+
+/* The key of a flow by its local comm ID, 0 if unknown. Overlay builds track
+ * the hosts of several virtual networks, whose comm IDs may collide, so the
+ * key also holds the VNI there. */
+#ifdef CTCM_OVERLAY
+typedef uint64_t local_id_t;
+#else
+typedef id_t local_id_t;
+#endif
+
+static inline local_id_t local_key(id_t id, [[maybe_unused]] vni_t vni)
+{
+#ifdef CTCM_OVERLAY
+	return id ? uint64_t(vni) << 32 | id : 0;
+#else
+	return id;
+#endif
+}
 
 #define FLOW_STATES \
 	(IDLE) \
@@ -40,108 +63,518 @@ typedef std::unordered_map<flow_key, qpn_t, boost::hash<flow_key>> qpn_map_t;
 	(DREQ_RCVD) \
 	(TIMEWAIT)
 
-using cm_flow_key_base = std::tuple<in_addr_t, id_t>;
+/* A CM message reduced to the fields the tracker uses. Decoded from the
+ * packet once, so that it can be processed after the packet is gone, on
+ * another thread, see ctcm_make_event. */
+struct cm_event
+{
+	cm_event() : sidr_rep() {}
+	cm_event(const ib_mad_hdr *mad, const rte_mbuf *p, enum ctcm_direction dir);
+
+	/* The remote side's address */
+	ip_addr peer;
+	/* The comm IDs of the sender and the receiver, 0 if the message does
+	 * not carry it. SIDR messages carry their request ID as sender_id. */
+	id_t sender_id = 0;
+	id_t receiver_id = 0;
+	/* The sender's QPN in a REQ or REP, the service QPN in a SIDR_REP */
+	qpn_t qpn = 0;
+	uint16_t attr_id = 0;
+	uint8_t dir = CTCM_FROM_HOST;
+	/* The message an MRA or a REJ responds to, CM_MSG_RESPONSE_* */
+	uint8_t responds_to = CM_MSG_RESPONSE_OTHER;
+	union {
+		struct {
+			uint8_t rep_timeout;
+			uint8_t rtu_timeout;
+			uint8_t max_cm_retries;
+			uint8_t ack_timeout;
+		} req;
+		/* MRA service timeout */
+		uint8_t mra_timeout;
+		struct {
+			uint32_t q_key;
+			uint8_t status;
+		} sidr_rep;
+	};
+
+	ctcm_direction direction() const { return ctcm_direction(dir); }
+	vni_t vni() const { return peer.get_vni(); }
+};
+
+using cm_flow_key_base = std::tuple<ip_addr, id_t>;
 
 struct cm_flow_key : public cm_flow_key_base
 {
 	cm_flow_key() {}
 	cm_flow_key(const cm_flow_key_base &base) : cm_flow_key_base(base) {}
-	operator bool() const { return std::get<0>(*this) && std::get<1>(*this); }
+	operator bool() const { return bool(std::get<0>(*this)) && std::get<1>(*this); }
 
-	in_addr_t addr() const { return std::get<0>(*this); }
+	const ip_addr &addr() const { return std::get<0>(*this); }
 	id_t id() const { return std::get<1>(*this); }
 
-	static cm_flow_key from_dest(const rte_mbuf *p, id_t remote_id) {
-		return std::make_tuple(mbuf_ip(p)->daddr, remote_id);
-	}
+	cm_flow_key(const ip_addr &addr, id_t id) : cm_flow_key_base(addr, id) {}
+};
 
-	static cm_flow_key from_src(const rte_mbuf *p, id_t remote_id) {
-		return std::make_tuple(mbuf_ip(p)->saddr, remote_id);
-	}
+struct flow_hash : seeded_hash
+{
+	using seeded_hash::seeded_hash;
+
+	uint32_t operator()(id_t id) const
+	{ return hash_mix32(rte_hash_crc_4byte(id, seed)); }
+
+	uint32_t operator()(uint64_t id) const
+	{ return hash_mix32(rte_hash_crc_8byte(id, seed)); }
+
+	uint32_t operator()(const ip_addr &addr) const
+	{ return hash_mix32(addr.crc(seed)); }
+
+	uint32_t operator()(const cm_flow_key &key) const
+	{ return hash_mix32(rte_hash_crc_4byte(key.id(), key.addr().crc(seed))); }
+};
+
+/* Assigns the flows of a sharded context to its shards, and CM messages to
+ * the shard of their flow.
+ *
+ * A flow belongs to the shard its initiator's ID hashes to: its local comm ID
+ * if the local host started it, and the remote address and comm ID
+ * otherwise. Handshake messages tell which side sent them, and so which side
+ * started the flow. Those of established connections (DREQ, DREP, LAP, APR)
+ * do not, so the shards record the local comm IDs of the flows that remote
+ * hosts started in owners, and the other messages go to the shard of their
+ * local comm ID. */
+class shard_steering
+{
+public:
+	shard_steering(unsigned shards, uint32_t seed, int socket = heap_socket) :
+		shards(shards), hash(seed), owners(seed, socket)
+	{}
+
+	unsigned shard_of(const cm_event &ev) const;
+
+	/* Record the local ID of a flow a remote host started. Returns false
+	 * if there is no room for it. */
+	bool own(local_id_t local_id, unsigned shard)
+	{ return owners.insert(local_id, shard); }
+
+	void disown(local_id_t local_id, unsigned shard)
+	{ owners.erase(local_id, shard); }
+
+private:
+	unsigned shards;
+	flow_hash hash;
+	owner_table owners;
+
+	unsigned scale(uint32_t h) const { return unsigned(uint64_t(h) * shards >> 32); }
+	unsigned of_local(local_id_t local_id) const { return scale(hash(local_id)); }
+	unsigned of_remote(const cm_flow_key &remote_id) const { return scale(hash(remote_id)); }
 };
 
-struct flow_state
+/* Flow fields looked at on every packet */
+struct alignas(16) flow_state
 {
 	flow_state() {}
 
-	enum {
+	enum state_t : uint8_t {
 	    BOOST_PP_SEQ_ENUM(FLOW_STATES)
 	} state = IDLE;
 
 	static const char *state_names[];
 
-	id_t local_id = 0;
-	cm_flow_key remote_id = cm_flow_key();
+	bool in_qpn_map = false;
+	/* Set when the flow is looked up, cleared by the eviction sweep */
+	bool referenced = false;
 	qpn_t local_qpn = 0;
 	qpn_t remote_qpn = 0;
+};
 
-	bool in_qpn_map = false;
+/* What a CM message does to a flow in a given state */
+enum class cm_action : uint8_t {
+	unexpected,	/* Not valid in this state, ignored */
+	duplicate,	/* A retransmission, ignored */
+	transition,	/* Move to the next state */
+	track,		/* Valid, the state does not change */
+	establish,	/* Move to the next state and map the QPs */
+	timewait,	/* Unmap the QPs and wait for stray messages */
+	erase,		/* Free the flow */
+};
+
+struct cm_transition
+{
+	flow_state::state_t next = flow_state::IDLE;
+	cm_action action = cm_action::unexpected;
+};
+
+/* The connection state machine, indexed by message direction, attribute ID
+ * and current state. Built at compile time, so that process<dir>() reduces
+ * to a table load, and can be inspected by tests and tracing. */
+class cm_transition_table
+{
+public:
+	static constexpr unsigned num_states = BOOST_PP_SEQ_SIZE(FLOW_STATES);
+	using state_t = flow_state::state_t;
+
+	constexpr cm_transition_table()
+	{
+		using s = flow_state;
+		const auto host = CTCM_FROM_HOST, net = CTCM_FROM_NET;
+
+		add(host, CM_REQ_ATTR_ID, {s::IDLE, s::REQ_SENT},
+		    s::REQ_SENT, cm_action::transition);
+		add(host, CM_REQ_ATTR_ID, {s::MRA_REQ_RCVD},
+		    s::MRA_REQ_RCVD, cm_action::duplicate);
+		add(net, CM_REQ_ATTR_ID, {s::IDLE, s::REQ_RCVD},
+		    s::REQ_RCVD, cm_action::transition);
+		add(net, CM_REQ_ATTR_ID, {s::MRA_REQ_SENT},
+		    s::MRA_REQ_SENT, cm_action::duplicate);
+
+		/* An MRA asks the peer to wait longer for the reply. The
+		 * state tells which message it acknowledges: a REQ, a REP, or
+		 * a LAP on an established connection. Repeated MRAs restart
+		 * the wait. */
+		add(host, CM_MRA_ATTR_ID, {s::REQ_RCVD, s::MRA_REQ_SENT},
+		    s::MRA_REQ_SENT, cm_action::transition);
+		add(host, CM_MRA_ATTR_ID, {s::REP_RCVD, s::MRA_REP_SENT},
+		    s::MRA_REP_SENT, cm_action::transition);
+		add(host, CM_MRA_ATTR_ID, {s::ESTABLISHED},
+		    s::ESTABLISHED, cm_action::track);
+		add(net, CM_MRA_ATTR_ID, {s::REQ_SENT, s::MRA_REQ_RCVD},
+		    s::MRA_REQ_RCVD, cm_action::transition);
+		add(net, CM_MRA_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD},
+		    s::MRA_REP_RCVD, cm_action::transition);
+		add(net, CM_MRA_ATTR_ID, {s::ESTABLISHED},
+		    s::ESTABLISHED, cm_action::track);
+
+		add(host, CM_REJ_ATTR_ID, {s::IDLE, s::REQ_RCVD, s::REQ_SENT,
+		    s::MRA_REQ_RCVD, s::MRA_REQ_SENT, s::REP_RCVD,
+		    s::MRA_REP_SENT}, s::IDLE, cm_action::erase);
+		add(host, CM_REJ_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD},
+		    s::TIMEWAIT, cm_action::timewait);
+		add(net, CM_REJ_ATTR_ID, {s::IDLE, s::REQ_SENT, s::MRA_REQ_RCVD,
+		    s::REP_SENT, s::MRA_REP_RCVD, s::MRA_REQ_SENT},
+		    s::IDLE, cm_action::erase);
+		add(net, CM_REJ_ATTR_ID, {s::DREQ_SENT, s::REP_RCVD,
+		    s::MRA_REP_SENT, s::ESTABLISHED},
+		    s::TIMEWAIT, cm_action::timewait);
+
+		add(host, CM_REP_ATTR_ID, {s::REQ_RCVD, s::MRA_REQ_SENT},
+		    s::REP_SENT, cm_action::transition);
+		add(host, CM_REP_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD},
+		    s::REP_SENT, cm_action::duplicate);
+		add(net, CM_REP_ATTR_ID, {s::REQ_SENT, s::MRA_REQ_RCVD},
+		    s::REP_RCVD, cm_action::transition);
+		add(net, CM_REP_ATTR_ID, {s::MRA_REP_SENT},
+		    s::MRA_REP_SENT, cm_action::duplicate);
+
+		add(host, CM_RTU_ATTR_ID, {s::REP_RCVD, s::MRA_REP_SENT},
+		    s::ESTABLISHED, cm_action::establish);
+		add(net, CM_RTU_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD},
+		    s::ESTABLISHED, cm_action::establish);
+
+		add(host, CM_DREQ_ATTR_ID, {s::IDLE, s::ESTABLISHED,
+		    s::DREQ_SENT, s::DREQ_RCVD},
+		    s::DREQ_SENT, cm_action::transition);
+		add(net, CM_DREQ_ATTR_ID, {s::REP_SENT, s::DREQ_SENT,
+		    s::ESTABLISHED, s::MRA_REP_RCVD, s::TIMEWAIT, s::DREQ_RCVD},
+		    s::DREQ_RCVD, cm_action::transition);
+
+		add(host, CM_DREP_ATTR_ID, {s::DREQ_SENT, s::DREQ_RCVD},
+		    s::TIMEWAIT, cm_action::timewait);
+		add(net, CM_DREP_ATTR_ID, {s::DREQ_SENT, s::DREQ_RCVD},
+		    s::TIMEWAIT, cm_action::timewait);
+
+		/* Loading an alternate path keeps the QPs, and so the
+		 * tracked flow, as they are */
+		for (auto dir : {host, net}) {
+			add(dir, CM_LAP_ATTR_ID, {s::ESTABLISHED},
+			    s::ESTABLISHED, cm_action::track);
+			add(dir, CM_APR_ATTR_ID, {s::ESTABLISHED},
+			    s::ESTABLISHED, cm_action::track);
+		}
+	}
+
+	constexpr cm_transition get(ctcm_direction dir, uint16_t attr_id,
+				    state_t state) const
+	{
+		return table[dir][attr_id][state];
+	}
+
+	/* Whether messages with attr_id are tracked at all */
+	constexpr bool handles(ctcm_direction dir, uint16_t attr_id) const
+	{
+		return attr_id < CM_MAX_ATTR_ID && handled[dir][attr_id];
+	}
 
-	auto get_cm_flow_key() const
-	{ return remote_id; }
+private:
+	cm_transition table[2][CM_MAX_ATTR_ID][num_states] = {};
+	bool handled[2][CM_MAX_ATTR_ID] = {};
 
-	auto get_flow_key() const
+	constexpr void add(ctcm_direction dir, uint16_t attr_id,
+			   std::initializer_list<state_t> from, state_t next,
+			   cm_action action)
 	{
-		auto remote_ip = std::get<0>(remote_id);
-		return std::make_tuple(remote_ip, remote_qpn);
+		for (state_t state : from)
+			table[dir][attr_id][state] = cm_transition{next, action};
+		handled[dir][attr_id] = true;
 	}
+};
 
-	auto flow_value() const
-	{ return qpn_map_t::value_type(get_flow_key(), local_qpn); }
+static constexpr cm_transition_table cm_transitions;
 
-	void log(const char *func, const char *msg = "");
+/* CM timeouts are encoded as 4.096us * 2^x. These defaults, used until the
+ * REQ of a flow is seen, match the Linux RDMA CM. */
+static constexpr uint8_t default_cm_response_timeout = 20;
+static constexpr uint8_t default_max_cm_retries = 15;
+static constexpr uint8_t default_ack_timeout = 18;
+
+/* Flow fields only used when adding or removing a flow */
+struct flow_ids
+{
+	local_id_t local_id = 0;
+	cm_flow_key remote_id = cm_flow_key();
+	/* Added by its remote ID first, i.e. started by the remote host */
+	bool by_remote = false;
+
+	/* Timeouts from the REQ, used to expire the flow if the handshake or
+	 * the disconnection stalls */
+	uint8_t rep_timeout = default_cm_response_timeout;
+	uint8_t rtu_timeout = default_cm_response_timeout;
+	uint8_t max_cm_retries = default_max_cm_retries;
+	uint8_t ack_timeout = default_ack_timeout;
+	/* Service timeout of the last MRA */
+	uint8_t mra_timeout = 0;
 };
 
-using flow_state_ptr = std::shared_ptr<flow_state>;
+/* A flow in the tracker's slab */
+struct flow_ref
+{
+	flow_handle handle = invalid_flow_handle;
+	flow_state *hot = nullptr;
+	flow_ids *ids = nullptr;
+
+	flow_state *operator->() const { return hot; }
+
+	/* False if the flow could not be added */
+	explicit operator bool() const { return hot; }
+
+	/* Log the flow's state at debug level. Does not touch the flow
+	 * unless that level is logged. */
+	void log(const char *func, const char *msg = "") const
+	{
+		if (log_enabled(RTE_LOG_DEBUG))
+			log_state(func, msg);
+	}
+
+private:
+	void log_state(const char *func, const char *msg) const;
+};
 
 class cm_connection_tracker
 {
 public:
-	cm_connection_tracker(parser_context& parser);
+	/* Trackers of a sharded context share qpns and steering, and are
+	 * told their shard number. The tables are sized and placed by sizing;
+	 * fixed ones track at most sizing.entries flows. */
+	cm_connection_tracker(parser_context& parser, std::shared_ptr<qpn_index> qpns,
+			      std::shared_ptr<shard_steering> steering = nullptr,
+			      unsigned shard = 0,
+			      const table_sizing &sizing = table_sizing());
+	~cm_connection_tracker();
+
+	cm_connection_tracker(const cm_connection_tracker &) = delete;
+	cm_connection_tracker &operator=(const cm_connection_tracker &) = delete;
 
 	void process(const rte_mbuf *p, enum ctcm_direction dir);
+	void process(const cm_event &ev);
+	/* Process events in order, looking up the flow of each while the
+	 * previous one is processed */
+	void process_events(const cm_event *events, unsigned n);
+
+	/* Decode the CM packet p into ev. Returns false if p is not a CM
+	 * packet. May be called from any thread. */
+	bool make_event(const rte_mbuf *p, enum ctcm_direction dir, cm_event &ev) const;
 
-	qpn_t get_source_qpn(flow_key flow) const
+	/* Parse and process a burst of packets without going through the mbuf
+	 * dynfields. Returns the number of CM packets. */
+	unsigned process_burst(rte_mbuf **packets, unsigned n,
+			       enum ctcm_direction dir);
+
+	qpn_t get_source_qpn(const flow_key &flow) const
 	{
-		auto it = qpn_map.find(flow);
-		if (it != qpn_map.end())
-			return it->second;
-		else
-			return 0;
+		return qpn_map.find(flow);
 	}
 
-private:
-        parser_context &parser;
-	std::unordered_map<id_t, flow_state_ptr> local_map;
-	std::unordered_map<cm_flow_key, flow_state_ptr, boost::hash<cm_flow_key>> remote_map;
+	qpn_t get_source_qpn(const flow_key6 &flow) const
+	{
+		return qpn_map6.find(flow);
+	}
 
-	flow_state_ptr get_flow(id_t local_id, cm_flow_key remote_id = cm_flow_key());
-	void erase_flow(id_t local_id, cm_flow_key remote_id = cm_flow_key());
-	flow_state_ptr add_new_flow(id_t local_id, cm_flow_key remote_id = cm_flow_key());
+	unsigned get_source_qpn_bulk(const ip4_addr *ips, const qpn_t *qpns,
+				     qpn_t *out, unsigned n) const
+	{
+		return qpn_map.find_bulk(ips, qpns, out, n);
+	}
 
-	void on_established(flow_state_ptr state);
-	void on_disconnected(flow_state_ptr state);
+	unsigned get_source_qpn_bulk(const ip_addr *ips, const qpn_t *qpns,
+				     qpn_t *out, unsigned n) const
+	{
+		return qpn_map6.find_bulk(ips, qpns, out, n);
+	}
 
-	void req_sent(const rte_mbuf *);
-	void rej_sent(const rte_mbuf *);
-	void rep_sent(const rte_mbuf *);
-	void rtu_sent(const rte_mbuf *);
-	void dreq_sent(const rte_mbuf *);
-	void drep_sent(const rte_mbuf *);
+	/* The shard that processes the CM packet p, 0 if not sharded, or -1 if
+	 * p is not a CM packet. May be called from any thread. */
+	int shard_of(const rte_mbuf *p, enum ctcm_direction dir) const;
 
-	void req_received(const rte_mbuf *);
-	void rej_received(const rte_mbuf *);
-	void rep_received(const rte_mbuf *);
-	void rtu_received(const rte_mbuf *);
-	void dreq_received(const rte_mbuf *);
-	void drep_received(const rte_mbuf *);
+	/* Find a UD service resolved through SIDR with peer. Only valid on the
+	 * thread processing packets. */
+	bool get_sidr_mapping(const ip_addr &peer, qpn_t qpn,
+			      sidr_table::mapping &m) const;
 
-	using handler = std::function<void(const rte_mbuf *)>;
+	int rcu_qsbr_add(rte_rcu_qsbr *v)
+	{
+		if (qpn_map.rcu_qsbr_add(v))
+			return -1;
+		return qpn_map6.rcu_qsbr_add(v);
+	}
 
-	std::vector<handler> host_handlers;
-	std::vector<handler> net_handlers;
+	/* Advance the flow timers to tsc, freeing up to budget flows whose
+	 * handshake, disconnection or time wait has timed out. Returns the
+	 * number of flows freed. */
+	unsigned expire(uint64_t tsc, unsigned budget)
+	{
+		uint64_t tick = tsc >> tick_shift;
+		if (likely(tick < timers.now()))
+			return 0;
+		return expire_flows(tick, budget);
+	}
+
+	/* Returns false if the tables are fixed, and max is 0 or more flows
+	 * than they hold */
+	bool set_limits(uint32_t max, uint32_t max_per_host)
+	{
+		if (fixed_capacity && (!max || max > fixed_capacity))
+			return false;
+		max_flows = max;
+		max_flows_per_host = max_per_host;
+		sidr.set_limit(max);
+		return true;
+	}
 
-	void process_packet(const std::vector<handler> &handlers, const rte_mbuf *p);
+	void get_counters(struct ctcm_flow_counters *c) const;
+	/* Fill in the tracker's statistics since reset_stats() */
+	void get_stats(struct ctcm_stats *s) const;
+	void reset_stats() { counters.reset(); }
 
-	qpn_map_t qpn_map;
+	/* Flows expired per processed packet, to bound its latency */
+	static constexpr unsigned packet_expire_budget = 8;
+
+	/* Never expire a flow sooner than this, whatever the REQ says, so the
+	 * endpoints give up first */
+	static constexpr uint64_t min_flow_timeout_ns = 1000000000ull;
+
+	/* How long to wait for the SIDR_REP of a SIDR_REQ, and to keep the
+	 * service mapping after it */
+	static constexpr uint64_t sidr_request_timeout_ns = min_flow_timeout_ns;
+	static constexpr uint64_t sidr_lifetime_ns = 60 * 1000000000ull;
+
+private:
+        parser_context &parser;
+	/* Random per context, so that other hosts cannot predict which of
+	 * their comm IDs or QPNs collide in the tables */
+	uint32_t hash_seed;
+	flow_slab<flow_state, flow_ids> flows;
+	flow_table<local_id_t, flow_hash> local_map;
+	flow_table<cm_flow_key, flow_hash> remote_map;
+
+	flow_ref ref(flow_handle h)
+	{ return flow_ref{h, &flows.hot(h), &flows.cold(h)}; }
+
+	flow_ref get_flow(local_id_t local_id, cm_flow_key remote_id = cm_flow_key());
+	flow_ref add_new_flow(local_id_t local_id, cm_flow_key remote_id = cm_flow_key());
+	void free_flow(flow_handle h);
+
+	/* Allocate a flow, evicting one if the tracker is full. by_remote is
+	 * set for flows started by a remote host, subject to its quota.
+	 * Returns invalid_flow_handle if the flow is refused. */
+	flow_handle alloc_flow(const ip_addr &remote_ip, bool by_remote);
+	flow_handle pick_victim();
+	/* Count a flow in host_flows when its remote ID is added or removed */
+	void charge_host(flow_ref state);
+	void release_host(flow_ref state);
+
+	uint32_t max_flows = 0;
+	uint32_t max_flows_per_host = 0;
+	/* Flows the tables were sized for if they never grow, or 0 */
+	uint32_t fixed_capacity;
+	/* CLOCK hand of the eviction sweep */
+	flow_handle clock_hand = 0;
+	/* Number of flows started by each remote IP */
+	flow_table<ip_addr, flow_hash> host_flows;
+
+	/* Sweep at most this many flows looking for a victim */
+	static constexpr unsigned max_eviction_scan = 1024;
+
+	sidr_table sidr;
+	/* SIDR entries checked for expiry on every timer tick */
+	static constexpr unsigned sidr_sweep_per_tick = 64;
+	/* Slots of each table migrated on every timer tick, so that tables
+	 * finish shrinking when idle */
+	static constexpr uint32_t table_migrate_per_tick = 64;
+
+	/* Event counters, see struct ctcm_stats */
+	enum stat : unsigned {
+		/* By attribute index and direction */
+		stat_packets,
+		stat_unknown_attr = stat_packets + 2 * CTCM_STATS_ATTRS,
+		stat_transitions,
+		stat_unexpected,
+		stat_duplicates,
+		stat_evicted,
+		stat_refused_full,
+		stat_refused_host_quota,
+		stat_id_conflicts,
+		stat_insert_failures,
+		num_stats,
+	};
+	lcore_counters<num_stats> counters;
+
+	/* Flow timers count ticks of 2^tick_shift TSC cycles, about a
+	 * millisecond */
+	unsigned tick_shift;
+	uint64_t ns_per_tick;
+	timer_wheel timers;
+
+	/* Move a flow to a new state and arm the timer for it */
+	void set_state(flow_ref state, flow_state::state_t new_state);
+	void enter_timewait(flow_ref state);
+	void set_timeouts(flow_ref state, const cm_event &ev);
+	uint64_t state_timeout_ns(flow_ref state) const;
+	unsigned expire_flows(uint64_t tick, unsigned budget);
+
+	void on_established(flow_ref state);
+	void on_disconnected(flow_ref state);
+	/* Add or remove the flow in the QPN table of its address family */
+	bool map_qpns(flow_ref state);
+	bool unmap_qpns(flow_ref state);
+
+	template <ctcm_direction dir>
+	void process(const cm_event &ev);
+	template <ctcm_direction dir>
+	void process_sidr(const cm_event &ev);
+
+	/* Message fields updated on a valid transition */
+	template <ctcm_direction dir>
+	void update_flow(flow_ref state, const cm_event &ev, local_id_t local_id,
+			 cm_flow_key remote_id);
+	void apply(flow_ref state, const cm_event &ev, cm_transition t);
+
+	/* Prefetch the table entry process() is going to look up for ev */
+	void prefetch_flow(const cm_event &ev) const;
+
+	std::shared_ptr<shard_steering> steering;
+	unsigned shard;
+
+	std::shared_ptr<qpn_index> qpns;
+	qpn_table4 &qpn_map;
+	qpn_table6 &qpn_map6;
 };
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_table.h"
+
+#include "numa_allocator.h"
+
+#include <algorithm>
+
+/* Flow storage addressed by 32-bit handles.
+ *
+ * Flows are allocated from fixed-size chunks that never move, so a handle
+ * stays valid until the flow is freed. The fields needed on every packet
+ * (Hot) and those only needed when adding or removing a flow (Cold) are kept
+ * in separate arrays, so that a lookup touches a single cache line. A bitmap
+ * of the allocated handles lets the owner sweep over the live flows. */
+template <typename Hot, typename Cold>
+class flow_slab
+{
+public:
+	static constexpr unsigned chunk_shift = 12;
+	static constexpr uint32_t chunk_size = 1u << chunk_shift;
+
+	/* Allocates room for sizing.entries flows up front, at least one
+	 * chunk. Only allocates again when more flows than that are live. */
+	explicit flow_slab(const table_sizing &sizing = table_sizing()) :
+		chunks(numa_allocator<chunk_ptr>(sizing.socket)),
+		free_list(numa_allocator<flow_handle>(sizing.socket)),
+		used(numa_allocator<uint64_t>(sizing.socket))
+	{
+		size_t capacity = std::max<size_t>(sizing.entries, 1);
+		chunks.reserve((capacity + chunk_size - 1) / chunk_size);
+		while (chunks.size() * chunk_size < capacity)
+			add_chunk();
+		free_list.reserve(capacity);
+		used.reserve((capacity + 63) / 64);
+	}
+
+	flow_handle alloc()
+	{
+		flow_handle h;
+
+		if (!free_list.empty()) {
+			h = free_list.back();
+			free_list.pop_back();
+		} else {
+			if (next == chunks.size() * chunk_size)
+				add_chunk();
+			h = next++;
+			if (h / 64 == used.size())
+				used.push_back(0);
+		}
+
+		hot(h) = Hot();
+		cold(h) = Cold();
+		used[h / 64] |= 1ull << (h % 64);
+		++count;
+		return h;
+	}
+
+	void free(flow_handle h)
+	{
+		used[h / 64] &= ~(1ull << (h % 64));
+		free_list.push_back(h);
+		--count;
+	}
+
+	bool allocated(flow_handle h) const
+	{
+		return h < next && (used[h / 64] & (1ull << (h % 64)));
+	}
+
+	/* One past the highest handle ever allocated */
+	flow_handle end() const { return next; }
+
+	Hot &hot(flow_handle h) { return chunks[h >> chunk_shift]->hot[h & (chunk_size - 1)]; }
+	const Hot &hot(flow_handle h) const { return chunks[h >> chunk_shift]->hot[h & (chunk_size - 1)]; }
+	Cold &cold(flow_handle h) { return chunks[h >> chunk_shift]->cold[h & (chunk_size - 1)]; }
+	const Cold &cold(flow_handle h) const { return chunks[h >> chunk_shift]->cold[h & (chunk_size - 1)]; }
+
+	size_t size() const { return count; }
+
+private:
+	struct chunk
+	{
+		Hot hot[chunk_size];
+		Cold cold[chunk_size];
+	};
+
+	using chunk_ptr = numa_ptr<chunk>;
+
+	numa_vector<chunk_ptr> chunks;
+	numa_vector<flow_handle> free_list;
+	numa_vector<uint64_t> used;
+	flow_handle next = 0;
+	size_t count = 0;
+
+	void add_chunk()
+	{
+		chunks.push_back(make_numa<chunk>(chunks.get_allocator().socket));
+	}
+};
@@ -0,0 +1,329 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "numa_allocator.h"
+
+#include <rte_branch_prediction.h>
+#include <rte_hash_crc.h>
+#include <rte_prefetch.h>
+
+typedef uint32_t flow_handle;
+
+static constexpr flow_handle invalid_flow_handle = UINT32_MAX;
+
+static inline uint32_t hash_mix32(uint32_t x)
+{
+	/* murmur3 finalizer */
+	x ^= x >> 16;
+	x *= 0x85ebca6bu;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35u;
+	x ^= x >> 16;
+	return x;
+}
+
+/* Base of the hash functions of flow keys, which take a CRC32C of the key
+ * (one instruction per 8 bytes with SSE4.2 or the ARMv8 CRC extension) seeded
+ * per context, so that colliding keys cannot be precomputed. CRC32C is
+ * linear, though: keys whose CRCs share their low bits would share a bucket
+ * whatever the seed, so the CRC is passed through hash_mix32() too. */
+struct seeded_hash
+{
+	uint32_t seed;
+
+	explicit seeded_hash(uint32_t seed = 0) : seed(seed) {}
+};
+
+/* How a context sizes and places its tables */
+struct table_sizing
+{
+	/* Entries to make room for up front */
+	size_t entries = 0;
+	/* Hold at most entries, so that nothing is allocated after the table
+	 * is created */
+	bool fixed = false;
+	/* Where to allocate, see numa_allocator */
+	int socket = heap_socket;
+};
+
+/* Open addressing hash table mapping keys to 32-bit values, usually flow
+ * handles. invalid_flow_handle marks empty slots and cannot be stored.
+ *
+ * Collisions are resolved with Robin Hood linear probing: an entry being
+ * inserted takes the slot of any entry that is closer to its home bucket,
+ * which keeps probe sequences short and lets lookups of missing keys stop
+ * early. Deletion shifts the following entries back instead of leaving
+ * tombstones. Each slot stores the full hash so that probing rarely needs to
+ * compare keys.
+ *
+ * The table doubles when 7/8 full, and halves when less than 1/8 full, down
+ * to the capacity it was created with. Either way the entries move to the
+ * new slots a few at a time: every insert and erase migrates the next
+ * migrate_step old slots, in index order, and lookups search the old slots
+ * that are left as well. Migrated slots are emptied without shifting their
+ * neighbors back, so probes of the old slots skip over the migrated ones
+ * rather than stop at them. A migration ends well before the next one is
+ * due, so no single operation pays for rehashing the table. */
+template <typename Key, typename Hash>
+class flow_table
+{
+public:
+	/* Starts with at least capacity slots, and room for sizing.entries
+	 * keys */
+	explicit flow_table(size_t capacity = 1024, const Hash &hash = Hash(),
+			    const table_sizing &sizing = table_sizing()) :
+		slots(numa_allocator<slot>(sizing.socket)),
+		old(numa_allocator<slot>(sizing.socket)), hasher(hash),
+		fixed(sizing.fixed)
+	{
+		size_t n = min_capacity;
+		while (n < capacity || n * 7 < sizing.entries * 8)
+			n <<= 1;
+		slots.resize(n);
+		mask = uint32_t(n - 1);
+		min_slots = n;
+	}
+
+	flow_handle find(const Key &key) const
+	{
+		return find(key, hash_of(key));
+	}
+
+	/* Lookup with a hash computed by hash_of(), e.g. ahead of time in a
+	 * bulk lookup */
+	flow_handle find(const Key &key, uint32_t hash) const
+	{
+		const slot *s = lookup(key, hash);
+		return s ? s->handle : invalid_flow_handle;
+	}
+
+	/* Pointer to the value stored for key, to update it in place, or
+	 * nullptr if not found */
+	flow_handle *find_value(const Key &key)
+	{
+		slot *s = const_cast<slot *>(lookup(key, hash_of(key)));
+		return s ? &s->handle : nullptr;
+	}
+
+	/* Returns false if the key is already in the table, or a fixed table
+	 * is full. */
+	bool insert(const Key &key, flow_handle handle)
+	{
+		if ((count + 1) * 8 > capacity() * 7) {
+			if (fixed)
+				return false;
+			migrate(uint32_t(old.size()));
+			resize(capacity() * 2);
+		}
+
+		uint32_t hash = hasher(key);
+		if (migrating() && find_slot(old, old_mask, migrated, key, hash) >= 0)
+			return false;
+		if (!insert_slot(slot{hash, handle, key}, true))
+			return false;
+		++count;
+		migrate(migrate_step);
+		return true;
+	}
+
+	bool erase(const Key &key)
+	{
+		uint32_t hash = hasher(key);
+
+		if (!erase_slot(slots, mask, 0, key, hash) &&
+		    (!migrating() || !erase_slot(old, old_mask, migrated, key, hash)))
+			return false;
+		--count;
+
+		if (!migrating())
+			shrink();
+		migrate(migrate_step);
+		return true;
+	}
+
+	/* Move the entries of the next n old slots, if resizing. Idle tables
+	 * call this periodically to finish shrinking. */
+	void migrate(uint32_t n)
+	{
+		if (likely(!migrating()))
+			return;
+
+		uint32_t end = uint32_t(std::min<size_t>(size_t(migrated) + n, old.size()));
+		for (; migrated < end; ++migrated) {
+			slot &s = old[migrated];
+			if (s.handle != invalid_flow_handle) {
+				insert_slot(s, false);
+				s.handle = invalid_flow_handle;
+			}
+		}
+		if (migrated == old.size()) {
+			numa_vector<slot>(old.get_allocator()).swap(old);
+			shrink();
+		}
+	}
+
+	uint32_t hash_of(const Key &key) const
+	{
+		return hasher(key);
+	}
+
+	/* Start loading the home bucket of key */
+	void prefetch(const Key &key) const
+	{
+		prefetch_hash(hash_of(key));
+	}
+
+	void prefetch_hash(uint32_t hash) const
+	{
+		rte_prefetch0(&slots[hash & mask]);
+		if (migrating())
+			rte_prefetch0(&old[hash & old_mask]);
+	}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	size_t capacity() const { return slots.size(); }
+	/* Bytes allocated for the slots, including those still migrating */
+	size_t memory() const
+	{ return (slots.capacity() + old.capacity()) * sizeof(slot); }
+	/* Whether entries are still moving to resized slots */
+	bool migrating() const { return !old.empty(); }
+
+	/* Old slots migrated per insert and erase. A migration ends after
+	 * 1/8 as many operations as there are old slots, before the new slots
+	 * can get more than half full or empty enough to resize again. */
+	static constexpr uint32_t migrate_step = 8;
+
+private:
+	static constexpr size_t min_capacity = 16;
+
+	struct slot
+	{
+		uint32_t hash = 0;
+		flow_handle handle = invalid_flow_handle;
+		Key key = Key();
+	};
+
+	numa_vector<slot> slots;
+	/* Slots being migrated to slots after a resize, empty otherwise.
+	 * Those below migrated have been moved. */
+	numa_vector<slot> old;
+	Hash hasher;
+	bool fixed;
+	uint32_t mask;
+	uint32_t old_mask = 0;
+	uint32_t migrated = 0;
+	/* Never shrink below the initial capacity */
+	size_t min_slots;
+	size_t count = 0;
+
+	const slot *lookup(const Key &key, uint32_t hash) const
+	{
+		int64_t idx = find_slot(slots, mask, 0, key, hash);
+		if (idx >= 0)
+			return &slots[size_t(idx)];
+		if (likely(!migrating()))
+			return nullptr;
+		idx = find_slot(old, old_mask, migrated, key, hash);
+		return idx >= 0 ? &old[size_t(idx)] : nullptr;
+	}
+
+	/* Index of key in table t, whose slots below begin have been migrated
+	 * and are skipped, or -1. The slots left to migrate may all be
+	 * occupied, so the probe gives up after going around them once. */
+	static int64_t find_slot(const numa_vector<slot> &t, uint32_t m,
+				 uint32_t begin, const Key &key, uint32_t hash)
+	{
+		uint32_t idx = hash & m;
+
+		for (uint32_t n = 0; n <= m; ++n, idx = (idx + 1) & m) {
+			if (idx < begin)
+				idx = begin;
+			const slot &s = t[idx];
+			if (s.handle == invalid_flow_handle ||
+			    ((idx - s.hash) & m) < ((idx - hash) & m))
+				return -1;
+			if (s.hash == hash && s.key == key)
+				return idx;
+		}
+		return -1;
+	}
+
+	static bool erase_slot(numa_vector<slot> &t, uint32_t m, uint32_t begin,
+			       const Key &key, uint32_t hash)
+	{
+		int64_t found = find_slot(t, m, begin, key, hash);
+		if (found < 0)
+			return false;
+
+		/* Backward shift the rest of the probe sequence. It ends at
+		 * the migrated slots, which are empty. */
+		uint32_t idx = uint32_t(found);
+		for (;;) {
+			uint32_t next = (idx + 1) & m;
+			const slot &s = t[next];
+			if (s.handle == invalid_flow_handle ||
+			    ((next - s.hash) & m) == 0)
+				break;
+			t[idx] = s;
+			idx = next;
+		}
+		t[idx].handle = invalid_flow_handle;
+		return true;
+	}
+
+	uint32_t distance(uint32_t hash, uint32_t idx) const
+	{
+		return (idx - hash) & mask;
+	}
+
+	bool insert_slot(slot cur, bool check_existing)
+	{
+		uint32_t idx = cur.hash & mask;
+
+		for (uint32_t dist = 0;; ++dist, idx = (idx + 1) & mask) {
+			slot &s = slots[idx];
+			if (s.handle == invalid_flow_handle) {
+				s = cur;
+				return true;
+			}
+			if (check_existing && s.hash == cur.hash && s.key == cur.key)
+				return false;
+			uint32_t s_dist = distance(s.hash, idx);
+			if (s_dist < dist) {
+				/* The key cannot appear further down the
+				 * probe sequence once we displace an entry */
+				std::swap(s, cur);
+				dist = s_dist;
+				check_existing = false;
+			}
+		}
+	}
+
+	/* Start migrating the entries to new_capacity slots */
+	void resize(size_t new_capacity)
+	{
+		numa_vector<slot> next(new_capacity, slots.get_allocator());
+		old.swap(slots);
+		slots.swap(next);
+		old_mask = mask;
+		mask = uint32_t(new_capacity - 1);
+		migrated = 0;
+	}
+
+	/* Start halving the slots if they are mostly empty */
+	void shrink()
+	{
+		if (!fixed && count * 8 < capacity() && capacity() > min_slots)
+			resize(capacity() / 2);
+	}
+};
@@ -14,3 +14,8 @@
 #define CM_APR_ATTR_ID		(0x001A)
 
 #define CM_MAX_ATTR_ID 0x20
+
+/* The message an MRA or a REJ responds to */
+#define CM_MSG_RESPONSE_REQ	(0x0)
+#define CM_MSG_RESPONSE_REP	(0x1)
+#define CM_MSG_RESPONSE_OTHER	(0x2)
@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_table.h"
+
+#include <rte_hash_crc.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/* VXLAN/GENEVE virtual network identifier, 0 outside of overlays */
+typedef uint32_t vni_t;
+
+#ifdef CTCM_OVERLAY
+/* An IPv4 address qualified by its VNI, the key of the IPv4 QPN table */
+struct ip4_addr
+{
+	in_addr_t ip;
+	vni_t vni;
+
+	ip4_addr() {}
+	ip4_addr(in_addr_t a, vni_t v = 0) : ip(a), vni(v) {}
+
+	bool operator==(const ip4_addr &o) const
+	{ return ip == o.ip && vni == o.vni; }
+};
+
+/* Accumulate an IPv4 key and a 32-bit ID into a CRC32C */
+static inline uint32_t crc_key(const ip4_addr &a, uint32_t id, uint32_t crc)
+{
+	return rte_hash_crc_8byte((uint64_t(a.vni) << 32) | id,
+				  rte_hash_crc_4byte(a.ip, crc));
+}
+#else
+typedef in_addr_t ip4_addr;
+
+/* Accumulate an IPv4 key and a 32-bit ID into a CRC32C, packed into a single
+ * 64-bit word */
+static inline uint32_t crc_key(ip4_addr a, uint32_t id, uint32_t crc)
+{
+	return rte_hash_crc_8byte((uint64_t(a) << 32) | id, crc);
+}
+#endif
+
+/* An IPv4 or IPv6 address, in network order. IPv4 addresses are stored
+ * IPv4-mapped (::ffff:a.b.c.d), so that tables keyed by the address of a
+ * CM peer handle both families with one key type.
+ *
+ * Overlay builds (CTCM_OVERLAY) also key peers by the VNI they were seen on,
+ * so that tenants with overlapping addresses do not collide. Other builds keep
+ * the 16-byte key and ignore the VNI. */
+struct ip_addr
+{
+	uint32_t w[4] = {};
+#ifdef CTCM_OVERLAY
+	vni_t vni = 0;
+
+	static constexpr bool qualified = true;
+#else
+	static constexpr bool qualified = false;
+#endif
+
+	ip_addr() {}
+	explicit ip_addr(in_addr_t v4, vni_t vni = 0) :
+		w{0, 0, htonl(0xffff), v4}
+	{ set_vni(vni); }
+	explicit ip_addr(const in6_addr &v6, vni_t vni = 0)
+	{
+		memcpy(w, &v6, sizeof(w));
+		set_vni(vni);
+	}
+
+	bool is_v4() const { return !w[0] && !w[1] && w[2] == htonl(0xffff); }
+	in_addr_t v4() const { return w[3]; }
+
+	vni_t get_vni() const
+	{
+#ifdef CTCM_OVERLAY
+		return vni;
+#else
+		return 0;
+#endif
+	}
+
+	/* The key of an IPv4 address in the IPv4 QPN table */
+	ip4_addr v4_key() const
+	{
+#ifdef CTCM_OVERLAY
+		return ip4_addr(w[3], vni);
+#else
+		return w[3];
+#endif
+	}
+
+	in6_addr v6() const
+	{
+		in6_addr a;
+		memcpy(&a, w, sizeof(a));
+		return a;
+	}
+
+	/* False for the unspecified address, in either family */
+	explicit operator bool() const
+	{ return w[3] || (!is_v4() && (w[0] | w[1] | w[2])); }
+
+	bool operator==(const ip_addr &o) const
+	{
+		return w[0] == o.w[0] && w[1] == o.w[1] && w[2] == o.w[2] &&
+		       w[3] == o.w[3]
+#ifdef CTCM_OVERLAY
+		       && vni == o.vni
+#endif
+		       ;
+	}
+	bool operator!=(const ip_addr &o) const { return !(*this == o); }
+
+	/* Accumulate the address into a CRC32C, see seeded_hash */
+	uint32_t crc(uint32_t crc) const
+	{
+		uint64_t hi, lo;
+		memcpy(&hi, &w[0], sizeof(hi));
+		memcpy(&lo, &w[2], sizeof(lo));
+		crc = rte_hash_crc_8byte(lo, rte_hash_crc_8byte(hi, crc));
+#ifdef CTCM_OVERLAY
+		crc = rte_hash_crc_4byte(vni, crc);
+#endif
+		return crc;
+	}
+
+	const char *str(char (&buf)[INET6_ADDRSTRLEN]) const
+	{
+		if (is_v4())
+			return inet_ntop(AF_INET, &w[3], buf, sizeof(buf));
+		return inet_ntop(AF_INET6, w, buf, sizeof(buf));
+	}
+
+private:
+	void set_vni([[maybe_unused]] vni_t v)
+	{
+#ifdef CTCM_OVERLAY
+		vni = v;
+#endif
+	}
+};
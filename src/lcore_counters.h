@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "numa_allocator.h"
+
+#include <rte_branch_prediction.h>
+#include <rte_config.h>
+#include <rte_lcore.h>
+
+#include <atomic>
+
+/* N event counters that any lcore may update without sharing a cache line
+ * with the others: each lcore adds to its own copy, with a plain store, and
+ * readers sum the copies up. Threads that are not EAL lcores share one more
+ * copy, which they update atomically. */
+template <unsigned N>
+class lcore_counters
+{
+public:
+	explicit lcore_counters(int socket = heap_socket) :
+		copies(RTE_MAX_LCORE + 1, numa_allocator<copy>(socket))
+	{}
+
+	void add(unsigned i, uint64_t n = 1)
+	{
+		unsigned lcore = rte_lcore_id();
+
+		if (likely(lcore < RTE_MAX_LCORE)) {
+			std::atomic<uint64_t> &c = copies[lcore].counters[i];
+			c.store(c.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+		} else {
+			copies[RTE_MAX_LCORE].counters[i].fetch_add(
+				n, std::memory_order_relaxed);
+		}
+	}
+
+	/* Totals since the counters were created */
+	void sum(uint64_t (&totals)[N]) const
+	{
+		for (unsigned i = 0; i < N; ++i)
+			totals[i] = 0;
+		for (const copy &c : copies)
+			for (unsigned i = 0; i < N; ++i)
+				totals[i] += c.counters[i].load(std::memory_order_relaxed);
+	}
+
+	/* Totals since the last reset(). Neither may run concurrently with
+	 * the other. */
+	void sum_since_reset(uint64_t (&totals)[N]) const
+	{
+		sum(totals);
+		for (unsigned i = 0; i < N; ++i)
+			totals[i] -= base[i];
+	}
+
+	/* Leaves the copies to the lcores writing them */
+	void reset() { sum(base); }
+
+private:
+	struct alignas(RTE_CACHE_LINE_SIZE) copy
+	{
+		std::atomic<uint64_t> counters[N] = {};
+	};
+
+	numa_vector<copy> copies;
+	uint64_t base[N] = {};
+};
@@ -4,10 +4,31 @@
 
 #pragma once
 
+#include <rte_branch_prediction.h>
 #include <rte_log.h>
 
-#define CTCM_LOGTYPE RTE_LOGTYPE_USER1
+/* Messages less severe than this are compiled out, see the log_level build
+ * option. The rest are logged according to the level of the lib.conntrack_cm
+ * logtype, NOTICE by default (e.g. --log-level=lib.conntrack_cm:debug). */
+#ifndef CTCM_LOG_LEVEL
+#define CTCM_LOG_LEVEL RTE_LOG_DEBUG
+#endif
+
+extern int ctcm_logtype;
+
+#define CTCM_LOGTYPE ctcm_logtype
 #define CTCM_PREFIX "conntrack-cm: "
 
-#define log_debug(...) \
-    rte_log(RTE_LOG_DEBUG, CTCM_LOGTYPE, CTCM_PREFIX __VA_ARGS__)
+/* Whether messages of level are logged. Constant false for levels compiled
+ * out. */
+#define log_enabled(level) \
+    ((level) <= CTCM_LOG_LEVEL && unlikely(rte_log_can_log(CTCM_LOGTYPE, level)))
+
+/* The arguments are only evaluated if the message is logged */
+#define ctcm_log(level, ...) \
+    do { \
+        if (log_enabled(level)) \
+            rte_log(level, CTCM_LOGTYPE, CTCM_PREFIX __VA_ARGS__); \
+    } while (0)
+
+#define log_debug(...) ctcm_log(RTE_LOG_DEBUG, __VA_ARGS__)
@@ -5,27 +5,252 @@
 #include <libconntrack-cm.h>
 #include "cm_connection_tracker.h"
 #include "parser.h"
+#include "logging.h"
+
+#include <rte_cycles.h>
+#include <rte_random.h>
+#include <rte_ring.h>
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+
+RTE_LOG_REGISTER(ctcm_logtype, lib.conntrack_cm, NOTICE);
 
 struct ctcm_context {
-    ctcm_context() :
-        parser{},
-        tracker{parser}
+    ctcm_context(uint64_t flags, const table_sizing &sizing,
+                 std::shared_ptr<qpn_index> qpns,
+                 std::shared_ptr<shard_steering> steering = nullptr,
+                 unsigned shard = 0) :
+        socket(sizing.socket),
+        parser{bool(flags & CTCM_CREATE_PARSE_L2),
+               bool(flags & CTCM_CREATE_VALIDATE), sizing.socket},
+        tracker{parser, std::move(qpns), std::move(steering), shard, sizing}
     {}
 
+    /* Where the context and its tables are allocated */
+    int socket;
     parser_context parser;
     cm_connection_tracker tracker;
 };
 
+template <typename... Args>
+static ctcm_context *new_context(uint64_t flags, const table_sizing &sizing,
+                                 Args &&...args)
+{
+    return make_numa<ctcm_context>(sizing.socket, flags, sizing,
+                                   std::forward<Args>(args)...).release();
+}
+
+static void delete_context(ctcm_context *ctcm)
+{
+    numa_deleter<ctcm_context>{ctcm->socket}(ctcm);
+}
+
 ctcm_public
 struct ctcm_context *ctcm_create()
 {
-    return new ctcm_context{};
+    return ctcm_create_flags(0);
+}
+
+static_assert(CTCM_SOCKET_HEAP == heap_socket, "heap socket mismatch");
+
+/* entries is the number of flows to size the tables for, and their capacity
+ * with CTCM_CREATE_STATIC */
+static struct ctcm_context *create(uint64_t flags, int socket, uint32_t entries)
+{
+    bool fixed = flags & CTCM_CREATE_STATIC;
+
+    if ((flags & ~CTCM_CREATE_FLAGS_MASK) ||
+        ((flags & CTCM_CREATE_CONCURRENT_QUERY) &&
+         (flags & CTCM_CREATE_DIRECT_QPN)) ||
+        (fixed && (!entries || (flags & CTCM_CREATE_DIRECT_QPN)))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    qpn_table_mode mode = qpn_table_mode::local;
+    if (flags & CTCM_CREATE_CONCURRENT_QUERY)
+        mode = qpn_table_mode::concurrent;
+    else if (flags & CTCM_CREATE_DIRECT_QPN)
+        mode = qpn_table_mode::direct;
+
+    table_sizing sizing;
+    sizing.entries = entries;
+    sizing.fixed = fixed;
+    sizing.socket = socket;
+
+    try {
+        auto qpns = std::allocate_shared<qpn_index>(
+            numa_allocator<qpn_index>(socket), mode, uint32_t(rte_rand()), sizing);
+        return new_context(flags, sizing, std::move(qpns));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+    } catch (const std::exception& e) {
+        log_debug("ctcm_create failed: %s\n", e.what());
+        errno = EINVAL;
+    }
+    return nullptr;
+}
+
+ctcm_public
+struct ctcm_context *ctcm_create_flags(uint64_t flags)
+{
+    return create(flags, heap_socket, 0);
+}
+
+static bool valid_socket(int socket_id)
+{
+    return socket_id == SOCKET_ID_ANY ||
+           (socket_id >= 0 && socket_id < RTE_MAX_NUMA_NODES);
+}
+
+ctcm_public
+struct ctcm_context *ctcm_create_socket(uint64_t flags, int socket_id)
+{
+    if (!valid_socket(socket_id)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    return create(flags, socket_id, 0);
+}
+
+ctcm_public
+struct ctcm_context *ctcm_create_ex(const struct ctcm_config *config)
+{
+    if (config->size < sizeof(*config) ||
+        (config->socket_id != CTCM_SOCKET_HEAP && !valid_socket(config->socket_id))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    bool fixed = config->flags & CTCM_CREATE_STATIC;
+    ctcm_context *ctcm = create(config->flags, config->socket_id,
+                                fixed ? config->max_flows : config->expected_flows);
+    if (!ctcm)
+        return nullptr;
+
+    if (!ctcm->tracker.set_limits(config->max_flows, config->max_flows_per_host)) {
+        delete_context(ctcm);
+        errno = EINVAL;
+        return nullptr;
+    }
+    return ctcm;
+}
+
+ctcm_public
+int ctcm_create_sharded(uint64_t flags, unsigned n, struct ctcm_context **shards)
+{
+    if ((flags & ~CTCM_CREATE_FLAGS_MASK) ||
+        (flags & (CTCM_CREATE_DIRECT_QPN | CTCM_CREATE_STATIC)) ||
+        !n || n > CTCM_MAX_SHARDS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned i = 0;
+    try {
+        auto qpns = std::make_shared<qpn_index>(qpn_table_mode::shared,
+                                                uint32_t(rte_rand()));
+        auto steering = std::make_shared<shard_steering>(n, uint32_t(rte_rand()));
+        for (; i < n; ++i)
+            shards[i] = new_context(flags, table_sizing(), qpns, steering, i);
+        return 0;
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+    } catch (const std::exception& e) {
+        log_debug("ctcm_create_sharded failed: %s\n", e.what());
+        errno = EINVAL;
+    }
+    while (i)
+        delete_context(shards[--i]);
+    return -1;
+}
+
+ctcm_public
+int ctcm_shard_of(const struct ctcm_context *ctcm, enum ctcm_direction dir,
+                  const struct rte_mbuf *packet)
+{
+    return ctcm->tracker.shard_of(packet, dir);
+}
+
+ctcm_public
+int ctcm_rcu_qsbr_add(struct ctcm_context *ctcm, struct rte_rcu_qsbr *v)
+{
+    return ctcm->tracker.rcu_qsbr_add(v);
 }
 
 ctcm_public
 void ctcm_destroy(struct ctcm_context *ctcm)
 {
-    delete ctcm;
+    delete_context(ctcm);
+}
+
+ctcm_public
+int ctcm_set_flow_limits(struct ctcm_context *ctcm,
+                         const struct ctcm_flow_limits *limits)
+{
+    if (limits->size < sizeof(*limits)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!ctcm->tracker.set_limits(limits->max_flows, limits->max_flows_per_host)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+ctcm_public
+int ctcm_get_flow_counters(const struct ctcm_context *ctcm,
+                           struct ctcm_flow_counters *counters)
+{
+    if (counters->size < sizeof(*counters)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ctcm->tracker.get_counters(counters);
+
+    return 0;
+}
+
+ctcm_public
+int ctcm_get_validation_counters(const struct ctcm_context *ctcm,
+                                 struct ctcm_validation_counters *counters)
+{
+    if (counters->size < sizeof(*counters)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ctcm->parser.get_counters(counters);
+
+    return 0;
+}
+
+ctcm_public
+int ctcm_stats_get(const struct ctcm_context *ctcm, struct ctcm_stats *stats)
+{
+    if (stats->size < sizeof(*stats)) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ctcm->tracker.get_stats(stats);
+    ctcm->parser.get_stats(stats);
+
+    return 0;
+}
+
+ctcm_public
+void ctcm_stats_reset(struct ctcm_context *ctcm)
+{
+    ctcm->tracker.reset_stats();
+    ctcm->parser.reset_stats();
 }
 
 ctcm_public
@@ -52,20 +277,223 @@ int ctcm_parse_packet(const struct ctcm_context *ctcm,
     return 0;
 }
 
+ctcm_public
+int ctcm_parse_burst(const struct ctcm_context *ctcm,
+                     struct rte_mbuf **packets, uint16_t n,
+                     uint64_t *cm_mask)
+{
+    if (n > CTCM_MAX_BURST) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *cm_mask = ctcm->parser.parse_burst(packets, n);
+
+    return __builtin_popcountll(*cm_mask);
+}
+
 ctcm_public
 int ctcm_process_packet(struct ctcm_context *ctcm,
                         enum ctcm_direction dir,
                         const struct rte_mbuf *packet)
 {
+    ctcm->tracker.expire(rte_rdtsc(), cm_connection_tracker::packet_expire_budget);
     if (ctcm->parser.mbuf_mad(packet))
         ctcm->tracker.process(packet, dir);
     
     return 0;
 }
 
+ctcm_public
+int ctcm_process_burst(struct ctcm_context *ctcm,
+                       enum ctcm_direction dir,
+                       struct rte_mbuf **packets, uint16_t n)
+{
+    unsigned count = 0;
+
+    ctcm->tracker.expire(rte_rdtsc(), cm_connection_tracker::packet_expire_budget);
+    for (unsigned i = 0; i < n; i += CTCM_MAX_BURST) {
+        unsigned burst = std::min<unsigned>(n - i, CTCM_MAX_BURST);
+        count += ctcm->tracker.process_burst(packets + i, burst, dir);
+    }
+
+    return int(count);
+}
+
+static_assert(sizeof(cm_event) <= sizeof(ctcm_event) &&
+              std::is_trivially_copyable<cm_event>::value,
+              "cm_event does not fit in ctcm_event");
+
+ctcm_public
+int ctcm_make_event(const struct ctcm_context *ctcm, enum ctcm_direction dir,
+                    const struct rte_mbuf *packet, struct ctcm_event *ev)
+{
+    cm_event e;
+
+    if (!ctcm->tracker.make_event(packet, dir, e))
+        return -1;
+    memset(ev, 0, sizeof(*ev));
+    memcpy(ev, &e, sizeof(e));
+
+    return 0;
+}
+
+/* Copy events out of the opaque ctcm_event and process them */
+static void process_events(struct ctcm_context *ctcm,
+                           const struct ctcm_event *events, unsigned n)
+{
+    cm_event burst[CTCM_MAX_BURST];
+
+    for (unsigned i = 0; i < n; i += CTCM_MAX_BURST) {
+        unsigned count = std::min<unsigned>(n - i, CTCM_MAX_BURST);
+        for (unsigned j = 0; j < count; ++j)
+            memcpy(static_cast<void *>(&burst[j]), &events[i + j],
+                   sizeof(burst[j]));
+        ctcm->tracker.process_events(burst, count);
+    }
+}
+
+ctcm_public
+int ctcm_process_events(struct ctcm_context *ctcm,
+                        const struct ctcm_event *events, unsigned n)
+{
+    ctcm->tracker.expire(rte_rdtsc(), cm_connection_tracker::packet_expire_budget);
+    process_events(ctcm, events, n);
+
+    return int(n);
+}
+
+ctcm_public
+int ctcm_process_ring(struct ctcm_context *ctcm, struct rte_ring *ring,
+                      unsigned max)
+{
+    ctcm_event events[CTCM_MAX_BURST];
+    unsigned count = 0;
+
+    ctcm->tracker.expire(rte_rdtsc(), cm_connection_tracker::packet_expire_budget);
+    while (count < max) {
+        unsigned burst = std::min<unsigned>(max - count, CTCM_MAX_BURST);
+        unsigned n = rte_ring_dequeue_burst_elem(ring, events, sizeof(events[0]),
+                                                 burst, nullptr);
+        if (!n)
+            break;
+        process_events(ctcm, events, n);
+        count += n;
+    }
+
+    return int(count);
+}
+
+ctcm_public
+int ctcm_poll(struct ctcm_context *ctcm, uint64_t tsc, unsigned budget)
+{
+    return int(ctcm->tracker.expire(tsc, budget));
+}
+
 ctcm_public
 uint32_t ctcm_query_ipv4(const struct ctcm_context *ctcm,
                          in_addr_t dest_ip, uint32_t dqpn)
 {
-    return ctcm->tracker.get_source_qpn(flow_key(dest_ip, dqpn));
+    return ctcm->tracker.get_source_qpn(flow_key(ip_addr(dest_ip).v4_key(), dqpn));
+}
+
+ctcm_public
+uint32_t ctcm_query_vni_ipv4(const struct ctcm_context *ctcm, uint32_t vni,
+                             in_addr_t dest_ip, uint32_t dqpn)
+{
+    /* Overlay flows are tracked without their VNI */
+    if (!ip_addr::qualified && vni)
+        return 0;
+    return ctcm->tracker.get_source_qpn(flow_key(ip_addr(dest_ip, vni).v4_key(),
+                                                 dqpn));
+}
+
+ctcm_public
+int ctcm_query_ipv4_bulk(const struct ctcm_context *ctcm,
+                         const in_addr_t *dest_ips, const uint32_t *dqpns,
+                         uint32_t *sqpns, unsigned n)
+{
+    unsigned found = 0;
+
+    for (unsigned i = 0; i < n; i += qpn_table4::bulk_max) {
+        unsigned burst = std::min(n - i, qpn_table4::bulk_max);
+#ifdef CTCM_OVERLAY
+        /* Add VNI 0 to the keys */
+        ip4_addr ips[qpn_table4::bulk_max];
+        for (unsigned j = 0; j < burst; ++j)
+            ips[j] = ip4_addr(dest_ips[i + j]);
+        found += ctcm->tracker.get_source_qpn_bulk(ips, dqpns + i,
+                                                   sqpns + i, burst);
+#else
+        found += ctcm->tracker.get_source_qpn_bulk(dest_ips + i, dqpns + i,
+                                                   sqpns + i, burst);
+#endif
+    }
+
+    return int(found);
+}
+
+ctcm_public
+uint32_t ctcm_query_ipv6(const struct ctcm_context *ctcm,
+                         const struct in6_addr *dest_ip, uint32_t dqpn)
+{
+    return ctcm->tracker.get_source_qpn(flow_key6(ip_addr(*dest_ip), dqpn));
+}
+
+ctcm_public
+uint32_t ctcm_query_vni_ipv6(const struct ctcm_context *ctcm, uint32_t vni,
+                             const struct in6_addr *dest_ip, uint32_t dqpn)
+{
+    if (!ip_addr::qualified && vni)
+        return 0;
+    return ctcm->tracker.get_source_qpn(flow_key6(ip_addr(*dest_ip, vni), dqpn));
+}
+
+ctcm_public
+int ctcm_query_ipv6_bulk(const struct ctcm_context *ctcm,
+                         const struct in6_addr *dest_ips, const uint32_t *dqpns,
+                         uint32_t *sqpns, unsigned n)
+{
+    ip_addr ips[qpn_table6::bulk_max];
+    unsigned found = 0;
+
+    for (unsigned i = 0; i < n; i += qpn_table6::bulk_max) {
+        unsigned burst = std::min(n - i, qpn_table6::bulk_max);
+        for (unsigned j = 0; j < burst; ++j)
+            ips[j] = ip_addr(dest_ips[i + j]);
+        found += ctcm->tracker.get_source_qpn_bulk(ips, dqpns + i,
+                                                   sqpns + i, burst);
+    }
+
+    return int(found);
+}
+
+static int query_sidr(const struct ctcm_context *ctcm, const ip_addr &remote_ip,
+                      uint32_t qpn, struct ctcm_sidr_mapping *mapping)
+{
+    sidr_table::mapping m;
+
+    if (!ctcm->tracker.get_sidr_mapping(remote_ip, qpn, m)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    mapping->qkey = m.qkey;
+    mapping->flags = m.service == sidr_table::local ? CTCM_SIDR_LOCAL_SERVICE : 0;
+    return 0;
+}
+
+ctcm_public
+int ctcm_query_sidr_ipv4(const struct ctcm_context *ctcm, in_addr_t remote_ip,
+                         uint32_t qpn, struct ctcm_sidr_mapping *mapping)
+{
+    return query_sidr(ctcm, ip_addr(remote_ip), qpn, mapping);
+}
+
+ctcm_public
+int ctcm_query_sidr_ipv6(const struct ctcm_context *ctcm,
+                         const struct in6_addr *remote_ip, uint32_t qpn,
+                         struct ctcm_sidr_mapping *mapping)
+{
+    return query_sidr(ctcm, ip_addr(*remote_ip), qpn, mapping);
 }
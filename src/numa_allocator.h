@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <rte_malloc.h>
+
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+/* Not a NUMA socket: allocate from the C++ heap */
+static constexpr int heap_socket = -2;
+
+/* Allocator of the tracker's tables. Allocates from the DPDK heap of a NUMA
+ * socket, i.e. hugepages on the node of the lcores using the tables, or with
+ * SOCKET_ID_ANY from any node. Tables that are not given a socket, such as
+ * those of a context created without one, stay on the C++ heap. */
+template <typename T>
+struct numa_allocator
+{
+	typedef T value_type;
+
+	int socket = heap_socket;
+
+	numa_allocator() {}
+	explicit numa_allocator(int socket) : socket(socket) {}
+	template <typename U>
+	numa_allocator(const numa_allocator<U> &o) : socket(o.socket) {}
+
+	T *allocate(size_t n)
+	{
+		if (socket == heap_socket)
+			return std::allocator<T>().allocate(n);
+		void *p = rte_malloc_socket("ctcm", n * sizeof(T), alignof(T), socket);
+		if (!p)
+			throw std::bad_alloc();
+		return static_cast<T *>(p);
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (socket == heap_socket)
+			std::allocator<T>().deallocate(p, n);
+		else
+			rte_free(p);
+	}
+
+	template <typename U>
+	bool operator==(const numa_allocator<U> &o) const { return socket == o.socket; }
+	template <typename U>
+	bool operator!=(const numa_allocator<U> &o) const { return socket != o.socket; }
+};
+
+template <typename T>
+using numa_vector = std::vector<T, numa_allocator<T>>;
+
+template <typename T>
+struct numa_deleter
+{
+	int socket = heap_socket;
+
+	void operator()(T *p) const
+	{
+		p->~T();
+		numa_allocator<T>(socket).deallocate(p, 1);
+	}
+};
+
+/* A single object allocated on a socket */
+template <typename T>
+using numa_ptr = std::unique_ptr<T, numa_deleter<T>>;
+
+template <typename T, typename... Args>
+numa_ptr<T> make_numa(int socket, Args &&...args)
+{
+	numa_allocator<T> alloc(socket);
+	T *p = alloc.allocate(1);
+	try {
+		new (p) T(std::forward<Args>(args)...);
+	} catch (...) {
+		alloc.deallocate(p, 1);
+		throw;
+	}
+	return numa_ptr<T>(p, numa_deleter<T>{socket});
+}
@@ -0,0 +1,164 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_table.h"
+#include "numa_allocator.h"
+
+#include <stdint.h>
+
+#include <rte_pause.h>
+#include <rte_spinlock.h>
+
+#include <atomic>
+
+/* Maps keys of up to 56 bits to the number of the shard that owns them, see
+ * shard_steering.
+ *
+ * Updated by the shards under a lock, and read by any thread without one:
+ * writers bump a sequence number before and after each update, and readers
+ * retry the lookup if it changed meanwhile. Each slot packs a key and its
+ * shard into one word, zero when empty. Erasing shifts the rest of the probe
+ * sequence back, so there are no tombstones to clean up, and the table never
+ * grows. */
+class owner_table
+{
+public:
+	static constexpr unsigned shard_bits = 8;
+	static constexpr uint32_t capacity = 1u << 17;
+
+	explicit owner_table(uint32_t seed, int socket = heap_socket) :
+		slots(capacity, numa_allocator<std::atomic<uint64_t>>(socket)), seed(seed)
+	{
+		rte_spinlock_init(&lock);
+	}
+
+	/* The shard owning key, or -1 */
+	int find(uint64_t key) const
+	{
+		for (;;) {
+			uint32_t begin = seq.load(std::memory_order_acquire);
+			if (begin & 1) {
+				rte_pause();
+				continue;
+			}
+
+			int shard = -1;
+			for (uint32_t idx = home(key);; idx = (idx + 1) & mask) {
+				uint64_t slot = slots[idx].load(std::memory_order_relaxed);
+				if (!slot)
+					break;
+				if (slot >> shard_bits == key) {
+					shard = int(slot & shard_mask);
+					break;
+				}
+			}
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) == begin)
+				return shard;
+		}
+	}
+
+	/* Set the owner of key. Returns false if the table is full. */
+	bool insert(uint64_t key, unsigned shard)
+	{
+		bool ok = true;
+
+		begin_update();
+		uint32_t idx = home(key);
+		for (;; idx = (idx + 1) & mask) {
+			uint64_t slot = slots[idx].load(std::memory_order_relaxed);
+			if (!slot || slot >> shard_bits == key)
+				break;
+		}
+		if (slots[idx].load(std::memory_order_relaxed)) {
+			set(idx, key, shard);
+		} else if (count < max_count) {
+			set(idx, key, shard);
+			++count;
+		} else {
+			ok = false;
+		}
+		end_update();
+		return ok;
+	}
+
+	/* Remove key, if shard still owns it */
+	void erase(uint64_t key, unsigned shard)
+	{
+		begin_update();
+		uint32_t idx = home(key);
+		for (;; idx = (idx + 1) & mask) {
+			uint64_t slot = slots[idx].load(std::memory_order_relaxed);
+			if (!slot || slot >> shard_bits == key)
+				break;
+		}
+		uint64_t slot = slots[idx].load(std::memory_order_relaxed);
+		if (slot && (slot & shard_mask) == shard) {
+			shift_back(idx);
+			--count;
+		}
+		end_update();
+	}
+
+	size_t size() const { return count; }
+
+private:
+	static constexpr uint32_t mask = capacity - 1;
+	static constexpr uint64_t shard_mask = (1u << shard_bits) - 1;
+	/* Keep probe sequences short */
+	static constexpr uint32_t max_count = capacity / 4 * 3;
+
+	numa_vector<std::atomic<uint64_t>> slots;
+	uint32_t seed;
+	std::atomic<uint32_t> seq{0};
+	rte_spinlock_t lock;
+	/* Only accessed under the lock */
+	uint32_t count = 0;
+
+	uint32_t home(uint64_t key) const
+	{
+		return hash_mix32(rte_hash_crc_8byte(key, seed)) & mask;
+	}
+
+	void set(uint32_t idx, uint64_t key, unsigned shard)
+	{
+		slots[idx].store(key << shard_bits | shard, std::memory_order_relaxed);
+	}
+
+	void begin_update()
+	{
+		rte_spinlock_lock(&lock);
+		seq.store(seq.load(std::memory_order_relaxed) + 1,
+			  std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void end_update()
+	{
+		seq.store(seq.load(std::memory_order_relaxed) + 1,
+			  std::memory_order_release);
+		rte_spinlock_unlock(&lock);
+	}
+
+	/* Empty slot idx, moving back the entries after it that would not be
+	 * found past the hole */
+	void shift_back(uint32_t idx)
+	{
+		for (uint32_t next = (idx + 1) & mask;; next = (next + 1) & mask) {
+			uint64_t slot = slots[next].load(std::memory_order_relaxed);
+			if (!slot)
+				break;
+			uint32_t h = home(slot >> shard_bits);
+			/* Leave the entry if its home lies in (idx, next] */
+			if (idx <= next ? idx < h && h <= next : idx < h || h <= next)
+				continue;
+			slots[idx].store(slot, std::memory_order_relaxed);
+			idx = next;
+		}
+		slots[idx].store(0, std::memory_order_relaxed);
+	}
+};
@@ -3,13 +3,20 @@
  */
 
 #include "parser.h"
+#include "classify.h"
 
 #include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include "rxe_hdr.h"
 #include "ib_pack.h"
 #include "ib_mad.h"
 
+#include <rte_net_crc.h>
+
+#include <algorithm>
 #include <stdexcept>
 #include <array>
 
@@ -19,7 +26,7 @@ static rxe_bth *extract_bth(udphdr *udp, size_t& len)
         udp->uh_dport != htons(UDP_PORT_ROCE_V2))
         return nullptr;
     
-    len -= sizeof(rxe_bth) + 4;
+    len -= sizeof(udphdr) + sizeof(rxe_bth) + 4;
 
     return reinterpret_cast<rxe_bth *>(udp + 1);
 }
@@ -30,8 +37,6 @@ static rxe_deth *extract_deth(rxe_bth *bth, size_t& len)
         len < sizeof(rxe_deth))
         return nullptr;
     
-    // TODO check ICRC
-    // Validate BTH & DETH
     len -= sizeof(rxe_deth);
 
     return reinterpret_cast<rxe_deth *>(bth + 1);
@@ -44,20 +49,247 @@ static ib_mad_hdr *extract_mad(rxe_deth *deth, size_t& len)
     return reinterpret_cast<ib_mad_hdr *>(deth + 1);
 }
 
-ib_mad_hdr *parser_context::parse_packet(rte_mbuf* packet) const
+#ifndef ETHERTYPE_8021AD
+#define ETHERTYPE_8021AD 0x88a8
+#endif
+
+static uint16_t load16(const uint8_t *p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Length of the IPv6 header and the extension headers before the UDP header,
+ * or 0 if the packet is not UDP or its headers are not in the first segment */
+static size_t ipv6_l3_len(const uint8_t *ip, size_t len)
+{
+    if (len < sizeof(ip6_hdr) ||
+        (ip[0] >> 4) != 6)
+        return 0;
+
+    uint8_t nxt = reinterpret_cast<const ip6_hdr *>(ip)->ip6_nxt;
+    size_t l3_len = sizeof(ip6_hdr);
+    for (unsigned i = 0; i < 4 && nxt != IPPROTO_UDP; ++i) {
+        if ((nxt != IPPROTO_HOPOPTS && nxt != IPPROTO_ROUTING &&
+             nxt != IPPROTO_DSTOPTS) || len < l3_len + 2)
+            return 0;
+        nxt = ip[l3_len];
+        l3_len += (ip[l3_len + 1] + 1) * 8;
+    }
+    if (nxt != IPPROTO_UDP || len < l3_len)
+        return 0;
+    return l3_len;
+}
+
+/* Header lengths and packet types of an Ethernet frame */
+struct eth_ip_headers {
+    size_t l2_len;
+    size_t l3_len;
+    uint32_t l2_type;
+    uint32_t l3_type;
+};
+
+/* Parse an Ethernet header with up to two VLAN tags, and the IP header after
+ * it. Returns false for anything but unfragmented UDP over IPv4 or IPv6. */
+static bool parse_eth_ip(const uint8_t *data, size_t len, eth_ip_headers &h)
+{
+    h.l2_len = sizeof(ether_header);
+    h.l2_type = RTE_PTYPE_L2_ETHER;
+
+    if (len < h.l2_len)
+        return false;
+    uint16_t type = load16(data + offsetof(ether_header, ether_type));
+    for (unsigned tags = 0; tags < 2; ++tags) {
+        if (type != htons(ETHERTYPE_VLAN) && type != htons(ETHERTYPE_8021AD))
+            break;
+        /* TCI, then the encapsulated ethertype */
+        if (len < h.l2_len + 4)
+            return false;
+        type = load16(data + h.l2_len + 2);
+        h.l2_len += 4;
+        h.l2_type = tags ? RTE_PTYPE_L2_ETHER_QINQ : RTE_PTYPE_L2_ETHER_VLAN;
+    }
+
+    const uint8_t *ip = data + h.l2_len;
+    len -= h.l2_len;
+    if (type == htons(ETHERTYPE_IP)) {
+        auto ip4 = reinterpret_cast<const iphdr *>(ip);
+        if (len < sizeof(iphdr) || ip4->version != 4 || ip4->ihl < 5 ||
+            len < ip4->ihl * 4u || ip4->protocol != IPPROTO_UDP ||
+            (ip4->frag_off & htons(IP_MF | IP_OFFMASK)))
+            return false;
+        h.l3_len = ip4->ihl * 4u;
+        h.l3_type = h.l3_len == sizeof(iphdr) ? RTE_PTYPE_L3_IPV4 :
+            RTE_PTYPE_L3_IPV4_EXT;
+    } else if (type == htons(ETHERTYPE_IPV6)) {
+        h.l3_len = ipv6_l3_len(ip, len);
+        /* Too long for the mbuf's l3_len */
+        if (!h.l3_len || h.l3_len > 0x1ff)
+            return false;
+        h.l3_type = h.l3_len == sizeof(ip6_hdr) ? RTE_PTYPE_L3_IPV6 :
+            RTE_PTYPE_L3_IPV6_EXT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#define UDP_PORT_VXLAN 4789
+#define UDP_PORT_GENEVE 6081
+/* GENEVE protocol type of Ethernet payloads (Transparent Ethernet Bridging) */
+#define ETHERTYPE_TEB 0x6558
+
+/* Length of the VXLAN or GENEVE header at hdr, following a UDP header to
+ * dport, or 0 if there is none carrying Ethernet */
+static size_t tunnel_len(uint16_t dport, const uint8_t *hdr, size_t len,
+                         uint32_t &tunnel_type)
+{
+    if (len < 8)
+        return 0;
+    if (dport == htons(UDP_PORT_VXLAN)) {
+        /* The I flag marks a valid VNI */
+        if (!(hdr[0] & 0x08))
+            return 0;
+        tunnel_type = RTE_PTYPE_TUNNEL_VXLAN;
+        return 8;
+    }
+    if (dport == htons(UDP_PORT_GENEVE)) {
+        /* Version 0, options length in 4-byte words */
+        if ((hdr[0] >> 6) || load16(hdr + 2) != htons(ETHERTYPE_TEB))
+            return 0;
+        tunnel_type = RTE_PTYPE_TUNNEL_GENEVE;
+        return 8 + (hdr[0] & 0x3f) * 4u;
+    }
+    return 0;
+}
+
+/* The RTE_PTYPE_INNER_* bits of the headers of a tunnelled frame */
+static uint32_t inner_packet_type(const eth_ip_headers &h)
 {
-    udphdr *udp = mbuf_udp(packet);
-    size_t len = ntohs(udp->len);
-    auto bth = extract_bth(udp, len);
-    mbuf_bth(packet, bth);
-    mbuf_mad(packet, nullptr);
+    uint32_t ptype = RTE_PTYPE_INNER_L4_UDP;
+
+    switch (h.l2_type) {
+    case RTE_PTYPE_L2_ETHER_QINQ: ptype |= RTE_PTYPE_INNER_L2_ETHER_QINQ; break;
+    case RTE_PTYPE_L2_ETHER_VLAN: ptype |= RTE_PTYPE_INNER_L2_ETHER_VLAN; break;
+    default: ptype |= RTE_PTYPE_INNER_L2_ETHER; break;
+    }
+    switch (h.l3_type) {
+    case RTE_PTYPE_L3_IPV4: ptype |= RTE_PTYPE_INNER_L3_IPV4; break;
+    case RTE_PTYPE_L3_IPV4_EXT: ptype |= RTE_PTYPE_INNER_L3_IPV4_EXT; break;
+    case RTE_PTYPE_L3_IPV6: ptype |= RTE_PTYPE_INNER_L3_IPV6; break;
+    default: ptype |= RTE_PTYPE_INNER_L3_IPV6_EXT; break;
+    }
+    return ptype;
+}
+
+/* Fill in the header lengths and packet_type from the Ethernet (with up to
+ * two VLAN tags) and IP headers, which must be in the first segment. Returns
+ * false for anything but unfragmented UDP over IPv4 or IPv6. Frames carried
+ * over VXLAN or GENEVE are parsed too, setting the lengths and packet type of
+ * both layers as described in parser.h.
+ *
+ * A packet type set by the NIC is trusted: once the NIC recognized the L2
+ * header, anything it did not classify as UDP is rejected without reading the
+ * packet, and its packet type is kept unless it missed a tunnel. */
+static bool parse_l2_l3(rte_mbuf *packet)
+{
+    const uint32_t ptype = packet->packet_type;
+    if ((ptype & RTE_PTYPE_L2_MASK) &&
+        (ptype & RTE_PTYPE_L4_MASK) != RTE_PTYPE_L4_UDP)
+        return false;
+
+    const uint8_t *data = rte_pktmbuf_mtod(packet, const uint8_t *);
+    size_t len = rte_pktmbuf_data_len(packet);
+    eth_ip_headers outer;
+    if (!parse_eth_ip(data, len, outer))
+        return false;
+
+    size_t udp_offset = outer.l2_len + outer.l3_len;
+    size_t tunnel_offset = udp_offset + sizeof(udphdr);
+    uint32_t tunnel = 0;
+    size_t tunnel_hdr_len = len < tunnel_offset ? 0 :
+        tunnel_len(load16(data + udp_offset + offsetof(udphdr, uh_dport)),
+                   data + tunnel_offset, len - tunnel_offset, tunnel);
+
+    bool keep_ptype = (ptype & RTE_PTYPE_L2_MASK) &&
+        (ptype & RTE_PTYPE_TUNNEL_MASK) == tunnel;
+    if (!tunnel_hdr_len) {
+        packet->l2_len = uint16_t(outer.l2_len) & 0x7f;
+        packet->l3_len = uint16_t(outer.l3_len) & 0x1ff;
+        if (!keep_ptype)
+            packet->packet_type = outer.l2_type | outer.l3_type |
+                RTE_PTYPE_L4_UDP;
+        return true;
+    }
+
+    size_t inner_offset = tunnel_offset + tunnel_hdr_len;
+    eth_ip_headers inner;
+    if (len < inner_offset ||
+        !parse_eth_ip(data + inner_offset, len - inner_offset, inner))
+        return false;
+    /* l2_len spans the outer UDP header to the inner IP header */
+    size_t l2_len = inner_offset - udp_offset + inner.l2_len;
+    if (l2_len > 0x7f)
+        return false;
+
+    packet->outer_l2_len = uint16_t(outer.l2_len) & 0x7f;
+    packet->outer_l3_len = uint16_t(outer.l3_len) & 0x1ff;
+    packet->l2_len = uint16_t(l2_len) & 0x7f;
+    packet->l3_len = uint16_t(inner.l3_len) & 0x1ff;
+    if (!keep_ptype ||
+        (ptype & RTE_PTYPE_INNER_L4_MASK) != RTE_PTYPE_INNER_L4_UDP)
+        packet->packet_type = outer.l2_type | outer.l3_type |
+            RTE_PTYPE_L4_UDP | tunnel | inner_packet_type(inner);
+    return true;
+}
+
+/* Parse the L2/L3 headers of a burst if the library owns them. Returns a mask
+ * of the packets that may carry RoCE. */
+uint64_t parser_context::parse_l2_l3_burst(rte_mbuf **packets, unsigned n) const
+{
+    uint64_t udp = n == 64 ? ~0ull : (1ull << n) - 1;
+
+    if (!parse_l2)
+        return udp;
+    for (unsigned i = 0; i < n; ++i)
+        if (!parse_l2_l3(packets[i]))
+            udp &= ~(1ull << i);
+    return udp;
+}
+
+/* Bytes from the UDP header to the end of the MAD header */
+static constexpr size_t header_window = sizeof(udphdr) + sizeof(rxe_bth) +
+    sizeof(rxe_deth) + sizeof(ib_mad_hdr);
+
+/* Copy up to len bytes at offset of a packet into buf, zero-filling what lies
+ * past its end. */
+static void read_window(const rte_mbuf *packet, size_t offset, void *buf,
+                        size_t len)
+{
+    size_t avail = offset < rte_pktmbuf_pkt_len(packet) ?
+        std::min(len, rte_pktmbuf_pkt_len(packet) - offset) : 0;
+    const void *p = avail ?
+        rte_pktmbuf_read(packet, uint32_t(offset), uint32_t(avail), buf) : buf;
+    if (p != buf)
+        memcpy(buf, p, avail);
+    memset(static_cast<char *>(buf) + avail, 0, len - avail);
+}
+
+/* avail is the number of bytes from the UDP header to the end of the packet */
+static ib_mad_hdr *parse_headers(udphdr *udp, size_t avail, rxe_bth *&bth)
+{
+    bth = nullptr;
+    if (avail < sizeof(udphdr))
+        return nullptr;
+    /* Never trust the UDP length past the end of the packet */
+    size_t len = std::min<size_t>(ntohs(udp->len), avail);
+    bth = extract_bth(udp, len);
     if (!bth)
         return nullptr;
-    // TODO: validate BTH
     auto deth = extract_deth(bth, len);
     if (!deth)
         return nullptr;
-    // TODO: validate DETH
 
     if (__bth_qpn(const_cast<rxe_bth *>(bth)) != 1)
         return nullptr;
@@ -66,16 +298,236 @@ ib_mad_hdr *parser_context::parse_packet(rte_mbuf* packet) const
     if (!mad)
         return nullptr;
     
-    // TODO: check base version, class version, etc.
+    /* The remaining fields are checked by validate_cm() if enabled */
     if (mad->mgmt_class != IB_MGMT_CLASS_CM)
         return nullptr;
     
-    mbuf_mad(packet, mad);
     return mad;
 }
 
-parser_context::parser_context()
+/* Locate the BTH and CM MAD of a packet without updating its dynfields.
+ * Offsets are from the start of the packet data, 0 if not found. When the
+ * headers straddle segments they are parsed from a copy. */
+static void parse_headers(const rte_mbuf *packet, uint16_t &bth_offset,
+                          uint16_t &mad_offset)
 {
+    size_t udp_offset = mbuf_l3_offset(packet) + packet->l3_len;
+    size_t avail = udp_offset < rte_pktmbuf_pkt_len(packet) ?
+        rte_pktmbuf_pkt_len(packet) - udp_offset : 0;
+    alignas(8) char buf[header_window];
+    udphdr *udp;
+
+    assert(packet->l3_len && mbuf_is_udp(packet));
+
+    if (likely(packet->nb_segs == 1 ||
+               udp_offset + header_window <= rte_pktmbuf_data_len(packet))) {
+        udp = rte_pktmbuf_mtod_offset(packet, udphdr *, udp_offset);
+    } else {
+        read_window(packet, udp_offset, buf, sizeof(buf));
+        udp = reinterpret_cast<udphdr *>(buf);
+    }
+
+    rxe_bth *bth;
+    auto mad = parse_headers(udp, avail, bth);
+    auto offset = [&](const void *hdr) -> uint16_t {
+        if (!hdr)
+            return 0;
+        return uint16_t(udp_offset + ((const char *)hdr - (const char *)udp));
+    };
+    bth_offset = offset(bth);
+    mad_offset = offset(mad);
+}
+
+bool parser_context::parse_packet(rte_mbuf* packet) const
+{
+    if (parse_l2 && !parse_l2_l3(packet)) {
+        *ctcm_mbuf_bth_offset(&dynfield_offsets, packet) = 0;
+        *ctcm_mbuf_mad_offset(&dynfield_offsets, packet) = 0;
+        return false;
+    }
+    return parse_udp(packet);
+}
+
+bool parser_context::parse_udp(rte_mbuf* packet) const
+{
+    uint16_t bth = 0, mad = 0;
+    parse_headers(packet, bth, mad);
+    if (mad && unlikely(validate) && !validate_cm(packet))
+        mad = 0;
+    *ctcm_mbuf_bth_offset(&dynfield_offsets, packet) = bth;
+    *ctcm_mbuf_mad_offset(&dynfield_offsets, packet) = mad;
+    return mad;
+}
+
+#define IB_CM_CLASS_VERSION 2
+
+/* UDP length of a RoCE v2 packet carrying a MAD */
+static constexpr size_t cm_udp_len = sizeof(udphdr) + sizeof(rxe_bth) +
+    sizeof(rxe_deth) + IB_MGMT_MAD_SIZE + 4 /* icrc */;
+
+/* Mask the fields the ICRC does not cover, in a copy of the packet from its
+ * IP header: those that may change in flight, and the BTH reserved byte. */
+static void mask_icrc_fields(uint8_t *ip, size_t l3_len, bool ipv6)
+{
+    if (ipv6) {
+        auto ip6 = reinterpret_cast<ip6_hdr *>(ip);
+        /* Traffic class and flow label */
+        ip6->ip6_flow |= htonl(0x0fffffff);
+        ip6->ip6_hlim = 0xff;
+    } else {
+        auto ip4 = reinterpret_cast<iphdr *>(ip);
+        ip4->tos = 0xff;
+        ip4->ttl = 0xff;
+        ip4->check = 0xffff;
+    }
+
+    auto udp = reinterpret_cast<udphdr *>(ip + l3_len);
+    udp->check = 0xffff;
+    auto bth = reinterpret_cast<rxe_bth *>(udp + 1);
+    bth->qpn |= htonl(BTH_FECN_MASK | BTH_BECN_MASK | BTH_RESV6A_MASK);
+}
+
+bool parser_context::validate_cm(const rte_mbuf *packet) const
+{
+    const size_t ip_offset = mbuf_l3_offset(packet);
+    const size_t l3_len = packet->l3_len;
+    /* The ICRC covers the packet from the IP header, preceded by 8 bytes
+     * of ones in place of the LRH. */
+    alignas(8) uint8_t buf[8 + 0x1ff + cm_udp_len];
+    uint8_t *ip = buf + 8;
+
+    if (ip_offset + l3_len + cm_udp_len > rte_pktmbuf_pkt_len(packet))
+        return drop(bad_length);
+    read_window(packet, ip_offset, ip, l3_len + cm_udp_len);
+
+    auto udp = reinterpret_cast<udphdr *>(ip + l3_len);
+    auto bth = reinterpret_cast<rxe_bth *>(udp + 1);
+    auto deth = reinterpret_cast<rxe_deth *>(bth + 1);
+    auto mad = reinterpret_cast<ib_mad_hdr *>(deth + 1);
+
+    if (ntohs(udp->len) != cm_udp_len)
+        return drop(bad_length);
+    if (__bth_tver(bth) || __bth_pad(bth))
+        return drop(bad_bth);
+    if (__deth_qkey(deth) != IB_QP1_QKEY || __deth_sqp(deth) != 1)
+        return drop(bad_deth);
+    if (mad->base_version != IB_MGMT_BASE_VERSION ||
+        mad->class_version != IB_CM_CLASS_VERSION ||
+        mad->method != IB_MGMT_METHOD_SEND)
+        return drop(bad_mad);
+
+    uint32_t icrc;
+    memcpy(&icrc, ip + l3_len + cm_udp_len - 4, sizeof(icrc));
+    memset(buf, 0xff, 8);
+    mask_icrc_fields(ip, l3_len, mbuf_is_ipv6(packet));
+    if (rte_net_crc_calc(buf, uint32_t(8 + l3_len + cm_udp_len - 4),
+                         RTE_NET_CRC32_ETH) != icrc)
+        return drop(bad_icrc);
+
+    return true;
+}
+
+void parser_context::get_counters(struct ctcm_validation_counters *counters) const
+{
+    uint64_t totals[num_drop_reasons];
+
+    drops.sum(totals);
+    counters->bad_length = totals[bad_length];
+    counters->bad_bth = totals[bad_bth];
+    counters->bad_deth = totals[bad_deth];
+    counters->bad_mad = totals[bad_mad];
+    counters->bad_icrc = totals[bad_icrc];
+}
+
+void parser_context::get_stats(struct ctcm_stats *stats) const
+{
+    uint64_t totals[num_drop_reasons];
+
+    drops.sum_since_reset(totals);
+    stats->bad_length = totals[bad_length];
+    stats->bad_bth = totals[bad_bth];
+    stats->bad_deth = totals[bad_deth];
+    stats->bad_mad = totals[bad_mad];
+    stats->bad_icrc = totals[bad_icrc];
+}
+
+const ib_mad_hdr *parser_context::read_mad(const rte_mbuf *packet,
+                                           size_t offset, cm_mad_window &buf)
+{
+    if (likely(offset + sizeof(buf) <= rte_pktmbuf_data_len(packet)))
+        return rte_pktmbuf_mtod_offset(packet, const ib_mad_hdr *, offset);
+
+    read_window(packet, offset, buf, sizeof(buf));
+    return reinterpret_cast<const ib_mad_hdr *>(buf);
+}
+
+uint64_t parser_context::parse_burst(rte_mbuf **packets, unsigned n) const
+{
+    auto masks = classify::classify_packets(packets, n,
+                                            parse_l2_l3_burst(packets, n));
+
+    /* The common case: no CM packets, only record the BTH offsets */
+    uint64_t scalar = masks.cm | masks.slow;
+    for (unsigned i = 0; i < n; ++i) {
+        if (scalar & (1ull << i))
+            continue;
+        rte_mbuf *packet = packets[i];
+        rxe_bth *bth = nullptr;
+        if (masks.roce & (1ull << i))
+            bth = reinterpret_cast<rxe_bth *>(mbuf_udp(packet) + 1);
+        mbuf_bth(packet, bth);
+        mbuf_mad(packet, nullptr);
+    }
+
+    /* The L2/L3 headers of these were parsed along with the burst */
+    uint64_t cm = 0;
+    while (scalar) {
+        unsigned i = __builtin_ctzll(scalar);
+        scalar &= scalar - 1;
+        if (parse_udp(packets[i]))
+            cm |= 1ull << i;
+    }
+
+    return cm;
+}
+
+uint64_t parser_context::find_cm_burst(rte_mbuf **packets, unsigned n,
+                                       const ib_mad_hdr **mads,
+                                       cm_mad_window *bufs) const
+{
+    auto masks = classify::classify_packets(packets, n,
+                                            parse_l2_l3_burst(packets, n));
+
+    uint64_t scalar = masks.cm | masks.slow;
+    uint64_t cm = 0;
+    while (scalar) {
+        unsigned i = __builtin_ctzll(scalar);
+        scalar &= scalar - 1;
+        uint16_t bth, mad;
+        parse_headers(packets[i], bth, mad);
+        if (mad && unlikely(validate) && !validate_cm(packets[i]))
+            mad = 0;
+        if (mad) {
+            mads[i] = read_mad(packets[i], mad, bufs[i]);
+            cm |= 1ull << i;
+        }
+    }
+
+    return cm;
+}
+
+parser_context::parser_context(bool parse_l2, bool validate, int socket) :
+    parse_l2(parse_l2), validate(validate), drops(socket)
+{
+    if (validate) {
+        /* Falls back to the scalar CRC on CPUs without these instructions */
+#ifdef RTE_ARCH_ARM64
+        rte_net_crc_set_alg(RTE_NET_CRC_NEON);
+#else
+        rte_net_crc_set_alg(RTE_NET_CRC_SSE42);
+#endif
+    }
+
     std::array dynfields{
         rte_mbuf_dynfield{
             "BTH",
@@ -5,6 +5,10 @@
 #pragma once
 
 #include "libconntrack-cm.h"
+#include "ip_addr.h"
+#include "lcore_counters.h"
+
+#include <netinet/udp.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -15,10 +19,20 @@ extern "C" {
 #endif
 
 struct ib_mad_hdr;
+struct ip6_hdr;
+
+/* The part of a CM MAD read by the tracker: the MAD header and the CM message
+ * fields up to the REQ's primary local ACK timeout */
+typedef uint8_t cm_mad_window[128] __attribute__((aligned(8)));
 
 class parser_context {
 public:
-    parser_context();
+    /* With parse_l2, the parser fills in the mbufs' l2_len, l3_len and
+     * packet_type itself instead of relying on the caller. With validate,
+     * packets that look like CM are dropped unless their ICRC, BTH, DETH
+     * and MAD header are valid. */
+    explicit parser_context(bool parse_l2 = false, bool validate = false,
+                            int socket = heap_socket);
 
     const struct rxe_bth *mbuf_bth(const struct rte_mbuf *packet) const
     {
@@ -40,34 +54,165 @@ public:
         ctcm_mbuf_set_mad(&dynfield_offsets, packet, mad);
     }
 
-    /* Return the MAD header if the UDP packet contains a CM MAD. */
-    ib_mad_hdr *parse_packet(rte_mbuf* packet) const;
+    /* Record the BTH and MAD offsets of a packet in its dynfields. Returns
+     * true if the UDP packet contains a CM MAD. The headers may span
+     * several segments. */
+    bool parse_packet(rte_mbuf* packet) const;
+
+    /* Return the CM MAD window at offset: in place if the first segment
+     * holds it, which is the common case, or else copied into buf,
+     * zero-filled past the end of the packet. */
+    static const ib_mad_hdr *read_mad(const rte_mbuf *packet, size_t offset,
+                                      cm_mad_window &buf);
+
+    /* The CM MAD window of a parsed packet, or nullptr if it has none */
+    const ib_mad_hdr *read_mad(const rte_mbuf *packet, cm_mad_window &buf) const
+    {
+        uint16_t offset = *ctcm_mbuf_mad_offset(&dynfield_offsets,
+                                                const_cast<rte_mbuf *>(packet));
+        return offset ? read_mad(packet, offset, buf) : nullptr;
+    }
+
+    /* Parse up to CTCM_MAX_BURST packets. Returns a mask of the packets
+     * containing a CM MAD. */
+    uint64_t parse_burst(rte_mbuf **packets, unsigned n) const;
+
+    /* Like parse_burst, but leave the dynfields untouched. For each packet
+     * in the returned mask, mads[i] points to its CM MAD window, in the
+     * packet or in bufs[i]. */
+    uint64_t find_cm_burst(rte_mbuf **packets, unsigned n,
+                           const ib_mad_hdr **mads,
+                           cm_mad_window *bufs) const;
+
+    void get_counters(struct ctcm_validation_counters *counters) const;
+    /* Fill in the validation drops of stats since reset_stats() */
+    void get_stats(struct ctcm_stats *stats) const;
+    void reset_stats() { drops.reset(); }
 
     int dynfield_bth_offset() const { return dynfield_offsets.bth; }
     int dynfield_mad_offset() const { return dynfield_offsets.mad; }
 
 private:
     struct ctcm_dynfield_offsets dynfield_offsets;
+    bool parse_l2;
+    bool validate;
+
+    enum drop_reason {
+        bad_length,
+        bad_bth,
+        bad_deth,
+        bad_mad,
+        bad_icrc,
+        num_drop_reasons,
+    };
+    /* Parsing may run on several threads at once */
+    mutable lcore_counters<num_drop_reasons> drops;
+
+    uint64_t parse_l2_l3_burst(rte_mbuf **packets, unsigned n) const;
+    /* parse_packet, for a UDP packet whose L2/L3 headers are known */
+    bool parse_udp(rte_mbuf* packet) const;
+
+    /* Only called for packets that carry a CM MAD, so the work stays off
+     * the data path */
+    bool validate_cm(const rte_mbuf *packet) const;
+
+    bool drop(drop_reason reason) const
+    {
+        drops.add(reason);
+        return false;
+    }
 };
 
+/* Tunnelled packets follow the DPDK offload conventions: outer_l2_len and
+ * outer_l3_len cover the outer Ethernet and IP headers, l2_len covers the
+ * outer UDP header, the VXLAN/GENEVE header and the inner Ethernet header,
+ * and the inner header types are in the RTE_PTYPE_INNER_* bits. The helpers
+ * below return the RoCE headers, inner ones for tunnelled packets. */
+static inline bool mbuf_tunnel(const struct rte_mbuf *packet)
+{
+    return packet->packet_type & RTE_PTYPE_TUNNEL_MASK;
+}
+
+static inline size_t mbuf_l3_offset(const struct rte_mbuf *packet)
+{
+    size_t offset = packet->l2_len;
+    if (unlikely(mbuf_tunnel(packet)))
+        offset += packet->outer_l2_len + packet->outer_l3_len;
+    return offset;
+}
+
+static inline bool mbuf_is_udp(const struct rte_mbuf *packet)
+{
+    if (likely(!mbuf_tunnel(packet)))
+        return (packet->packet_type & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP;
+    return (packet->packet_type & RTE_PTYPE_INNER_L4_MASK) == RTE_PTYPE_INNER_L4_UDP;
+}
+
+static inline bool mbuf_is_ipv4(const struct rte_mbuf *packet)
+{
+    if (likely(!mbuf_tunnel(packet)))
+        return RTE_ETH_IS_IPV4_HDR(packet->packet_type);
+    switch (packet->packet_type & RTE_PTYPE_INNER_L3_MASK) {
+    case RTE_PTYPE_INNER_L3_IPV4:
+    case RTE_PTYPE_INNER_L3_IPV4_EXT:
+    case RTE_PTYPE_INNER_L3_IPV4_EXT_UNKNOWN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static inline bool mbuf_is_ipv6(const struct rte_mbuf *packet)
+{
+    if (likely(!mbuf_tunnel(packet)))
+        return RTE_ETH_IS_IPV6_HDR(packet->packet_type);
+    switch (packet->packet_type & RTE_PTYPE_INNER_L3_MASK) {
+    case RTE_PTYPE_INNER_L3_IPV6:
+    case RTE_PTYPE_INNER_L3_IPV6_EXT:
+    case RTE_PTYPE_INNER_L3_IPV6_EXT_UNKNOWN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* The VNI of a tunnelled packet, which VXLAN and GENEVE headers both carry in
+ * bytes 4-6, or 0 */
+static inline vni_t mbuf_vni(const struct rte_mbuf *packet)
+{
+    if (likely(!mbuf_tunnel(packet)))
+        return 0;
+    auto vni = rte_pktmbuf_mtod_offset(packet, const uint8_t *,
+                                       packet->outer_l2_len +
+                                       packet->outer_l3_len +
+                                       sizeof(udphdr) + 4);
+    return vni_t(vni[0]) << 16 | vni_t(vni[1]) << 8 | vni[2];
+}
+
 static inline const struct iphdr *mbuf_ip(const struct rte_mbuf *packet)
 {
-    assert(RTE_ETH_IS_IPV4_HDR(packet->packet_type));
-    return rte_pktmbuf_mtod_offset(packet, struct iphdr *, packet->l2_len);
+    assert(mbuf_is_ipv4(packet));
+    return rte_pktmbuf_mtod_offset(packet, struct iphdr *, mbuf_l3_offset(packet));
+}
+
+static inline const struct ip6_hdr *mbuf_ip6(const struct rte_mbuf *packet)
+{
+    assert(mbuf_is_ipv6(packet));
+    return rte_pktmbuf_mtod_offset(packet, struct ip6_hdr *, mbuf_l3_offset(packet));
 }
 
 static inline const struct udphdr *mbuf_udp(const struct rte_mbuf *packet)
 {
-    assert(packet->l3_len && 
-           ((packet->packet_type & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP));
-    return rte_pktmbuf_mtod_offset(packet, struct udphdr *, packet->l2_len + packet->l3_len);
+    assert(packet->l3_len && mbuf_is_udp(packet));
+    return rte_pktmbuf_mtod_offset(packet, struct udphdr *,
+                                   mbuf_l3_offset(packet) + packet->l3_len);
 }
 
 static inline const struct rxe_bth *mbuf_bth(const struct rte_mbuf *packet)
 {
     assert(packet->l3_len && packet->l4_len);
     return rte_pktmbuf_mtod_offset(packet, struct rxe_bth *,
-                                   packet->l2_len + packet->l3_len +
+                                   mbuf_l3_offset(packet) + packet->l3_len +
                                    packet->l4_len);
 }
 
@@ -76,6 +221,11 @@ static inline struct iphdr *mbuf_ip(struct rte_mbuf *packet)
     return const_cast<iphdr *>(mbuf_ip(static_cast<const rte_mbuf *>(packet)));
 }
 
+static inline struct ip6_hdr *mbuf_ip6(struct rte_mbuf *packet)
+{
+    return const_cast<ip6_hdr *>(mbuf_ip6(static_cast<const rte_mbuf *>(packet)));
+}
+
 static inline struct udphdr *mbuf_udp(struct rte_mbuf *packet)
 {
     return const_cast<udphdr *>(mbuf_udp(static_cast<const rte_mbuf *>(packet)));
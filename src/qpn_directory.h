@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_table.h"
+
+#include <stdint.h>
+
+#include <rte_branch_prediction.h>
+#include <rte_prefetch.h>
+
+#include <tuple>
+
+/* QPN table made of a small per-host directory and direct-indexed pages.
+ *
+ * NICs allocate QPNs densely from a small range, so the QPNs a host uses fall
+ * in a few pages of page_size consecutive QPNs. The directory maps a host's
+ * address to the run of page numbers it spans; a lookup finds the host, then
+ * reads the value straight from the page holding the QPN, without hashing or
+ * comparing the QPN. A host's run grows to cover new QPNs up to max_span
+ * pages; QPNs further out go to an overflow hash table, so hosts with
+ * scattered QPNs still work, only slower than with the plain table.
+ *
+ * Values are QPNs, 0 marks an empty entry. */
+template <typename Addr, typename Key, typename Hash>
+class qpn_directory
+{
+public:
+	static constexpr unsigned page_bits = 6;
+	static constexpr uint32_t page_size = 1u << page_bits;
+	/* Pages a host may span, 64K QPNs */
+	static constexpr uint32_t max_span = 1024;
+
+	explicit qpn_directory(const Hash &hash = Hash(), int socket = heap_socket) :
+		directory(64, hash, table_sizing{0, false, socket}),
+		hosts(numa_allocator<host>(socket)),
+		free_hosts(numa_allocator<flow_handle>(socket)),
+		entries(numa_allocator<uint32_t>(socket)),
+		page_counts(numa_allocator<uint16_t>(socket)),
+		free_pages(numa_allocator<uint32_t>(socket)),
+		overflow(64, hash, table_sizing{0, false, socket})
+	{}
+
+	uint32_t find(const Key &key) const
+	{
+		flow_handle h = directory.find(std::get<0>(key));
+		if (h == invalid_flow_handle)
+			return 0;
+		return find(hosts[h], key);
+	}
+
+	/* Start loading the directory entry of key's host */
+	void prefetch(const Key &key) const
+	{
+		directory.prefetch(std::get<0>(key));
+	}
+
+	/* Start loading key's value, once its directory entry is in the
+	 * cache. Bulk lookups go through prefetch, prefetch_value and find
+	 * in turn, so that each stage's cache misses overlap. */
+	void prefetch_value(const Key &key) const
+	{
+		flow_handle h = directory.find(std::get<0>(key));
+		if (h == invalid_flow_handle)
+			return;
+		const host &hst = hosts[h];
+		const uint32_t qpn = std::get<1>(key);
+		uint32_t idx = (qpn >> page_bits) - hst.base;
+		if (likely(idx < hst.pages.size())) {
+			if (hst.pages[idx] != no_page)
+				rte_prefetch0(page_entry(hst.pages[idx], qpn));
+		} else if (!overflow.empty()) {
+			overflow.prefetch(key);
+		}
+	}
+
+	/* Returns false if the key is already in the table */
+	bool insert(const Key &key, uint32_t value)
+	{
+		const uint32_t qpn = std::get<1>(key);
+		flow_handle h = directory.find(std::get<0>(key));
+		if (h == invalid_flow_handle)
+			h = add_host(std::get<0>(key));
+		host &hst = hosts[h];
+
+		uint32_t *slot = page_slot(hst, qpn >> page_bits);
+		if (slot) {
+			if (*page_entry(*slot, qpn))
+				return false;
+			*page_entry(*slot, qpn) = value;
+			++page_counts[*slot];
+		} else if (!overflow.insert(key, value)) {
+			return false;
+		}
+		++hst.count;
+		++count;
+		return true;
+	}
+
+	bool erase(const Key &key)
+	{
+		const uint32_t qpn = std::get<1>(key);
+		flow_handle h = directory.find(std::get<0>(key));
+		if (h == invalid_flow_handle)
+			return false;
+		host &hst = hosts[h];
+
+		uint32_t idx = (qpn >> page_bits) - hst.base;
+		if (idx < hst.pages.size() && hst.pages[idx] != no_page) {
+			uint32_t page = hst.pages[idx];
+			if (!*page_entry(page, qpn))
+				return false;
+			*page_entry(page, qpn) = 0;
+			if (!--page_counts[page]) {
+				free_pages.push_back(page);
+				hst.pages[idx] = no_page;
+			}
+		} else if (!overflow.erase(key)) {
+			return false;
+		}
+
+		--count;
+		if (!--hst.count)
+			remove_host(h, std::get<0>(key));
+		return true;
+	}
+
+	size_t size() const { return count; }
+	/* Hosts with at least one entry */
+	size_t host_count() const { return directory.size(); }
+	/* Bytes allocated for pages */
+	size_t page_memory() const { return entries.capacity() * sizeof(uint32_t); }
+
+	/* Bytes allocated overall */
+	size_t memory() const
+	{
+		size_t bytes = directory.memory() + overflow.memory() +
+			page_memory() +
+			page_counts.capacity() * sizeof(uint16_t) +
+			free_pages.capacity() * sizeof(uint32_t) +
+			hosts.capacity() * sizeof(host) +
+			free_hosts.capacity() * sizeof(flow_handle);
+		for (const host &hst : hosts)
+			bytes += hst.pages.capacity() * sizeof(uint32_t);
+		return bytes;
+	}
+
+private:
+	static constexpr uint32_t no_page = UINT32_MAX;
+
+	struct host
+	{
+		explicit host(int socket) : pages(numa_allocator<uint32_t>(socket)) {}
+
+		/* Page number of pages[0] */
+		uint32_t base = 0;
+		/* Entries, in pages and in the overflow table */
+		uint32_t count = 0;
+		numa_vector<uint32_t> pages;
+	};
+
+	flow_table<Addr, Hash> directory;
+	numa_vector<host> hosts;
+	numa_vector<flow_handle> free_hosts;
+	/* page_size values per page */
+	numa_vector<uint32_t> entries;
+	numa_vector<uint16_t> page_counts;
+	numa_vector<uint32_t> free_pages;
+	flow_table<Key, Hash> overflow;
+	size_t count = 0;
+
+	int socket() const { return hosts.get_allocator().socket; }
+
+	uint32_t *page_entry(uint32_t page, uint32_t qpn)
+	{ return &entries[size_t(page) * page_size + (qpn & (page_size - 1))]; }
+
+	const uint32_t *page_entry(uint32_t page, uint32_t qpn) const
+	{ return &entries[size_t(page) * page_size + (qpn & (page_size - 1))]; }
+
+	uint32_t find(const host &hst, const Key &key) const
+	{
+		const uint32_t qpn = std::get<1>(key);
+		uint32_t idx = (qpn >> page_bits) - hst.base;
+		if (likely(idx < hst.pages.size())) {
+			uint32_t page = hst.pages[idx];
+			return page != no_page ? *page_entry(page, qpn) : 0;
+		}
+		if (overflow.empty())
+			return 0;
+		flow_handle v = overflow.find(key);
+		return v != invalid_flow_handle ? v : 0;
+	}
+
+	flow_handle add_host(const Addr &addr)
+	{
+		flow_handle h;
+		if (!free_hosts.empty()) {
+			h = free_hosts.back();
+			free_hosts.pop_back();
+		} else {
+			h = flow_handle(hosts.size());
+			hosts.emplace_back(socket());
+		}
+		directory.insert(addr, h);
+		return h;
+	}
+
+	void remove_host(flow_handle h, const Addr &addr)
+	{
+		for (uint32_t page : hosts[h].pages)
+			if (page != no_page)
+				free_pages.push_back(page);
+		hosts[h] = host(socket());
+		free_hosts.push_back(h);
+		directory.erase(addr);
+	}
+
+	/* The page of page number pno in host's run, allocated if needed.
+	 * Returns nullptr if pno is beyond the span a host may have. */
+	uint32_t *page_slot(host &hst, uint32_t pno)
+	{
+		if (hst.pages.empty()) {
+			hst.base = pno;
+			hst.pages.push_back(no_page);
+		} else if (pno < hst.base) {
+			if (hst.base + hst.pages.size() - pno > max_span)
+				return nullptr;
+			hst.pages.insert(hst.pages.begin(), hst.base - pno, no_page);
+			hst.base = pno;
+		} else if (pno - hst.base >= hst.pages.size()) {
+			if (pno - hst.base >= max_span)
+				return nullptr;
+			hst.pages.resize(pno - hst.base + 1, no_page);
+		}
+
+		uint32_t &slot = hst.pages[pno - hst.base];
+		if (slot == no_page)
+			slot = alloc_page();
+		return &slot;
+	}
+
+	uint32_t alloc_page()
+	{
+		uint32_t page;
+		if (!free_pages.empty()) {
+			page = free_pages.back();
+			free_pages.pop_back();
+		} else {
+			page = uint32_t(page_counts.size());
+			page_counts.push_back(0);
+			entries.resize(entries.size() + page_size);
+		}
+		return page;
+	}
+};
@@ -0,0 +1,203 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "qpn_table.h"
+#include "logging.h"
+
+#include <rte_hash.h>
+#include <rte_hash_crc.h>
+#include <rte_lcore.h>
+
+#include <cassert>
+#include <stdexcept>
+#include <atomic>
+
+/* rte_hash names are global, count the tables of all contexts */
+static std::atomic<unsigned> instance{0};
+
+template <typename Addr>
+qpn_table<Addr>::qpn_table(qpn_table_mode mode, uint32_t seed,
+			   const table_sizing &sizing) :
+	map(1024, flow_key_hash(seed), local_sizing(mode, sizing))
+{
+	if (mode == qpn_table_mode::direct)
+		direct = make_numa<qpn_directory<Addr, key_type, flow_key_hash>>(
+			sizing.socket, flow_key_hash(seed), sizing.socket);
+	if (mode != qpn_table_mode::concurrent && mode != qpn_table_mode::shared)
+		return;
+
+	char name[RTE_HASH_NAMESIZE];
+	snprintf(name, sizeof(name), "ctcm_qpn_%u", instance++);
+
+	rte_hash_parameters params = {};
+	params.name = name;
+	params.entries = uint32_t(std::max<size_t>(concurrent_entries, sizing.entries));
+	params.key_len = sizeof(hash_key);
+	params.hash_func = rte_hash_crc;
+	params.hash_func_init_val = seed;
+	params.socket_id = sizing.socket == heap_socket ? int(rte_socket_id()) :
+							  sizing.socket;
+	params.extra_flag = RTE_HASH_EXTRA_FLAGS_RW_CONCURRENCY_LF;
+	if (mode == qpn_table_mode::shared)
+		params.extra_flag |= RTE_HASH_EXTRA_FLAGS_MULTI_WRITER_ADD;
+
+	hash = rte_hash_create(&params);
+	if (!hash)
+		throw std::runtime_error("error creating dpdk hash table");
+}
+
+/* The flow_table only backs the local mode, the others keep it small */
+template <typename Addr>
+table_sizing qpn_table<Addr>::local_sizing(qpn_table_mode mode,
+					   const table_sizing &sizing)
+{
+	if (mode == qpn_table_mode::local)
+		return sizing;
+	table_sizing unused;
+	unused.socket = sizing.socket;
+	return unused;
+}
+
+template <typename Addr>
+qpn_table<Addr>::~qpn_table()
+{
+	rte_hash_free(hash);
+}
+
+template <typename Addr>
+size_t qpn_table<Addr>::size() const
+{
+	if (hash)
+		return size_t(std::max(rte_hash_count(hash), 0));
+	if (direct)
+		return direct->size();
+	return map.size();
+}
+
+template <typename Addr>
+qpn_t qpn_table<Addr>::find_concurrent(const key_type &key) const
+{
+	hash_key k(key);
+	void *data;
+
+	if (rte_hash_lookup_data(hash, &k, &data) < 0)
+		return 0;
+	return qpn_t(uintptr_t(data));
+}
+
+template <typename Addr>
+unsigned qpn_table<Addr>::find_bulk(const Addr *ips, const qpn_t *qpns,
+				   qpn_t *out, unsigned n) const
+{
+	unsigned found = 0;
+
+	assert(n <= bulk_max);
+
+	if (hash) {
+		hash_key keys[bulk_max];
+		const void *key_ptrs[bulk_max];
+		void *data[bulk_max];
+		uint64_t hits = 0;
+
+		for (unsigned i = 0; i < n; ++i) {
+			keys[i] = hash_key(key_type(ips[i], qpns[i]));
+			key_ptrs[i] = &keys[i];
+		}
+		if (rte_hash_lookup_bulk_data(hash, key_ptrs, n, &hits, data) < 0)
+			hits = 0;
+		for (unsigned i = 0; i < n; ++i) {
+			out[i] = hits & (1ull << i) ? qpn_t(uintptr_t(data[i])) : 0;
+			found += out[i] != 0;
+		}
+		return found;
+	}
+
+	if (direct) {
+		for (unsigned i = 0; i < n; ++i)
+			direct->prefetch(key_type(ips[i], qpns[i]));
+		for (unsigned i = 0; i < n; ++i)
+			direct->prefetch_value(key_type(ips[i], qpns[i]));
+		for (unsigned i = 0; i < n; ++i) {
+			out[i] = direct->find(key_type(ips[i], qpns[i]));
+			found += out[i] != 0;
+		}
+		return found;
+	}
+
+	uint32_t hashes[bulk_max];
+
+	for (unsigned i = 0; i < n; ++i) {
+		hashes[i] = map.hash_of(key_type(ips[i], qpns[i]));
+		map.prefetch_hash(hashes[i]);
+	}
+
+	for (unsigned i = 0; i < n; ++i) {
+		flow_handle qpn = map.find(key_type(ips[i], qpns[i]), hashes[i]);
+		out[i] = qpn != invalid_flow_handle ? qpn : 0;
+		found += out[i] != 0;
+	}
+
+	return found;
+}
+
+template <typename Addr>
+bool qpn_table<Addr>::insert(const key_type &key, qpn_t qpn)
+{
+	if (direct)
+		return direct->insert(key, qpn);
+	if (!hash)
+		return map.insert(key, qpn);
+
+	hash_key k(key);
+	void *data;
+	if (rte_hash_lookup_data(hash, &k, &data) >= 0)
+		return false;
+
+	int ret = rte_hash_add_key_data(hash, &k, reinterpret_cast<void *>(uintptr_t(qpn)));
+	if (ret < 0) {
+		log_debug("Failed adding QP to table: %d\n", ret);
+		return false;
+	}
+	return true;
+}
+
+template <typename Addr>
+bool qpn_table<Addr>::erase(const key_type &key)
+{
+	if (direct)
+		return direct->erase(key);
+	if (!hash)
+		return map.erase(key);
+
+	hash_key k(key);
+	int32_t pos = rte_hash_del_key(hash, &k);
+	if (pos < 0)
+		return false;
+	/* The lock-free rte_hash leaves deleted keys' slots to the RCU
+	 * variable to reclaim. Without one, free them here, or the table
+	 * fills up with torn-down connections. */
+	if (!rcu_attached.load(std::memory_order_relaxed))
+		rte_hash_free_key_with_position(hash, pos);
+	return true;
+}
+
+template <typename Addr>
+int qpn_table<Addr>::rcu_qsbr_add(rte_rcu_qsbr *v)
+{
+	if (!hash) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rte_hash_rcu_config config = {};
+	config.v = v;
+	config.mode = RTE_HASH_QSBR_MODE_DQ;
+	if (rte_hash_rcu_qsbr_add(hash, &config))
+		return -1;
+	rcu_attached.store(true, std::memory_order_relaxed);
+	return 0;
+}
+
+template class qpn_table<ip4_addr>;
+template class qpn_table<ip_addr>;
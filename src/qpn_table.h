@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <memory>
+#include <tuple>
+
+#include <rte_branch_prediction.h>
+
+#include "flow_table.h"
+#include "ip_addr.h"
+#include "qpn_directory.h"
+
+struct rte_hash;
+struct rte_rcu_qsbr;
+
+typedef uint32_t qpn_t;
+/* Dest IP, Dest QPN */
+template <typename Addr>
+using qpn_key = std::tuple<Addr, qpn_t>;
+typedef qpn_key<ip4_addr> flow_key;
+typedef qpn_key<ip_addr> flow_key6;
+
+struct flow_key_hash : seeded_hash
+{
+	using seeded_hash::seeded_hash;
+
+	uint32_t operator()(const flow_key &key) const
+	{ return hash_mix32(crc_key(std::get<0>(key), std::get<1>(key), seed)); }
+
+	uint32_t operator()(const flow_key6 &key) const
+	{
+		return hash_mix32(rte_hash_crc_4byte(std::get<1>(key),
+						     std::get<0>(key).crc(seed)));
+	}
+
+	/* Host addresses alone, for qpn_directory */
+	uint32_t operator()(const ip4_addr &addr) const
+	{ return hash_mix32(crc_key(addr, 0, seed)); }
+
+	uint32_t operator()(const ip_addr &addr) const
+	{ return hash_mix32(addr.crc(seed)); }
+};
+
+enum class qpn_table_mode {
+	/* Only accessed from the thread processing CM packets */
+	local,
+	/* Likewise, backed by a qpn_directory */
+	direct,
+	/* Queried from any thread */
+	concurrent,
+	/* Queried from any thread, and updated from several */
+	shared,
+};
+
+/* Maps established flows to their source QPN.
+ *
+ * In local mode the table is only accessed from the thread processing CM
+ * packets, and is either a hash table or, in direct mode, a qpn_directory. In
+ * concurrent mode it is backed by a lock-free rte_hash: queries
+ * may run on any thread while the tracker updates the table, and deleted
+ * entries are reclaimed once the readers registered on an rte_rcu_qsbr
+ * variable have gone through a quiescent state, or right away while no
+ * variable is attached. Shared mode also lets the
+ * shards of a sharded context update it from their lcores. */
+template <typename Addr>
+class qpn_table
+{
+public:
+	using key_type = qpn_key<Addr>;
+
+	/* seed randomizes the hash function, see seeded_hash */
+	qpn_table(qpn_table_mode mode, uint32_t seed,
+		  const table_sizing &sizing = table_sizing());
+	~qpn_table();
+
+	qpn_table(const qpn_table &) = delete;
+	qpn_table &operator=(const qpn_table &) = delete;
+
+	qpn_t find(const key_type &key) const
+	{
+		if (likely(!hash)) {
+			if (direct)
+				return direct->find(key);
+			flow_handle qpn = map.find(key);
+			return qpn != invalid_flow_handle ? qpn : 0;
+		}
+		return find_concurrent(key);
+	}
+
+	/* Look up n keys, hashing and prefetching them all before resolving
+	 * them. Returns the number of keys found; missing ones get 0. */
+	unsigned find_bulk(const Addr *ips, const qpn_t *qpns,
+			   qpn_t *out, unsigned n) const;
+
+	/* Largest n accepted by find_bulk */
+	static constexpr unsigned bulk_max = 64;
+
+	/* Returns false if the key is already in the table, or the table is
+	 * full. */
+	bool insert(const key_type &key, qpn_t qpn);
+	bool erase(const key_type &key);
+
+	size_t size() const;
+
+	/* Step a resize of the hash table of the local mode, see
+	 * flow_table::migrate */
+	void migrate(uint32_t n) { map.migrate(n); }
+
+	/* Attach the RCU variable the query threads report quiescent states
+	 * to. Only valid in concurrent mode. Entries deleted before are freed
+	 * on deletion. */
+	int rcu_qsbr_add(rte_rcu_qsbr *v);
+
+	bool concurrent() const { return hash; }
+
+	/* Entries in the rte_hash of the concurrent mode, which cannot grow */
+	static constexpr uint32_t concurrent_entries = 1 << 16;
+
+private:
+	/* Key layout of the rte_hash */
+	struct hash_key
+	{
+		Addr ip;
+		qpn_t qpn;
+
+		hash_key() {}
+		hash_key(const key_type &key) :
+			ip(std::get<0>(key)), qpn(std::get<1>(key))
+		{}
+	};
+
+	/* QPNs are 24-bit, so they never collide with invalid_flow_handle */
+	flow_table<key_type, flow_key_hash> map;
+	numa_ptr<qpn_directory<Addr, key_type, flow_key_hash>> direct;
+	rte_hash *hash = nullptr;
+	std::atomic<bool> rcu_attached{false};
+
+	qpn_t find_concurrent(const key_type &key) const;
+	static table_sizing local_sizing(qpn_table_mode mode,
+					 const table_sizing &sizing);
+};
+
+/* IPv4 flows keep their own table, so that their lookups do not pay for the
+ * IPv6 key: a slot is 16 bytes with an IPv4 key, and 28 with an IPv6 one, so
+ * an IPv6 lookup and its first probes stay within two cache lines. */
+typedef qpn_table<ip4_addr> qpn_table4;
+typedef qpn_table<ip_addr> qpn_table6;
+
+/* The QPN tables of a context, or of all the shards of a sharded one */
+struct qpn_index
+{
+	qpn_index(qpn_table_mode mode, uint32_t seed,
+		  const table_sizing &sizing = table_sizing()) :
+		v4(mode, seed, sizing), v6(mode, seed, sizing)
+	{}
+
+	qpn_table4 v4;
+	qpn_table6 v6;
+};
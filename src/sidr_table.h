@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_slab.h"
+#include "flow_table.h"
+#include "qpn_table.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+
+/* UD services resolved through SIDR.
+ *
+ * A SIDR_REQ is kept as a pending request until the matching SIDR_REP comes
+ * back from the other side, which then maps (peer IP, service QPN) to the
+ * service's Q_Key. SIDR has no teardown, so both kinds of entries carry an
+ * expiry tick: lookups ignore expired entries, and sweep() reclaims them a
+ * few at a time. An entry takes 8 bytes in the slab for its expiry and Q_Key,
+ * plus its key, and no timer links. */
+class sidr_table
+{
+public:
+	/* seed randomizes the hash function, see seeded_hash */
+	explicit sidr_table(uint32_t seed, const table_sizing &sizing = table_sizing()) :
+		entries(sizing),
+		requests(1024, flow_key_hash(seed), sizing),
+		services(1024, flow_key_hash(seed), sizing)
+	{}
+
+	/* Who sent the SIDR_REQ, or which side the service runs on */
+	enum side : uint8_t {
+		remote,
+		local,
+	};
+
+	struct mapping
+	{
+		uint32_t qkey;
+		side service;
+	};
+
+	/* Record a SIDR_REQ sent to or received from peer. Returns false if
+	 * the table is full. */
+	bool add_request(const ip_addr &peer, uint32_t request_id, side requester,
+			 uint32_t expiry)
+	{
+		flow_handle h = requests.find(request_key(peer, request_id));
+		if (h == invalid_flow_handle) {
+			h = alloc(request_key(peer, request_id), requester);
+			if (h == invalid_flow_handle)
+				return false;
+			requests.insert(request_key(peer, request_id), h);
+		}
+		entries.cold(h).kind = requester;
+		entries.hot(h).expiry = expiry;
+		return true;
+	}
+
+	/* Complete the pending request answered by a SIDR_REP from responder,
+	 * adding or refreshing the mapping of the service if it was accepted.
+	 * Returns false if the request was not seen. */
+	bool add_reply(const ip_addr &peer, uint32_t request_id, side responder,
+		       bool accepted, qpn_t qpn, uint32_t qkey, uint32_t expiry,
+		       uint32_t now)
+	{
+		flow_handle h = requests.find(request_key(peer, request_id));
+		if (h == invalid_flow_handle || entries.cold(h).kind == responder ||
+		    expired(h, now))
+			return false;
+		free(h);
+		if (!accepted)
+			return true;
+
+		flow_key6 key(peer, qpn);
+		h = services.find(key);
+		if (h == invalid_flow_handle) {
+			/* Reuses the slot of the request just freed */
+			h = alloc(key, service_kind(responder));
+			services.insert(key, h);
+		}
+		entries.cold(h).kind = service_kind(responder);
+		entries.hot(h) = entry{expiry, qkey};
+		return true;
+	}
+
+	/* Find the service with QP number qpn resolved between the local host
+	 * and peer */
+	bool find(const ip_addr &peer, qpn_t qpn, uint32_t now, mapping &m) const
+	{
+		flow_handle h = services.find(flow_key6(peer, qpn));
+		if (h == invalid_flow_handle || expired(h, now))
+			return false;
+		m.qkey = entries.hot(h).qkey;
+		m.service = entries.cold(h).kind == local_service ? local : remote;
+		return true;
+	}
+
+	/* Free the expired entries among the next n slab slots */
+	void sweep(uint32_t now, unsigned n)
+	{
+		flow_handle end = entries.end();
+
+		for (n = std::min<unsigned>(n, end); n; --n) {
+			flow_handle h = sweep_hand;
+			sweep_hand = sweep_hand + 1 < end ? sweep_hand + 1 : 0;
+			if (entries.allocated(h) && expired(h, now))
+				free(h);
+		}
+	}
+
+	/* Bound the number of pending requests and mappings, 0 for no limit */
+	void set_limit(uint32_t max) { max_entries = max; }
+
+	size_t size() const { return entries.size(); }
+	size_t mappings() const { return services.size(); }
+
+	/* See flow_table::migrate */
+	void migrate(uint32_t n)
+	{
+		requests.migrate(n);
+		services.migrate(n);
+	}
+
+private:
+	/* Pending requests by SIDR_REQ sender, then mappings by service side */
+	enum kind_t : uint8_t {
+		remote_request = remote,
+		local_request = local,
+		remote_service,
+		local_service,
+	};
+
+	struct entry
+	{
+		uint32_t expiry;
+		uint32_t qkey;
+	};
+
+	/* The table key the entry was added with: a request ID or a QPN */
+	struct entry_key
+	{
+		ip_addr peer;
+		uint32_t id;
+		uint8_t kind;
+	};
+
+	flow_slab<entry, entry_key> entries;
+	flow_table<flow_key6, flow_key_hash> requests;
+	flow_table<flow_key6, flow_key_hash> services;
+	uint32_t max_entries = 0;
+	flow_handle sweep_hand = 0;
+
+	static flow_key6 request_key(const ip_addr &peer, uint32_t request_id)
+	{ return flow_key6(peer, request_id); }
+
+	static uint8_t service_kind(side responder)
+	{ return responder == local ? local_service : remote_service; }
+
+	/* Ticks wrap around, compare them by distance */
+	bool expired(flow_handle h, uint32_t now) const
+	{ return int32_t(entries.hot(h).expiry - now) < 0; }
+
+	flow_handle alloc(const flow_key6 &key, uint8_t kind)
+	{
+		if (max_entries && entries.size() >= max_entries)
+			return invalid_flow_handle;
+		flow_handle h = entries.alloc();
+		entries.cold(h) = entry_key{std::get<0>(key), std::get<1>(key), kind};
+		return h;
+	}
+
+	void free(flow_handle h)
+	{
+		const entry_key &key = entries.cold(h);
+		flow_key6 k(key.peer, key.id);
+		if (key.kind >= remote_service)
+			services.erase(k);
+		else
+			requests.erase(k);
+		entries.free(h);
+	}
+};
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "flow_table.h"
+#include "numa_allocator.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+
+/* Hierarchical timing wheel of flow handles.
+ *
+ * Time is counted in abstract ticks. Each level has 64 slots; a slot of level
+ * L covers 64^L ticks, so four levels cover 2^24 ticks with O(1) insertion
+ * and cancellation. When the lower level wraps around, the entries of the
+ * next slot of the level above are cascaded down, and each timer fires
+ * exactly at its expiry tick. Timers further out than the wheel covers are
+ * parked in the top level and re-cascaded until they are due.
+ *
+ * A per-level bitmap of the occupied slots lets advance() skip idle periods
+ * without visiting every tick. Timer links are kept in a side array indexed
+ * by flow handle, so the flows themselves do not grow. */
+class timer_wheel
+{
+public:
+	static constexpr unsigned level_bits = 6;
+	static constexpr unsigned slots = 1u << level_bits;
+	static constexpr unsigned levels = 4;
+	/* Longest delay that can be placed without re-cascading */
+	static constexpr uint64_t range = 1ull << (level_bits * levels);
+
+	/* Makes room for the timers of sizing.entries handles up front */
+	explicit timer_wheel(uint64_t now = 0,
+			     const table_sizing &sizing = table_sizing()) :
+		nodes(sizing.entries, numa_allocator<node>(sizing.socket)),
+		current(now)
+	{
+		std::fill(&heads[0][0], &heads[0][0] + levels * slots,
+			  invalid_flow_handle);
+	}
+
+	/* The next tick to be processed */
+	uint64_t now() const { return current; }
+
+	/* Fire h once advance() reaches expiry. Re-arms h if it was already
+	 * scheduled. */
+	void schedule(flow_handle h, uint64_t expiry)
+	{
+		if (h >= nodes.size())
+			nodes.resize(std::max<size_t>(h + 1, nodes.size() * 2));
+		if (nodes[h].slot != no_slot)
+			unlink(h);
+		nodes[h].expiry = expiry;
+		link(h);
+	}
+
+	void cancel(flow_handle h)
+	{
+		if (h < nodes.size() && nodes[h].slot != no_slot)
+			unlink(h);
+	}
+
+	bool scheduled(flow_handle h) const
+	{
+		return h < nodes.size() && nodes[h].slot != no_slot;
+	}
+
+	/* Process the ticks up to and including now, calling expire(h) for
+	 * every timer that is due. Stops after budget timers have fired; the
+	 * remaining ones are fired by the next call. Returns the number of
+	 * timers fired. */
+	template <typename Expire>
+	unsigned advance(uint64_t now, unsigned budget, Expire &&expire)
+	{
+		unsigned fired = 0;
+
+		while (current <= now) {
+			unsigned idx = current & slot_mask;
+			uint64_t pending = occupied[0] >> idx;
+
+			if (!(pending & 1)) {
+				/* Skip to the next occupied slot, or to the
+				 * next cascade */
+				uint64_t next = pending ?
+					current + __builtin_ctzll(pending) :
+					(current | slot_mask) + 1;
+				current = std::min(next, now + 1);
+				if (!(current & slot_mask))
+					cascade();
+				continue;
+			}
+
+			flow_handle h;
+			while ((h = heads[0][idx]) != invalid_flow_handle) {
+				if (fired == budget)
+					return fired;
+				unlink(h);
+				++fired;
+				expire(h);
+			}
+
+			++current;
+			if (!(current & slot_mask))
+				cascade();
+		}
+
+		return fired;
+	}
+
+	size_t size() const { return count; }
+
+private:
+	static constexpr unsigned slot_mask = slots - 1;
+	static constexpr uint16_t no_slot = UINT16_MAX;
+
+	struct node
+	{
+		flow_handle next = invalid_flow_handle;
+		flow_handle prev = invalid_flow_handle;
+		uint64_t expiry = 0;
+		/* level * slots + slot index */
+		uint16_t slot = no_slot;
+	};
+
+	numa_vector<node> nodes;
+	flow_handle heads[levels][slots];
+	uint64_t occupied[levels] = {};
+	uint64_t current;
+	size_t count = 0;
+
+	void link(flow_handle h)
+	{
+		node &n = nodes[h];
+		uint64_t expiry = std::max(n.expiry, current);
+		uint64_t delta = std::min(expiry - current, range - 1);
+		unsigned level = 0;
+
+		while (level + 1 < levels &&
+		       delta >= (1ull << (level_bits * (level + 1))))
+			++level;
+		expiry = current + delta;
+		unsigned idx = (expiry >> (level_bits * level)) & slot_mask;
+
+		n.slot = uint16_t(level * slots + idx);
+		n.prev = invalid_flow_handle;
+		n.next = heads[level][idx];
+		if (n.next != invalid_flow_handle)
+			nodes[n.next].prev = h;
+		heads[level][idx] = h;
+		occupied[level] |= 1ull << idx;
+		++count;
+	}
+
+	void unlink(flow_handle h)
+	{
+		node &n = nodes[h];
+		unsigned level = n.slot / slots, idx = n.slot & slot_mask;
+
+		if (n.prev != invalid_flow_handle)
+			nodes[n.prev].next = n.next;
+		else
+			heads[level][idx] = n.next;
+		if (n.next != invalid_flow_handle)
+			nodes[n.next].prev = n.prev;
+		if (heads[level][idx] == invalid_flow_handle)
+			occupied[level] &= ~(1ull << idx);
+		n.slot = no_slot;
+		--count;
+	}
+
+	/* Called when the level 0 slots wrap around: move the timers of the
+	 * upper level slots that have just become current to lower levels. */
+	void cascade()
+	{
+		unsigned top = 1;
+		while (top + 1 < levels &&
+		       !((current >> (level_bits * top)) & slot_mask))
+			++top;
+
+		for (unsigned level = top; level > 0; --level) {
+			unsigned idx = (current >> (level_bits * level)) & slot_mask;
+			flow_handle h;
+			while ((h = heads[level][idx]) != invalid_flow_handle) {
+				unlink(h);
+				link(h);
+			}
+		}
+	}
+};
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+/* Parsing cost per packet, for CM packets, RoCE packets that are not CM, and
+ * UDP packets that are not RoCE, through ctcm_parse_packet and
+ * ctcm_parse_burst, and for CM frames whose L2/L3 headers the library parses. Run with `meson test --benchmark`. */
+
+#include "ctcm_test.h"
+
+#include <rte_cycles.h>
+
+#include <stdio.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+static constexpr unsigned burst = 32;
+static constexpr unsigned rounds = 100000;
+
+static double ns_per_packet(const std::function<void()> &round)
+{
+    /* Warm up the caches and branch predictors */
+    for (unsigned i = 0; i < rounds / 10; ++i)
+        round();
+
+    uint64_t start = rte_rdtsc();
+    for (unsigned i = 0; i < rounds; ++i)
+        round();
+    uint64_t cycles = rte_rdtsc() - start;
+
+    return double(cycles) * 1e9 / double(rte_get_tsc_hz()) /
+        (double(rounds) * burst);
+}
+
+template <typename Packet>
+static void run(const char *name, ctcm_context *ctcm,
+                std::vector<std::unique_ptr<Packet>> &packets)
+{
+    std::vector<rte_mbuf *> mbufs;
+    for (auto &p : packets)
+        mbufs.push_back(&p->mbuf);
+
+    double single = ns_per_packet([&] {
+        for (auto m : mbufs)
+            ctcm_parse_packet(ctcm, m);
+    });
+    double bursts = ns_per_packet([&] {
+        uint64_t cm_mask;
+        ctcm_parse_burst(ctcm, mbufs.data(), burst, &cm_mask);
+    });
+    printf("%-16s %10.2f %10.2f\n", name, single, bursts);
+}
+
+int main()
+{
+    char *args[] = {};
+    if (rte_eal_init(0, args) < 0)
+        return 1;
+    ctcm_context *ctcm = ctcm_create();
+    ctcm_context *validate = ctcm_create_flags(CTCM_CREATE_VALIDATE);
+    ctcm_context *l2 = ctcm_create_flags(CTCM_CREATE_PARSE_L2);
+    if (!ctcm || !validate || !l2)
+        return 1;
+
+    std::vector<std::unique_ptr<cm_packet>> cm, roce, udp;
+    std::vector<std::unique_ptr<eth_frame>> cm_frames;
+    for (unsigned i = 0; i < burst; ++i) {
+        cm.push_back(make_cm_packet("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID,
+                                    i + 1, 0, 0x100 + i));
+        cm.back()->seal();
+        cm_frames.emplace_back(new eth_frame(*cm.back()));
+
+        roce.emplace_back(new cm_packet("10.0.0.1", "10.0.0.2", 0));
+        __bth_set_opcode(&roce.back()->hdr.bth, IB_OPCODE_RC_SEND_ONLY);
+        __bth_set_qpn(&roce.back()->hdr.bth, 0x100 + i);
+
+        udp.emplace_back(new cm_packet("10.0.0.1", "10.0.0.2", 0));
+        udp.back()->hdr.udp.uh_dport = htons(53);
+    }
+
+    printf("%-16s %10s %10s\n", "ns/packet", "packet", "burst");
+    run("cm", ctcm, cm);
+    run("cm (validate)", validate, cm);
+    run("cm (parse l2)", l2, cm_frames);
+    run("roce", ctcm, roce);
+    run("udp", ctcm, udp);
+
+    ctcm_destroy(l2);
+    ctcm_destroy(validate);
+    ctcm_destroy(ctcm);
+    rte_eal_cleanup();
+    return 0;
+}
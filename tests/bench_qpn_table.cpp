@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+/* Lookup cost and memory of the QPN table backends, the hash table and the
+ * qpn_directory of CTCM_CREATE_DIRECT_QPN, with 10K hosts of 1K QPNs each.
+ * Hosts allocate their QPNs either densely from a random base, as NICs do, or
+ * scattered over the whole QPN space. Run with `meson test --benchmark`. */
+
+#include "qpn_table.h"
+
+#include <rte_cycles.h>
+#include <rte_eal.h>
+
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+static constexpr unsigned hosts = 10000;
+static constexpr unsigned qpns_per_host = 1000;
+static constexpr unsigned lookups = 1 << 22;
+static constexpr unsigned burst = 32;
+
+using hash_backend = flow_table<flow_key, flow_key_hash>;
+using direct_backend = qpn_directory<ip4_addr, flow_key, flow_key_hash>;
+
+static uint32_t find(const hash_backend &table, const flow_key &key)
+{
+    return table.find(key);
+}
+
+static uint32_t find(const direct_backend &dir, const flow_key &key)
+{
+    return dir.find(key);
+}
+
+/* Bulk lookup the way qpn_table::find_bulk does it */
+static uint32_t find_burst(const hash_backend &table, const flow_key *keys)
+{
+    uint32_t hashes[burst], sum = 0;
+    for (unsigned i = 0; i < burst; ++i) {
+        hashes[i] = table.hash_of(keys[i]);
+        table.prefetch_hash(hashes[i]);
+    }
+    for (unsigned i = 0; i < burst; ++i)
+        sum += table.find(keys[i], hashes[i]);
+    return sum;
+}
+
+static uint32_t find_burst(const direct_backend &dir, const flow_key *keys)
+{
+    uint32_t sum = 0;
+    for (unsigned i = 0; i < burst; ++i)
+        dir.prefetch(keys[i]);
+    for (unsigned i = 0; i < burst; ++i)
+        dir.prefetch_value(keys[i]);
+    for (unsigned i = 0; i < burst; ++i)
+        sum += dir.find(keys[i]);
+    return sum;
+}
+
+static double ns_per_lookup(uint64_t cycles)
+{
+    return double(cycles) * 1e9 / double(rte_get_tsc_hz()) / lookups;
+}
+
+template <typename Table>
+static void run(const char *name, Table &table, const std::vector<flow_key> &keys,
+                const std::vector<flow_key> &queries)
+{
+    for (const flow_key &key : keys)
+        table.insert(key, std::get<1>(key) + 1);
+
+    uint32_t sum = 0;
+    uint64_t start = rte_rdtsc();
+    for (const flow_key &key : queries)
+        sum += find(table, key);
+    uint64_t single = rte_rdtsc() - start;
+
+    start = rte_rdtsc();
+    for (unsigned i = 0; i < lookups; i += burst)
+        sum += find_burst(table, &queries[i]);
+    uint64_t bursts = rte_rdtsc() - start;
+
+    printf("%-18s %10.2f %10.2f %10.1f %s\n", name, ns_per_lookup(single),
+           ns_per_lookup(bursts), double(table.memory()) / (1 << 20),
+           sum ? "" : "(no hits)");
+}
+
+static void run(const char *layout, bool dense)
+{
+    std::mt19937 rng(1);
+    std::vector<flow_key> keys;
+    keys.reserve(size_t(hosts) * qpns_per_host);
+    for (uint32_t h = 0; h < hosts; ++h) {
+        ip4_addr addr(htonl(0x0a000000 + h));
+        uint32_t base = uint32_t(rng() % (1 << 23));
+        for (uint32_t q = 0; q < qpns_per_host; ++q)
+            keys.emplace_back(addr, dense ? base + q : uint32_t(rng() % (1 << 24)));
+    }
+
+    std::vector<flow_key> queries;
+    queries.reserve(lookups);
+    for (unsigned i = 0; i < lookups; ++i)
+        queries.push_back(keys[rng() % keys.size()]);
+
+    printf("%s QPNs\n", layout);
+    {
+        hash_backend table(1024, flow_key_hash(0x1234));
+        run("  hash table", table, keys, queries);
+    }
+    {
+        direct_backend dir(flow_key_hash(0x1234));
+        run("  qpn_directory", dir, keys, queries);
+    }
+}
+
+int main()
+{
+    char *args[] = {};
+    if (rte_eal_init(0, args) < 0)
+        return 1;
+
+    printf("%-18s %10s %10s %10s\n", "ns/lookup", "single", "burst", "MiB");
+    run("dense", true);
+    run("scattered", false);
+
+    rte_eal_cleanup();
+    return 0;
+}
@@ -0,0 +1,319 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#pragma once
+
+#include "gtest/gtest.h"
+
+#include <libconntrack-cm.h>
+
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+#include "rxe_hdr.h"
+#include "ib_pack.h"
+#include "ib_mad.h"
+#include "ib_cm.h"
+
+class CTCM : public ::testing::Test {
+public:
+    ctcm_context *ctcm;
+
+    void SetUp() {
+        char * args[] = {};
+        int ret = rte_eal_init(0, args);
+        ASSERT_EQ(0, ret);
+        ctcm = ctcm_create();
+        ASSERT_TRUE(ctcm);
+    }
+
+    void TearDown() {
+        ctcm_destroy(ctcm);
+        int ret = rte_eal_cleanup();
+        ASSERT_EQ(0, ret);
+    }
+};
+
+static inline void fill_ip(iphdr &ip, const char *saddr, const char *daddr,
+                           size_t len)
+{
+    inet_aton(saddr, (in_addr *)&ip.saddr);
+    inet_aton(daddr, (in_addr *)&ip.daddr);
+    ip.version = 4;
+    ip.ihl = sizeof(iphdr) / 4;
+    ip.protocol = IPPROTO_UDP;
+    ip.tot_len = htons(uint16_t(len));
+}
+
+static inline void fill_ip(ip6_hdr &ip, const char *saddr, const char *daddr,
+                           size_t len)
+{
+    inet_pton(AF_INET6, saddr, &ip.ip6_src);
+    inet_pton(AF_INET6, daddr, &ip.ip6_dst);
+    ip.ip6_flow = htonl(6 << 28);
+    ip.ip6_nxt = IPPROTO_UDP;
+    ip.ip6_plen = htons(uint16_t(len - sizeof(ip6_hdr)));
+}
+
+/* Bitwise CRC-32 (IEEE 802.3), as a reference for the ICRC */
+static inline uint32_t crc32_reference(const uint8_t *data, size_t len)
+{
+    uint32_t crc = ~0u;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/* Set the IP header fields the ICRC does not cover to ones */
+static inline void mask_icrc(iphdr &ip)
+{
+    ip.tos = 0xff;
+    ip.ttl = 0xff;
+    ip.check = 0xffff;
+}
+
+static inline void mask_icrc(ip6_hdr &ip)
+{
+    ip.ip6_flow |= htonl(0x0fffffff);
+    ip.ip6_hlim = 0xff;
+}
+
+/* An IPv4 or IPv6 RoCE v2 packet carrying a CM MAD, backed by a fake mbuf. */
+template <typename IpHdr>
+struct basic_cm_packet {
+    /* Keeps the MAD header naturally aligned after an IPv6 header */
+    static constexpr size_t pad_len =
+        (8 - (sizeof(IpHdr) + sizeof(udphdr) + sizeof(rxe_bth) + sizeof(rxe_deth)) % 8) % 8;
+
+    struct headers {
+        uint8_t pad[pad_len];
+        IpHdr ip;
+        struct udphdr udp;
+        struct rxe_bth bth;
+        struct rxe_deth deth;
+        struct ib_mad_hdr mad;
+        uint8_t cm_data[256 - sizeof(ib_mad_hdr)];
+        uint32_t icrc;
+    } hdr;
+
+    rte_mbuf mbuf;
+    /* Second segment of a split packet */
+    rte_mbuf tail;
+    std::vector<uint8_t> tail_data;
+
+    basic_cm_packet(const char *saddr, const char *daddr, uint16_t attr_id)
+    {
+        /* Up to the ICRC, without the struct's tail padding */
+        const size_t len = offsetof(headers, icrc) + sizeof(hdr.icrc) - pad_len;
+
+        memset(&hdr, 0, sizeof(hdr));
+        fill_ip(hdr.ip, saddr, daddr, len);
+        hdr.udp.uh_dport = htons(4791);
+        hdr.udp.uh_ulen = htons(uint16_t(len - sizeof(hdr.ip)));
+        __bth_set_opcode(&hdr.bth, IB_OPCODE_UD_SEND_ONLY);
+        __bth_set_qpn(&hdr.bth, 1);
+        hdr.mad.base_version = 1;
+        hdr.mad.mgmt_class = IB_MGMT_CLASS_CM;
+        hdr.mad.class_version = 2;
+        hdr.mad.attr_id = htons(attr_id);
+
+        memset(&mbuf, 0, sizeof(mbuf));
+        mbuf.buf_addr = &hdr.ip;
+        mbuf.buf_len = uint16_t(len);
+        mbuf.data_len = uint16_t(len);
+        mbuf.pkt_len = uint32_t(len);
+        mbuf.nb_segs = 1;
+        mbuf.packet_type = RTE_PTYPE_L4_UDP |
+            (sizeof(IpHdr) == sizeof(iphdr) ? RTE_PTYPE_L3_IPV4 : RTE_PTYPE_L3_IPV6);
+        mbuf.l3_len = sizeof(IpHdr);
+        mbuf.l4_len = sizeof(udphdr);
+    }
+
+    basic_cm_packet(const basic_cm_packet&) = delete;
+
+    /* Set a CM message field by its byte offset in the IBTA message tables */
+    void set32(unsigned offset, uint32_t value)
+    {
+        value = htonl(value);
+        memcpy(&hdr.cm_data[offset], &value, sizeof(value));
+    }
+
+    /* 24-bit fields (QPNs) occupy the upper bits of a 32-bit word */
+    void set24(unsigned offset, uint32_t value)
+    {
+        set32(offset, (value & 0xffffff) << 8);
+    }
+
+    /* Fill in the fields a validating parser checks: the GSI DETH, the
+     * Send method and the ICRC */
+    void seal()
+    {
+        __deth_set_qkey(&hdr.deth, IB_QP1_QKEY);
+        __deth_set_sqp(&hdr.deth, 1);
+        hdr.mad.method = IB_MGMT_METHOD_SEND;
+        update_icrc();
+    }
+
+    void update_icrc()
+    {
+        headers masked = hdr;
+        mask_icrc(masked.ip);
+        masked.udp.check = 0xffff;
+        masked.bth.qpn |= htonl(0xff000000);
+        uint8_t pseudo[8 + offsetof(headers, icrc) - pad_len];
+        memset(pseudo, 0xff, 8);
+        memcpy(pseudo + 8, &masked.ip, sizeof(pseudo) - 8);
+        hdr.icrc = crc32_reference(pseudo, sizeof(pseudo));
+    }
+
+    /* Move the bytes from offset at onwards to a second segment, and
+     * scribble over them in the first one's buffer */
+    void split(size_t at)
+    {
+        uint8_t *data = reinterpret_cast<uint8_t *>(&hdr.ip);
+
+        tail_data.assign(data + at, data + mbuf.pkt_len);
+        memset(data + at, 0xee, mbuf.pkt_len - at);
+
+        memset(&tail, 0, sizeof(tail));
+        tail.buf_addr = tail_data.data();
+        tail.buf_len = uint16_t(tail_data.size());
+        tail.data_len = uint16_t(tail_data.size());
+        mbuf.data_len = uint16_t(at);
+        mbuf.buf_len = uint16_t(at);
+        mbuf.next = &tail;
+        mbuf.nb_segs = 2;
+    }
+};
+
+typedef basic_cm_packet<iphdr> cm_packet;
+typedef basic_cm_packet<ip6_hdr> cm_packet6;
+
+/* Build a CM message. Every tracked message starts with the sender's and
+ * receiver's comm IDs; REQ and REP also carry the sender's QPN. SIDR
+ * messages start with the request ID instead, and SIDR_REP carries the
+ * service QPN. */
+template <typename Packet = cm_packet>
+static inline std::unique_ptr<Packet> make_cm_packet(
+    const char *saddr, const char *daddr, uint16_t attr_id,
+    uint32_t local_id, uint32_t remote_id = 0, uint32_t qpn = 0)
+{
+    std::unique_ptr<Packet> p(new Packet(saddr, daddr, attr_id));
+    p->set32(0, local_id);
+    switch (attr_id) {
+    case CM_REQ_ATTR_ID:
+        p->set24(32, qpn);
+        break;
+    case CM_REP_ATTR_ID:
+        p->set32(4, remote_id);
+        p->set24(12, qpn);
+        break;
+    case CM_SIDR_REP_ATTR_ID:
+        p->set24(8, qpn);
+        break;
+    default:
+        p->set32(4, remote_id);
+    }
+    return p;
+}
+
+/* A CM packet in an Ethernet frame, with none of the mbuf metadata set */
+struct eth_frame {
+    alignas(8) uint8_t data[512];
+    size_t len = 0;
+    rte_mbuf mbuf;
+
+    template <typename Packet>
+    eth_frame(const Packet &p, std::initializer_list<uint16_t> tags = {},
+              uint16_t ethertype = ETHERTYPE_IP)
+    {
+        memset(data, 0, sizeof(data));
+        /* Keep the IP header 4-byte aligned */
+        len = 2 + 2 * 6;
+        for (uint16_t tpid : tags) {
+            put16(tpid);
+            put16(100);
+        }
+        put16(ethertype);
+        memcpy(&data[len], &p.hdr.ip, p.mbuf.pkt_len);
+        len += p.mbuf.pkt_len;
+
+        memset(&mbuf, 0, sizeof(mbuf));
+        mbuf.buf_addr = data;
+        mbuf.buf_len = sizeof(data);
+        mbuf.data_off = 2;
+        mbuf.data_len = uint16_t(len - 2);
+        mbuf.pkt_len = uint32_t(len - 2);
+        mbuf.nb_segs = 1;
+    }
+
+    eth_frame(const eth_frame&) = delete;
+
+    void put16(uint16_t v)
+    {
+        v = htons(v);
+        memcpy(&data[len], &v, sizeof(v));
+        len += sizeof(v);
+    }
+
+    /* Carry the frame over VXLAN or GENEVE (by UDP port) in an IPv4 packet */
+    void encapsulate(uint16_t dport, uint32_t vni, size_t geneve_options = 0)
+    {
+        const size_t outer_len = 14 + sizeof(iphdr) + sizeof(udphdr) + 8 +
+            geneve_options;
+        const size_t frame_len = len - 2;
+
+        memmove(&data[2 + outer_len], &data[2], frame_len);
+        memset(&data[2], 0, outer_len);
+        len = 2 + 12;
+        put16(ETHERTYPE_IP);
+
+        auto ip = reinterpret_cast<iphdr *>(&data[len]);
+        fill_ip(*ip, "192.168.0.1", "192.168.0.2", outer_len - 14 + frame_len);
+        len += sizeof(iphdr);
+
+        auto udp = reinterpret_cast<udphdr *>(&data[len]);
+        udp->uh_dport = htons(dport);
+        udp->uh_ulen = htons(uint16_t(outer_len - 14 - sizeof(iphdr) + frame_len));
+        len += sizeof(udphdr);
+
+        uint8_t *tunnel = &data[len];
+        if (dport == 4789) {
+            tunnel[0] = 0x08;
+        } else {
+            tunnel[0] = uint8_t(geneve_options / 4);
+            tunnel[2] = 0x65;
+            tunnel[3] = 0x58;
+        }
+        tunnel[4] = uint8_t(vni >> 16);
+        tunnel[5] = uint8_t(vni >> 8);
+        tunnel[6] = uint8_t(vni);
+        len += 8 + geneve_options + frame_len;
+
+        mbuf.data_len = uint16_t(len - 2);
+        mbuf.pkt_len = uint32_t(len - 2);
+    }
+
+    /* Grow the header at offset by n bytes of options */
+    void insert(size_t offset, size_t n)
+    {
+        memmove(&data[2 + offset + n], &data[2 + offset], len - 2 - offset);
+        memset(&data[2 + offset], 1 /* NOP */, n);
+        len += n;
+        mbuf.data_len = uint16_t(mbuf.data_len + n);
+        mbuf.pkt_len = uint32_t(mbuf.pkt_len + n);
+    }
+};
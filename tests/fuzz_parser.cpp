@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+/* libFuzzer entry point for the packet parser and the tracker.
+ *
+ * The first two bytes of an input select how the packet is presented:
+ *   byte 0, bits 0-1: the context (caller-parsed L3, CTCM_CREATE_PARSE_L2, or
+ *                     CTCM_CREATE_PARSE_L2 | CTCM_CREATE_VALIDATE)
+ *           bit 2:    the direction
+ *           bit 3:    IPv6 rather than IPv4 headers, for caller-parsed L3
+ *           bit 4:    a NIC packet type, for the L2 parsing contexts
+ *   byte 1:           if not 0, split the packet into a second segment that
+ *                     many bytes after the L3 header, or after the first 128
+ *                     bytes for the L2 parsing contexts
+ * The rest is the packet, from the IP header for caller-parsed L3 and from
+ * the Ethernet header otherwise. Every segment is a heap buffer of its exact
+ * length, so that the sanitizers catch any read past the packet.
+ */
+
+#include <libconntrack-cm.h>
+
+#include <rte_eal.h>
+#include <rte_mbuf.h>
+
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+static ctcm_context *contexts[3];
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***)
+{
+    char arg0[] = "fuzz-parser", no_huge[] = "--no-huge", no_pci[] = "--no-pci";
+    char *args[] = {arg0, no_huge, no_pci};
+    if (rte_eal_init(3, args) < 0)
+        abort();
+
+    contexts[0] = ctcm_create();
+    contexts[1] = ctcm_create_flags(CTCM_CREATE_PARSE_L2);
+    contexts[2] = ctcm_create_flags(CTCM_CREATE_PARSE_L2 | CTCM_CREATE_VALIDATE);
+    for (auto ctcm : contexts)
+        if (!ctcm)
+            abort();
+    return 0;
+}
+
+/* Point a fake mbuf at a copy of data */
+static std::unique_ptr<uint8_t[]> fill_segment(rte_mbuf &m, const uint8_t *data,
+                                               size_t len)
+{
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[len]);
+    memcpy(buf.get(), data, len);
+    m.buf_addr = buf.get();
+    m.buf_len = uint16_t(len);
+    m.data_len = uint16_t(len);
+    return buf;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 2 || size - 2 > UINT16_MAX)
+        return 0;
+
+    const uint8_t mode = data[0], split = data[1];
+    ctcm_context *ctcm = contexts[(mode & 3) % 3];
+    const bool parse_l2 = (mode & 3) % 3;
+    const auto dir = mode & 4 ? CTCM_FROM_NET : CTCM_FROM_HOST;
+    data += 2;
+    size -= 2;
+
+    rte_mbuf m{}, tail{};
+    m.pkt_len = uint32_t(size);
+    m.nb_segs = 1;
+    if (parse_l2) {
+        if (mode & 0x10)
+            m.packet_type = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 |
+                RTE_PTYPE_L4_UDP;
+    } else if (mode & 8) {
+        m.packet_type = RTE_PTYPE_L3_IPV6 | RTE_PTYPE_L4_UDP;
+        m.l3_len = sizeof(ip6_hdr);
+    } else {
+        m.packet_type = RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_UDP;
+        m.l3_len = sizeof(iphdr);
+    }
+
+    /* The L2/L3 headers must be in the first segment. With parse_l2 their
+     * length is only known after parsing, so keep a generous prefix. */
+    size_t at = (parse_l2 ? 128 : m.l3_len) + split;
+    std::unique_ptr<uint8_t[]> head, rest;
+    if (split && at < size) {
+        head = fill_segment(m, data, at);
+        rest = fill_segment(tail, data + at, size - at);
+        m.next = &tail;
+        m.nb_segs = 2;
+    } else {
+        head = fill_segment(m, data, size);
+    }
+
+    ctcm_parse_packet(ctcm, &m);
+    ctcm_process_packet(ctcm, dir, &m);
+
+    rte_mbuf *burst = &m;
+    uint64_t cm_mask;
+    ctcm_parse_burst(ctcm, &burst, 1, &cm_mask);
+    ctcm_process_burst(ctcm, dir, &burst, 1);
+    return 0;
+}
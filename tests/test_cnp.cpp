@@ -2,37 +2,10 @@
  * Copyright 2021 Haggai Eran
  */
 
-#include "gtest/gtest.h"
+#include "ctcm_test.h"
 
 #include <boost/algorithm/hex.hpp>
 
-#include <libconntrack-cm.h>
-
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netinet/ip.h>
-#include <netinet/udp.h>
-
-class CTCM : public ::testing::Test { 
-public:
-    ctcm_context *ctcm;
-
-    void SetUp() {
-        char * args[] = {};
-        int ret = rte_eal_init(0, args);
-        ASSERT_EQ(0, ret);
-        ctcm = ctcm_create();
-        ASSERT_TRUE(ctcm);
-    }
-
-    void TearDown() { 
-        ctcm_destroy(ctcm);
-        int ret = rte_eal_cleanup();
-        ASSERT_EQ(0, ret);
-    }
-};
-
 struct cnp {
     struct iphdr ip;
     struct udphdr udp;
@@ -95,3 +68,44 @@ TEST_F(CTCM, cnp_gen)
     }
     EXPECT_EQ(generated, expected);
 }
+
+TEST_F(CTCM, cnp_gen_ipv6)
+{
+    struct cnp6 {
+        struct ip6_hdr ip;
+        struct udphdr udp;
+        uint8_t bth[CTCM_BTH_LENGTH];
+        uint8_t payload[CTCM_CNP_LENGTH];
+        uint32_t icrc;
+    } cnpacket{};
+    rte_mbuf p{};
+    p.buf_addr = &cnpacket;
+    p.buf_len = sizeof(cnpacket);
+    ASSERT_EQ(0, ctcm_fill_cnp_template_ipv6(ctcm, &p));
+    ASSERT_EQ(sizeof(cnpacket), rte_pktmbuf_pkt_len(&p));
+    inet_pton(AF_INET6, "fd00::8", &cnpacket.ip.ip6_src);
+    inet_pton(AF_INET6, "fd00::7", &cnpacket.ip.ip6_dst);
+    cnpacket.ip.ip6_hlim = 0x20;
+    cnpacket.udp.uh_sport = htons(56238);
+    ctcm_generate_cnp(ctcm, &p, 0xd2);
+
+    EXPECT_EQ(0x6c200000u, ntohl(cnpacket.ip.ip6_flow));
+    EXPECT_EQ(sizeof(cnpacket) - sizeof(ip6_hdr), ntohs(cnpacket.ip.ip6_plen));
+    EXPECT_EQ(IPPROTO_UDP, cnpacket.ip.ip6_nxt);
+    EXPECT_EQ(htons(4791), cnpacket.udp.uh_dport);
+    EXPECT_EQ(0x81, cnpacket.bth[0]);
+    EXPECT_EQ(0xd2, cnpacket.bth[7]);
+
+    /* The ICRC covers 8 bytes of ones standing for the LRH, then the packet
+     * with traffic class, flow label, hop limit, UDP checksum and the BTH
+     * FECN/BECN/reserved bits set to ones */
+    cnp6 masked = cnpacket;
+    masked.ip.ip6_flow |= htonl(0x0fffffff);
+    masked.ip.ip6_hlim = 0xff;
+    masked.udp.check = 0xffff;
+    masked.bth[4] = 0xff;
+    uint8_t pseudo[8 + offsetof(cnp6, icrc)];
+    memset(pseudo, 0xff, 8);
+    memcpy(pseudo + 8, &masked, offsetof(cnp6, icrc));
+    EXPECT_EQ(crc32_reference(pseudo, sizeof(pseudo)), cnpacket.icrc);
+}
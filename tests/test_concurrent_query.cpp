@@ -0,0 +1,157 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <rte_malloc.h>
+#include <rte_rcu_qsbr.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static const char local_ip[] = "10.0.0.1";
+static const char remote_ip[] = "10.0.0.2";
+
+class CTCMConcurrent : public CTCM {
+public:
+    static constexpr unsigned readers = 4;
+    rte_rcu_qsbr *qsbr = nullptr;
+
+    void SetUp() {
+        char * args[] = {};
+        int ret = rte_eal_init(0, args);
+        ASSERT_EQ(0, ret);
+        ctcm = ctcm_create_flags(CTCM_CREATE_CONCURRENT_QUERY);
+        ASSERT_TRUE(ctcm);
+        if (!with_qsbr())
+            return;
+
+        size_t size = rte_rcu_qsbr_get_memsize(readers);
+        qsbr = static_cast<rte_rcu_qsbr *>(rte_zmalloc("qsbr", size, RTE_CACHE_LINE_SIZE));
+        ASSERT_TRUE(qsbr);
+        ASSERT_EQ(0, rte_rcu_qsbr_init(qsbr, readers));
+        ASSERT_EQ(0, ctcm_rcu_qsbr_add(ctcm, qsbr));
+    }
+
+    void TearDown() {
+        ctcm_destroy(ctcm);
+        rte_free(qsbr);
+        int ret = rte_eal_cleanup();
+        ASSERT_EQ(0, ret);
+    }
+
+    virtual bool with_qsbr() const { return true; }
+
+    /* Connection i: local comm ID 0x1000 + i, QPNs 0x100 + i -> 0x10000 + i */
+    void connect(unsigned i)
+    {
+        process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                CM_REQ_ATTR_ID, 0x1000 + i, 0, 0x100 + i));
+        process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                CM_REP_ATTR_ID, 0x80000 + i, 0x1000 + i, 0x10000 + i));
+        process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                CM_RTU_ATTR_ID, 0x1000 + i, 0x80000 + i));
+    }
+
+    void disconnect(unsigned i)
+    {
+        process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                CM_DREQ_ATTR_ID, 0x1000 + i, 0x80000 + i));
+        process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                CM_DREP_ATTR_ID, 0x80000 + i, 0x1000 + i));
+    }
+
+    void process(ctcm_direction dir, cm_packet &p)
+    {
+        ctcm_parse_packet(ctcm, &p.mbuf);
+        ctcm_process_packet(ctcm, dir, &p.mbuf);
+    }
+};
+
+TEST_F(CTCMConcurrent, readers_with_churning_writer)
+{
+    const unsigned stable = 64, churned = 256, rounds = 5;
+    in_addr remote;
+    inet_aton(remote_ip, &remote);
+
+    for (unsigned i = 0; i < stable; ++i)
+        connect(i);
+
+    std::atomic<bool> done{false};
+    std::atomic<unsigned> errors{0};
+    std::vector<std::thread> threads;
+
+    for (unsigned t = 0; t < readers; ++t) {
+        threads.emplace_back([&, t]() {
+            rte_rcu_qsbr_thread_register(qsbr, t);
+            rte_rcu_qsbr_thread_online(qsbr, t);
+            while (!done.load(std::memory_order_relaxed)) {
+                for (unsigned i = 0; i < stable + churned; ++i) {
+                    uint32_t qpn = ctcm_query_ipv4(ctcm, remote.s_addr, 0x10000 + i);
+                    bool ok = i < stable ? qpn == 0x100 + i :
+                                           qpn == 0 || qpn == 0x100 + i;
+                    if (!ok)
+                        ++errors;
+                }
+                rte_rcu_qsbr_quiescent(qsbr, t);
+                std::this_thread::yield();
+            }
+            rte_rcu_qsbr_thread_offline(qsbr, t);
+            rte_rcu_qsbr_thread_unregister(qsbr, t);
+        });
+    }
+
+    for (unsigned r = 0; r < rounds; ++r) {
+        for (unsigned i = stable; i < stable + churned; ++i)
+            connect(i);
+        for (unsigned i = stable; i < stable + churned; ++i)
+            disconnect(i);
+    }
+
+    done = true;
+    for (auto &t : threads)
+        t.join();
+
+    EXPECT_EQ(0u, errors.load());
+
+    std::vector<in_addr_t> ips(stable + churned, remote.s_addr);
+    std::vector<uint32_t> dqpns, sqpns(stable + churned);
+    for (unsigned i = 0; i < stable + churned; ++i)
+        dqpns.push_back(0x10000 + i);
+    EXPECT_EQ(int(stable), ctcm_query_ipv4_bulk(ctcm, ips.data(), dqpns.data(),
+                                                sqpns.data(), stable + churned));
+    for (unsigned i = 0; i < stable + churned; ++i)
+        EXPECT_EQ(i < stable ? 0x100 + i : 0,
+                  ctcm_query_ipv4(ctcm, remote.s_addr, 0x10000 + i));
+}
+
+/* Queried without an RCU variable attached */
+class CTCMConcurrentNoQsbr : public CTCMConcurrent {
+public:
+    bool with_qsbr() const override { return false; }
+};
+
+TEST_F(CTCMConcurrentNoQsbr, torn_down_entries_are_freed)
+{
+    in_addr remote;
+    inet_aton(remote_ip, &remote);
+
+    /* More connections than the table holds come and go */
+    const unsigned connections = 70000;
+    for (unsigned i = 0; i < connections; ++i) {
+        connect(i);
+        ASSERT_EQ(0x100 + i, ctcm_query_ipv4(ctcm, remote.s_addr, 0x10000 + i));
+        disconnect(i);
+    }
+    connect(connections);
+    EXPECT_EQ(0x100 + connections,
+              ctcm_query_ipv4(ctcm, remote.s_addr, 0x10000 + connections));
+}
+
+TEST_F(CTCM, rcu_qsbr_add_requires_concurrent_mode)
+{
+    rte_rcu_qsbr qsbr;
+    EXPECT_EQ(-1, ctcm_rcu_qsbr_add(ctcm, &qsbr));
+}
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <rte_ring.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static const char local_ip[] = "10.0.0.1";
+static const char remote_ip[] = "10.0.0.2";
+
+static in_addr_t ip(const char *addr)
+{
+    in_addr a;
+    inet_aton(addr, &a);
+    return a.s_addr;
+}
+
+/* Decode a packet into an event, and free the packet */
+static ctcm_event make_event(ctcm_context *ctcm, ctcm_direction dir,
+                             std::unique_ptr<cm_packet> p)
+{
+    ctcm_event ev;
+    ctcm_parse_packet(ctcm, &p->mbuf);
+    EXPECT_EQ(0, ctcm_make_event(ctcm, dir, &p->mbuf, &ev));
+    return ev;
+}
+
+/* The events of connection i, from REQ to DREP */
+static std::vector<ctcm_event> connection(ctcm_context *ctcm, uint32_t i)
+{
+    uint32_t local_id = 0x1000 + i, remote_id = 0x80000 + i;
+    return {
+        make_event(ctcm, CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                   CM_REQ_ATTR_ID, local_id, 0, 0x100 + i)),
+        make_event(ctcm, CTCM_FROM_NET, make_cm_packet(remote_ip, local_ip,
+                   CM_REP_ATTR_ID, remote_id, local_id, 0x10000 + i)),
+        make_event(ctcm, CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                   CM_RTU_ATTR_ID, local_id, remote_id)),
+        make_event(ctcm, CTCM_FROM_NET, make_cm_packet(remote_ip, local_ip,
+                   CM_DREQ_ATTR_ID, remote_id, local_id)),
+        make_event(ctcm, CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                   CM_DREP_ATTR_ID, local_id, remote_id)),
+    };
+}
+
+TEST_F(CTCM, track_through_events)
+{
+    auto events = connection(ctcm, 0);
+
+    EXPECT_EQ(2, ctcm_process_events(ctcm, events.data(), 2));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x10000));
+    EXPECT_EQ(1, ctcm_process_events(ctcm, &events[2], 1));
+    EXPECT_EQ(0x100u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x10000));
+    EXPECT_EQ(2, ctcm_process_events(ctcm, &events[3], 2));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x10000));
+}
+
+TEST_F(CTCM, replay_events)
+{
+    auto events = connection(ctcm, 0);
+    events.pop_back();
+    events.pop_back();
+
+    /* Events are plain data, another context replays them alike */
+    ctcm_context *replay = ctcm_create();
+    ASSERT_TRUE(replay);
+    ctcm_process_events(ctcm, events.data(), unsigned(events.size()));
+    ctcm_process_events(replay, events.data(), unsigned(events.size()));
+    EXPECT_EQ(0x100u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x10000));
+    EXPECT_EQ(0x100u, ctcm_query_ipv4(replay, ip(remote_ip), 0x10000));
+    ctcm_destroy(replay);
+}
+
+TEST_F(CTCM, sidr_events)
+{
+    ctcm_sidr_mapping m = {};
+    ctcm_event events[2];
+
+    events[0] = make_event(ctcm, CTCM_FROM_HOST, make_cm_packet(local_ip,
+                           remote_ip, CM_SIDR_REQ_ATTR_ID, 0x5));
+    auto rep = make_cm_packet(remote_ip, local_ip, CM_SIDR_REP_ATTR_ID, 0x5, 0, 0x33);
+    rep->set32(20, 0x1234);
+    events[1] = make_event(ctcm, CTCM_FROM_NET, std::move(rep));
+    ctcm_process_events(ctcm, events, 2);
+
+    ASSERT_EQ(0, ctcm_query_sidr_ipv4(ctcm, ip(remote_ip), 0x33, &m));
+    EXPECT_EQ(0x1234u, m.qkey);
+}
+
+TEST_F(CTCM, event_of_non_cm_packet)
+{
+    cm_packet p(local_ip, remote_ip, CM_REQ_ATTR_ID);
+    ctcm_event ev;
+
+    p.hdr.bth.qpn = htonl(2);
+    ctcm_parse_packet(ctcm, &p.mbuf);
+    EXPECT_EQ(-1, ctcm_make_event(ctcm, CTCM_FROM_HOST, &p.mbuf, &ev));
+}
+
+/* A data thread turns packets into events and queues them, the tracking
+ * thread drains the ring */
+TEST_F(CTCM, event_ring)
+{
+    const unsigned count = 256;
+    rte_ring *ring = rte_ring_create_elem("ctcm events", sizeof(ctcm_event),
+                                          64, SOCKET_ID_ANY, RING_F_SP_ENQ |
+                                          RING_F_SC_DEQ);
+    ASSERT_TRUE(ring);
+
+    std::atomic<bool> done{false};
+    std::thread data([&] {
+        for (uint32_t i = 0; i < count; ++i) {
+            auto events = connection(ctcm, i);
+            /* Leave the connection established */
+            events.resize(3);
+            for (unsigned sent = 0; sent < events.size(); )
+                sent += rte_ring_enqueue_burst_elem(ring, &events[sent],
+                    sizeof(ctcm_event), unsigned(events.size() - sent), nullptr);
+        }
+        done = true;
+    });
+
+    unsigned processed = 0;
+    for (;;) {
+        bool last = done;
+        processed += unsigned(ctcm_process_ring(ctcm, ring, 16));
+        if (last && !rte_ring_count(ring))
+            break;
+    }
+    data.join();
+    rte_ring_free(ring);
+
+    EXPECT_EQ(3 * count, processed);
+    for (uint32_t i = 0; i < count; ++i)
+        EXPECT_EQ(0x100u + i, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x10000 + i));
+}
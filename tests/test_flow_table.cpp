@@ -0,0 +1,207 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "gtest/gtest.h"
+
+#include "flow_table.h"
+#include "flow_slab.h"
+
+#include <random>
+#include <set>
+#include <unordered_map>
+
+struct collide_hash
+{
+    /* Few distinct hashes, to exercise long probe sequences */
+    uint32_t operator()(uint32_t key) const { return key % 7; }
+};
+
+struct identity_hash
+{
+    uint32_t operator()(uint32_t key) const { return key; }
+};
+
+struct mix_hash
+{
+    uint32_t operator()(uint32_t key) const { return hash_mix32(key); }
+};
+
+struct crc_hash : seeded_hash
+{
+    using seeded_hash::seeded_hash;
+
+    uint32_t operator()(uint32_t key) const
+    { return hash_mix32(rte_hash_crc_4byte(key, seed)); }
+};
+
+template <typename Hash>
+static void random_ops(unsigned key_range, const Hash &hash = Hash())
+{
+    flow_table<uint32_t, Hash> table(16, hash);
+    std::unordered_map<uint32_t, flow_handle> reference;
+    std::mt19937 rng(1);
+
+    for (unsigned i = 0; i < 100000; ++i) {
+        uint32_t key = uint32_t(rng() % key_range) + 1;
+        switch (rng() % 3) {
+        case 0: {
+            bool inserted = reference.emplace(key, i).second;
+            ASSERT_EQ(inserted, table.insert(key, i));
+            break;
+        }
+        case 1:
+            ASSERT_EQ(reference.erase(key) == 1, table.erase(key));
+            break;
+        case 2: {
+            auto it = reference.find(key);
+            ASSERT_EQ(it == reference.end() ? invalid_flow_handle : it->second,
+                      table.find(key));
+            break;
+        }
+        }
+        ASSERT_EQ(reference.size(), table.size());
+    }
+
+    for (auto &[key, handle] : reference)
+        EXPECT_EQ(handle, table.find(key));
+}
+
+TEST(flow_table, random_ops)
+{
+    random_ops<mix_hash>(5000);
+}
+
+TEST(flow_table, collisions)
+{
+    random_ops<collide_hash>(200);
+}
+
+TEST(flow_table, seeded_hash)
+{
+    random_ops<crc_hash>(5000, crc_hash(0x1234));
+
+    /* Keys whose CRCs share the low bits, as an attacker could pick */
+    const uint32_t buckets = 1024;
+    std::vector<uint32_t> keys;
+    for (uint32_t key = 1; keys.size() < 64; ++key)
+        if (!(rte_hash_crc_4byte(key, 0) % buckets))
+            keys.push_back(key);
+
+    /* The CRC is linear, the seed alone does not separate them */
+    const uint32_t seed = 0x9e3779b9;
+    for (uint32_t key : keys)
+        EXPECT_EQ(rte_hash_crc_4byte(keys[0], seed) % buckets,
+                  rte_hash_crc_4byte(key, seed) % buckets);
+
+    std::set<uint32_t> spread;
+    for (uint32_t key : keys)
+        spread.insert(crc_hash(seed)(key) % buckets);
+    EXPECT_GT(spread.size(), 48u);
+}
+
+TEST(flow_table, incremental_resize)
+{
+    const uint32_t keys = 20000;
+    flow_table<uint32_t, mix_hash> table(16);
+    bool migrated = false;
+
+    /* Every key stays visible while the entries move to larger slots */
+    for (uint32_t key = 1; key <= keys; ++key) {
+        ASSERT_TRUE(table.insert(key, key));
+        if (!table.migrating())
+            continue;
+        migrated = true;
+        ASSERT_FALSE(table.insert(key / 2 + 1, 0));
+        for (uint32_t k = 1; k <= key; k += 97)
+            ASSERT_EQ(k, table.find(k));
+    }
+    EXPECT_TRUE(migrated);
+    EXPECT_GE(table.capacity(), keys);
+    size_t grown = table.memory();
+
+    /* And back to smaller ones after a mass disconnect */
+    migrated = false;
+    for (uint32_t key = 11; key <= keys; ++key) {
+        ASSERT_TRUE(table.erase(key));
+        if (!table.migrating())
+            continue;
+        migrated = true;
+        ASSERT_EQ(1u, table.find(1));
+        ASSERT_TRUE(table.find_value(10));
+        if (key < keys) {
+            ASSERT_EQ(keys, table.find(keys));
+        }
+    }
+    EXPECT_TRUE(migrated);
+
+    /* An idle table finishes shrinking when stepped */
+    while (table.migrating())
+        table.migrate(64);
+    EXPECT_EQ(64u, table.capacity());
+    EXPECT_LT(table.memory() * 100, grown);
+    for (uint32_t key = 1; key <= 10; ++key)
+        EXPECT_EQ(key, table.find(key));
+
+    /* A cluster filling all the old slots left to migrate: probes for
+     * missing keys homed there must end after going around once */
+    flow_table<uint32_t, identity_hash> full(16);
+    for (uint32_t i = 0; i < 8; ++i)
+        ASSERT_TRUE(full.insert(8 + 16 * i, 1));
+    for (uint32_t i = 1; i <= 6; ++i)
+        ASSERT_TRUE(full.insert(16 * i, 1));
+    ASSERT_TRUE(full.insert(1, 1));
+    ASSERT_TRUE(full.migrating());
+    EXPECT_EQ(invalid_flow_handle, full.find(24 + 16 * 8));
+    EXPECT_EQ(invalid_flow_handle, full.find(8 + 32 * 8));
+    EXPECT_FALSE(full.erase(8 + 32 * 8));
+    EXPECT_TRUE(full.insert(8 + 32 * 8, 1));
+    for (uint32_t i = 0; i < 8; ++i)
+        EXPECT_EQ(1u, full.find(8 + 16 * i));
+}
+
+TEST(flow_table, fixed_capacity)
+{
+    table_sizing sizing;
+    sizing.entries = 100;
+    sizing.fixed = true;
+    flow_table<uint32_t, mix_hash> table(16, mix_hash(), sizing);
+    size_t memory = table.memory();
+
+    uint32_t key = 1;
+    while (table.insert(key, key))
+        ++key;
+    EXPECT_GE(table.size(), 100u);
+    EXPECT_EQ(memory, table.memory());
+    while (--key)
+        ASSERT_TRUE(table.erase(key));
+    EXPECT_EQ(memory, table.memory());
+    EXPECT_FALSE(table.migrating());
+}
+
+TEST(flow_slab, alloc_free)
+{
+    struct hot { uint32_t value = 0; };
+    struct cold { uint32_t value = 0; };
+    flow_slab<hot, cold> slab;
+    std::vector<flow_handle> handles;
+
+    for (uint32_t i = 0; i < 3 * slab.chunk_size; ++i) {
+        handles.push_back(slab.alloc());
+        slab.hot(handles.back()).value = i;
+        slab.cold(handles.back()).value = ~i;
+    }
+    EXPECT_EQ(3 * slab.chunk_size, slab.size());
+
+    for (uint32_t i = 0; i < handles.size(); ++i) {
+        EXPECT_EQ(i, slab.hot(handles[i]).value);
+        EXPECT_EQ(~i, slab.cold(handles[i]).value);
+    }
+
+    slab.free(handles[5]);
+    EXPECT_FALSE(slab.allocated(handles[5]));
+    EXPECT_TRUE(slab.allocated(handles[6]));
+    EXPECT_EQ(handles[5], slab.alloc());
+    EXPECT_TRUE(slab.allocated(handles[5]));
+    EXPECT_EQ(0u, slab.hot(handles[5]).value);
+}
@@ -0,0 +1,353 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <memory>
+#include <vector>
+
+TEST_F(CTCM, parse_cm_packet)
+{
+    cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(ctcm, &offsets));
+
+    ctcm_parse_packet(ctcm, &p.mbuf);
+    EXPECT_EQ(&p.hdr.bth, ctcm_mbuf_get_bth(&offsets, &p.mbuf));
+    EXPECT_EQ(&p.hdr.mad, ctcm_mbuf_get_mad(&offsets, &p.mbuf));
+
+    p.hdr.mad.mgmt_class = IB_MGMT_CLASS_PERF_MGMT;
+    ctcm_parse_packet(ctcm, &p.mbuf);
+    EXPECT_EQ(&p.hdr.bth, ctcm_mbuf_get_bth(&offsets, &p.mbuf));
+    EXPECT_EQ(nullptr, ctcm_mbuf_get_mad(&offsets, &p.mbuf));
+}
+
+TEST_F(CTCM, parse_split_packet)
+{
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(ctcm, &offsets));
+
+    /* Split inside the UDP header, the BTH, and the MAD header */
+    const size_t ip_len = sizeof(iphdr);
+    const size_t bth = ip_len + sizeof(udphdr);
+    const size_t mad = bth + sizeof(rxe_bth) + sizeof(rxe_deth);
+    for (size_t at : {ip_len + 2, bth + 5, mad + 1, mad + 40}) {
+        cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+        p.split(at);
+
+        EXPECT_EQ(0, ctcm_parse_packet(ctcm, &p.mbuf)) << at;
+        EXPECT_EQ(bth, *ctcm_mbuf_bth_offset(&offsets, &p.mbuf)) << at;
+        EXPECT_EQ(mad, *ctcm_mbuf_mad_offset(&offsets, &p.mbuf)) << at;
+
+        rte_mbuf *mbuf = &p.mbuf;
+        uint64_t cm_mask;
+        EXPECT_EQ(1, ctcm_parse_burst(ctcm, &mbuf, 1, &cm_mask)) << at;
+        EXPECT_EQ(1u, cm_mask) << at;
+        EXPECT_EQ(mad, *ctcm_mbuf_mad_offset(&offsets, &p.mbuf)) << at;
+    }
+}
+
+TEST_F(CTCM, parse_truncated_packet)
+{
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(ctcm, &offsets));
+
+    /* The UDP length covers more than the packet holds */
+    const size_t mad = sizeof(iphdr) + sizeof(udphdr) + sizeof(rxe_bth) +
+        sizeof(rxe_deth);
+    for (size_t len : {size_t(0), sizeof(iphdr) + 4, mad - 4, mad + 8}) {
+        cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+        p.mbuf.pkt_len = uint32_t(len);
+        p.mbuf.data_len = uint16_t(len);
+
+        ctcm_parse_packet(ctcm, &p.mbuf);
+        EXPECT_EQ(nullptr, ctcm_mbuf_get_mad(&offsets, &p.mbuf)) << len;
+    }
+}
+
+TEST_F(CTCM, parse_burst)
+{
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(ctcm, &offsets));
+
+    /* Mix CM packets with RoCE data packets, other UDP traffic, truncated
+     * packets, and headers that do not fit in the first segment. */
+    std::vector<std::unique_ptr<cm_packet>> packets;
+    uint64_t expected_cm = 0;
+    for (unsigned i = 0; i < CTCM_MAX_BURST; ++i) {
+        packets.emplace_back(new cm_packet("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID));
+        auto& p = *packets.back();
+        switch (i % 7) {
+        case 0:
+            expected_cm |= 1ull << i;
+            break;
+        case 1:
+            __bth_set_opcode(&p.hdr.bth, IB_OPCODE_RC_SEND_ONLY);
+            break;
+        case 2:
+            __bth_set_qpn(&p.hdr.bth, 0x1234);
+            break;
+        case 3:
+            p.hdr.udp.uh_dport = htons(53);
+            break;
+        case 4:
+            /* Too short for a MAD header: 40, then 48 to 55 */
+            p.hdr.udp.uh_ulen = htons(uint16_t(i / 7 ? 47 + i / 7 :
+                                      sizeof(udphdr) + CTCM_BTH_LENGTH + 20));
+            break;
+        case 5:
+            p.mbuf.data_len = sizeof(iphdr) + sizeof(udphdr);
+            expected_cm |= 1ull << i;
+            break;
+        case 6:
+            p.mbuf.packet_type = RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_TCP;
+            break;
+        }
+    }
+
+    std::vector<rte_mbuf *> mbufs;
+    for (auto& p : packets)
+        mbufs.push_back(&p->mbuf);
+
+    /* Reference results from the per-packet parser */
+    std::vector<std::pair<rxe_bth *, ib_mad_hdr *>> expected;
+    for (auto& p : packets) {
+        if ((p->mbuf.packet_type & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_UDP) {
+            ctcm_parse_packet(ctcm, &p->mbuf);
+            expected.emplace_back(ctcm_mbuf_get_bth(&offsets, &p->mbuf),
+                                  ctcm_mbuf_get_mad(&offsets, &p->mbuf));
+        } else {
+            expected.emplace_back(nullptr, nullptr);
+        }
+        /* Stale values must be overwritten */
+        *ctcm_mbuf_bth_offset(&offsets, &p->mbuf) = 1;
+        *ctcm_mbuf_mad_offset(&offsets, &p->mbuf) = 1;
+    }
+
+    for (unsigned n : {1u, 7u, 8u, 31u, unsigned(CTCM_MAX_BURST)}) {
+        uint64_t cm_mask = ~0ull;
+        uint64_t mask = n == 64 ? ~0ull : (1ull << n) - 1;
+        int ret = ctcm_parse_burst(ctcm, mbufs.data(), uint16_t(n), &cm_mask);
+        EXPECT_EQ(expected_cm & mask, cm_mask);
+        EXPECT_EQ(__builtin_popcountll(expected_cm & mask), ret);
+        for (unsigned i = 0; i < n; ++i) {
+            EXPECT_EQ(expected[i].first, ctcm_mbuf_get_bth(&offsets, mbufs[i])) << i;
+            EXPECT_EQ(expected[i].second, ctcm_mbuf_get_mad(&offsets, mbufs[i])) << i;
+        }
+    }
+
+    uint64_t cm_mask;
+    EXPECT_EQ(-1, ctcm_parse_burst(ctcm, mbufs.data(), CTCM_MAX_BURST + 1, &cm_mask));
+}
+
+TEST_F(CTCM, parse_l2_l3)
+{
+    ctcm_context *l2 = ctcm_create_flags(CTCM_CREATE_PARSE_L2);
+    ASSERT_TRUE(l2);
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(l2, &offsets));
+
+    cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+    cm_packet6 p6("fd00::1", "fd00::2", CM_REQ_ATTR_ID);
+    const uint16_t vlan = 0x8100, qinq = 0x88a8;
+    const size_t roce_len = sizeof(udphdr) + sizeof(rxe_bth) + sizeof(rxe_deth);
+
+    struct {
+        std::unique_ptr<eth_frame> frame;
+        uint16_t l2_len, l3_len;
+        uint32_t packet_type;
+    } cases[] = {
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{}, 0x0800),
+         14, 20, RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_UDP},
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{vlan}, 0x0800),
+         18, 20, RTE_PTYPE_L2_ETHER_VLAN | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_UDP},
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{qinq, vlan}, 0x0800),
+         22, 24, RTE_PTYPE_L2_ETHER_QINQ | RTE_PTYPE_L3_IPV4_EXT | RTE_PTYPE_L4_UDP},
+        {std::make_unique<eth_frame>(p6, std::initializer_list<uint16_t>{vlan}, 0x86dd),
+         18, 40, RTE_PTYPE_L2_ETHER_VLAN | RTE_PTYPE_L3_IPV6 | RTE_PTYPE_L4_UDP},
+        /* Rejected: ARP, an IPv4 fragment, and TCP according to the NIC */
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{}, 0x0806),
+         0, 0, 0},
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{}, 0x0800),
+         0, 0, 0},
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{}, 0x0800),
+         0, 0, RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_TCP},
+        /* A NIC packet type is kept */
+        {std::make_unique<eth_frame>(p, std::initializer_list<uint16_t>{}, 0x0800),
+         14, 20, RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4_EXT_UNKNOWN | RTE_PTYPE_L4_UDP},
+    };
+
+    /* IPv4 options */
+    auto &opts = *cases[2].frame;
+    opts.insert(22 + sizeof(iphdr), 4);
+    opts.data[2 + 22] = 0x46;
+    iphdr *ip = reinterpret_cast<iphdr *>(&opts.data[2 + 22]);
+    ip->tot_len = htons(uint16_t(ntohs(ip->tot_len) + 4));
+    /* More fragments */
+    ip = reinterpret_cast<iphdr *>(&cases[5].frame->data[2 + 14]);
+    ip->frag_off = htons(IP_MF);
+    cases[6].frame->mbuf.packet_type = cases[6].packet_type;
+    cases[7].frame->mbuf.packet_type = cases[7].packet_type;
+
+    std::vector<rte_mbuf *> mbufs;
+    std::vector<uint32_t> nic_types;
+    uint64_t expected_cm = 0;
+    for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        auto &c = cases[i];
+        rte_mbuf *m = &c.frame->mbuf;
+        mbufs.push_back(m);
+        nic_types.push_back(m->packet_type);
+        if (c.l3_len)
+            expected_cm |= 1ull << i;
+
+        ctcm_parse_packet(l2, m);
+        uint16_t mad = c.l3_len ? uint16_t(c.l2_len + c.l3_len + roce_len) : 0;
+        EXPECT_EQ(mad, *ctcm_mbuf_mad_offset(&offsets, m)) << i;
+        if (!c.l3_len)
+            continue;
+        EXPECT_EQ(c.l2_len, m->l2_len) << i;
+        EXPECT_EQ(c.l3_len, m->l3_len) << i;
+        EXPECT_EQ(c.packet_type, m->packet_type) << i;
+    }
+
+    for (unsigned i = 0; i < mbufs.size(); ++i) {
+        mbufs[i]->packet_type = nic_types[i];
+        mbufs[i]->l2_len = 0;
+        mbufs[i]->l3_len = 0;
+    }
+    uint64_t cm_mask;
+    EXPECT_EQ(__builtin_popcountll(expected_cm),
+              ctcm_parse_burst(l2, mbufs.data(), uint16_t(mbufs.size()), &cm_mask));
+    EXPECT_EQ(expected_cm, cm_mask);
+
+    ctcm_destroy(l2);
+}
+
+TEST_F(CTCM, parse_tunnels)
+{
+    ctcm_context *l2 = ctcm_create_flags(CTCM_CREATE_PARSE_L2);
+    ASSERT_TRUE(l2);
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(l2, &offsets));
+
+    cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+    cm_packet6 p6("fd00::1", "fd00::2", CM_REQ_ATTR_ID);
+    const size_t roce_len = sizeof(udphdr) + sizeof(rxe_bth) + sizeof(rxe_deth);
+
+    eth_frame vxlan(p);
+    vxlan.encapsulate(4789, 10);
+    eth_frame geneve(p6, {0x8100}, ETHERTYPE_IPV6);
+    geneve.encapsulate(6081, 20, 8);
+    eth_frame bad_flags(p);
+    bad_flags.encapsulate(4789, 10);
+    bad_flags.data[2 + 14 + sizeof(iphdr) + sizeof(udphdr)] = 0;
+
+    ctcm_parse_packet(l2, &vxlan.mbuf);
+    EXPECT_EQ(14u, vxlan.mbuf.outer_l2_len);
+    EXPECT_EQ(20u, vxlan.mbuf.outer_l3_len);
+    EXPECT_EQ(8u + 8 + 14, vxlan.mbuf.l2_len);
+    EXPECT_EQ(20u, vxlan.mbuf.l3_len);
+    EXPECT_EQ(RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_UDP |
+              RTE_PTYPE_TUNNEL_VXLAN | RTE_PTYPE_INNER_L2_ETHER |
+              RTE_PTYPE_INNER_L3_IPV4 | RTE_PTYPE_INNER_L4_UDP,
+              vxlan.mbuf.packet_type);
+    EXPECT_EQ(14 + 20 + 30 + 20 + roce_len,
+              *ctcm_mbuf_mad_offset(&offsets, &vxlan.mbuf));
+
+    ctcm_parse_packet(l2, &geneve.mbuf);
+    EXPECT_EQ(8u + 16 + 18, geneve.mbuf.l2_len);
+    EXPECT_EQ(40u, geneve.mbuf.l3_len);
+    EXPECT_EQ(RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 | RTE_PTYPE_L4_UDP |
+              RTE_PTYPE_TUNNEL_GENEVE | RTE_PTYPE_INNER_L2_ETHER_VLAN |
+              RTE_PTYPE_INNER_L3_IPV6 | RTE_PTYPE_INNER_L4_UDP,
+              geneve.mbuf.packet_type);
+    EXPECT_EQ(14 + 20 + 42 + 40 + roce_len,
+              *ctcm_mbuf_mad_offset(&offsets, &geneve.mbuf));
+
+    /* Without the VXLAN I flag the outer UDP packet is not RoCE */
+    ctcm_parse_packet(l2, &bad_flags.mbuf);
+    EXPECT_EQ(0, *ctcm_mbuf_mad_offset(&offsets, &bad_flags.mbuf));
+
+    rte_mbuf *mbufs[] = {&vxlan.mbuf, &bad_flags.mbuf, &geneve.mbuf};
+    for (auto m : mbufs)
+        m->packet_type = 0;
+    uint64_t cm_mask;
+    EXPECT_EQ(2, ctcm_parse_burst(l2, mbufs, 3, &cm_mask));
+    EXPECT_EQ(0x5u, cm_mask);
+
+    ctcm_destroy(l2);
+}
+
+TEST_F(CTCM, parse_validate)
+{
+    ctcm_context *v = ctcm_create_flags(CTCM_CREATE_VALIDATE);
+    ASSERT_TRUE(v);
+    struct ctcm_dynfield_offsets offsets{sizeof(offsets)};
+    ASSERT_EQ(0, ctcm_dynfield_offsets(v, &offsets));
+
+    cm_packet p("10.0.0.1", "10.0.0.2", CM_REQ_ATTR_ID);
+    cm_packet6 p6("fd00::1", "fd00::2", CM_REQ_ATTR_ID);
+    p.seal();
+    p6.seal();
+    /* Fields outside the ICRC may change in flight */
+    p.hdr.ip.ttl = 7;
+    p.hdr.udp.check = 0x1234;
+    p6.hdr.ip.ip6_hlim = 7;
+    ctcm_parse_packet(v, &p.mbuf);
+    EXPECT_EQ(&p.hdr.mad, ctcm_mbuf_get_mad(&offsets, &p.mbuf));
+    ctcm_parse_packet(v, &p6.mbuf);
+    EXPECT_EQ(&p6.hdr.mad, ctcm_mbuf_get_mad(&offsets, &p6.mbuf));
+
+    /* Corrupt a field, and recompute the ICRC unless it is the target */
+    auto corrupt = [](void (*f)(cm_packet &), bool update_icrc = true) {
+        std::unique_ptr<cm_packet> c(new cm_packet("10.0.0.1", "10.0.0.2",
+                                                   CM_REQ_ATTR_ID));
+        c->seal();
+        f(*c);
+        if (update_icrc)
+            c->update_icrc();
+        return c;
+    };
+    std::vector<std::unique_ptr<cm_packet>> bad;
+    bad.push_back(corrupt([](cm_packet &c) { c.mbuf.pkt_len = c.mbuf.data_len -= 4; }));
+    bad.push_back(corrupt([](cm_packet &c) { c.hdr.udp.uh_ulen = htons(100); }));
+    bad.push_back(corrupt([](cm_packet &c) { __bth_set_tver(&c.hdr.bth, 1); }));
+    bad.push_back(corrupt([](cm_packet &c) { __deth_set_qkey(&c.hdr.deth, 1); }));
+    bad.push_back(corrupt([](cm_packet &c) { __deth_set_sqp(&c.hdr.deth, 2); }));
+    bad.push_back(corrupt([](cm_packet &c) { c.hdr.mad.class_version = 3; }));
+    bad.push_back(corrupt([](cm_packet &c) { c.hdr.mad.method = IB_MGMT_METHOD_GET; }));
+    bad.push_back(corrupt([](cm_packet &c) { c.set32(0, 1); }, false));
+    bad.push_back(corrupt([](cm_packet &c) { c.hdr.ip.saddr ^= 1; }, false));
+
+    std::vector<rte_mbuf *> mbufs;
+    for (auto &b : bad) {
+        /* Still CM without validation */
+        ctcm_parse_packet(ctcm, &b->mbuf);
+        EXPECT_EQ(&b->hdr.mad, ctcm_mbuf_get_mad(&offsets, &b->mbuf));
+        ctcm_parse_packet(v, &b->mbuf);
+        EXPECT_EQ(nullptr, ctcm_mbuf_get_mad(&offsets, &b->mbuf));
+        mbufs.push_back(&b->mbuf);
+    }
+    mbufs.push_back(&p.mbuf);
+
+    struct ctcm_validation_counters counters{sizeof(counters)};
+    ASSERT_EQ(0, ctcm_get_validation_counters(v, &counters));
+    EXPECT_EQ(2u, counters.bad_length);
+    EXPECT_EQ(1u, counters.bad_bth);
+    EXPECT_EQ(2u, counters.bad_deth);
+    EXPECT_EQ(2u, counters.bad_mad);
+    EXPECT_EQ(2u, counters.bad_icrc);
+
+    uint64_t cm_mask;
+    EXPECT_EQ(1, ctcm_parse_burst(v, mbufs.data(), uint16_t(mbufs.size()),
+                                  &cm_mask));
+    EXPECT_EQ(1ull << bad.size(), cm_mask);
+    ASSERT_EQ(0, ctcm_get_validation_counters(v, &counters));
+    EXPECT_EQ(4u, counters.bad_icrc);
+
+    counters.size = 4;
+    EXPECT_EQ(-1, ctcm_get_validation_counters(v, &counters));
+
+    ctcm_destroy(v);
+}
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "gtest/gtest.h"
+
+#include "qpn_table.h"
+
+#include <map>
+#include <random>
+
+using directory4 = qpn_directory<ip4_addr, flow_key, flow_key_hash>;
+
+static flow_key key(uint32_t host, uint32_t qpn)
+{
+    return flow_key(ip4_addr(htonl(0x0a000000 | host)), qpn);
+}
+
+/* Random operations against a reference map, with QPNs drawn from spread,
+ * which when large sends some of them to the overflow table */
+static void random_ops(uint32_t hosts, uint32_t spread)
+{
+    directory4 dir(flow_key_hash(0x1234));
+    std::map<std::pair<uint32_t, uint32_t>, uint32_t> reference;
+    std::mt19937 rng(1);
+
+    for (unsigned i = 0; i < 200000; ++i) {
+        uint32_t host = uint32_t(rng() % hosts);
+        uint32_t qpn = 0x1000 + uint32_t(rng() % spread);
+        switch (rng() % 3) {
+        case 0: {
+            bool inserted = reference.emplace(std::make_pair(host, qpn),
+                                              i + 1).second;
+            ASSERT_EQ(inserted, dir.insert(key(host, qpn), i + 1));
+            break;
+        }
+        case 1:
+            ASSERT_EQ(reference.erase({host, qpn}) == 1,
+                      dir.erase(key(host, qpn)));
+            break;
+        case 2: {
+            auto it = reference.find({host, qpn});
+            ASSERT_EQ(it == reference.end() ? 0u : it->second,
+                      dir.find(key(host, qpn)));
+            break;
+        }
+        }
+        ASSERT_EQ(reference.size(), dir.size());
+    }
+
+    for (auto &[k, qpn] : reference)
+        EXPECT_EQ(qpn, dir.find(key(k.first, k.second)));
+}
+
+TEST(qpn_directory, random_ops)
+{
+    random_ops(16, 2000);
+}
+
+TEST(qpn_directory, overflow)
+{
+    random_ops(4, 1 << 24);
+}
+
+TEST(qpn_directory, span)
+{
+    directory4 dir;
+    const uint32_t span = directory4::max_span * directory4::page_size;
+
+    /* The run grows down and up to max_span pages, further QPNs overflow */
+    const uint32_t base = 0x800000;
+    ASSERT_TRUE(dir.insert(key(1, base), 1));
+    ASSERT_TRUE(dir.insert(key(1, base + 64), 2));
+    ASSERT_TRUE(dir.insert(key(1, base - span + 128), 3));
+    ASSERT_TRUE(dir.insert(key(1, base - span + 64), 4));
+    EXPECT_EQ(1u, dir.find(key(1, base)));
+    EXPECT_EQ(2u, dir.find(key(1, base + 64)));
+    EXPECT_EQ(3u, dir.find(key(1, base - span + 128)));
+    EXPECT_EQ(4u, dir.find(key(1, base - span + 64)));
+    EXPECT_EQ(0u, dir.find(key(1, base + 1)));
+    EXPECT_EQ(0u, dir.find(key(1, base - span + 65)));
+    EXPECT_EQ(0u, dir.find(key(2, base)));
+    EXPECT_FALSE(dir.insert(key(1, base - span + 64), 5));
+    EXPECT_EQ(1u, dir.host_count());
+
+    /* Removing a host's last entry frees its pages for other hosts */
+    size_t memory = dir.page_memory();
+    for (uint32_t qpn : {base, base + 64, base - span + 128, base - span + 64})
+        ASSERT_TRUE(dir.erase(key(1, qpn)));
+    EXPECT_FALSE(dir.erase(key(1, base)));
+    EXPECT_EQ(0u, dir.size());
+    EXPECT_EQ(0u, dir.host_count());
+
+    ASSERT_TRUE(dir.insert(key(2, 0x10), 6));
+    ASSERT_TRUE(dir.insert(key(2, 0x50), 7));
+    ASSERT_TRUE(dir.insert(key(2, 0x90), 8));
+    EXPECT_EQ(memory, dir.page_memory());
+    EXPECT_EQ(0u, dir.find(key(1, 0x10)));
+    EXPECT_EQ(7u, dir.find(key(2, 0x50)));
+}
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <random>
+#include <set>
+
+static const char local_ip[] = "10.0.0.1";
+static const char remote_ip[] = "10.0.0.2";
+
+class CTCMSharded : public ::testing::Test {
+public:
+    static constexpr unsigned n = 4;
+    ctcm_context *shards[n];
+    /* Shards the packets of the current connection went to */
+    std::set<int> used;
+    unsigned flows[n] = {};
+
+    void SetUp() {
+        char * args[] = {};
+        int ret = rte_eal_init(0, args);
+        ASSERT_EQ(0, ret);
+        ASSERT_EQ(0, ctcm_create_sharded(0, n, shards));
+    }
+
+    void TearDown() {
+        for (ctcm_context *shard : shards)
+            ctcm_destroy(shard);
+        int ret = rte_eal_cleanup();
+        ASSERT_EQ(0, ret);
+    }
+
+    /* Steer p the way RX code would, through any of the shards */
+    void process(ctcm_direction dir, cm_packet &p)
+    {
+        ctcm_parse_packet(shards[0], &p.mbuf);
+        int shard = ctcm_shard_of(shards[used.size() % n], dir, &p.mbuf);
+        ASSERT_GE(shard, 0);
+        ASSERT_LT(shard, int(n));
+        used.insert(shard);
+        ctcm_process_packet(shards[shard], dir, &p.mbuf);
+    }
+
+    void end_connection()
+    {
+        EXPECT_EQ(1u, used.size());
+        if (used.size() == 1)
+            ++flows[*used.begin()];
+        used.clear();
+    }
+
+    uint32_t query(unsigned shard, uint32_t qpn)
+    {
+        in_addr remote;
+        inet_aton(remote_ip, &remote);
+        return ctcm_query_ipv4(shards[shard], remote.s_addr, qpn);
+    }
+};
+
+TEST_F(CTCMSharded, connections_stay_on_one_shard)
+{
+    const unsigned count = 256;
+    std::mt19937 rng(1);
+
+    for (unsigned i = 0; i < count; ++i) {
+        uint32_t local_id = uint32_t(rng()) | 1, remote_id = uint32_t(rng()) | 1;
+        uint32_t local_qpn = 0x1000 + i, remote_qpn = 0x10000 + i;
+        bool active = i & 1;
+
+        if (active) {
+            process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                    CM_REQ_ATTR_ID, local_id, 0, local_qpn));
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_MRA_ATTR_ID, remote_id, local_id));
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_REP_ATTR_ID, remote_id, local_id, remote_qpn));
+            process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                    CM_RTU_ATTR_ID, local_id, remote_id));
+        } else {
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_REQ_ATTR_ID, remote_id, 0, remote_qpn));
+            process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                    CM_REP_ATTR_ID, local_id, remote_id, local_qpn));
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_RTU_ATTR_ID, remote_id, local_id));
+        }
+
+        /* The QPN table is shared */
+        for (unsigned shard = 0; shard < n; ++shard)
+            EXPECT_EQ(local_qpn, query(shard, remote_qpn));
+
+        /* Either side may disconnect */
+        if (rng() & 1) {
+            process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                    CM_DREQ_ATTR_ID, local_id, remote_id));
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_DREP_ATTR_ID, remote_id, local_id));
+        } else {
+            process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                    CM_DREQ_ATTR_ID, remote_id, local_id));
+            process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                    CM_DREP_ATTR_ID, local_id, remote_id));
+        }
+        end_connection();
+        EXPECT_EQ(0u, query(0, remote_qpn));
+    }
+
+    for (unsigned shard = 0; shard < n; ++shard)
+        EXPECT_GT(flows[shard], count / n / 2);
+}
+
+TEST_F(CTCMSharded, rejects_follow_the_flow)
+{
+    std::mt19937 rng(2);
+
+    for (unsigned i = 0; i < 64; ++i) {
+        uint32_t local_id = uint32_t(rng()) | 1, remote_id = uint32_t(rng()) | 1;
+
+        /* A passive flow rejected by the local host at the REQ */
+        process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                CM_REQ_ATTR_ID, remote_id, 0, 0x22));
+        process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                CM_REJ_ATTR_ID, local_id, remote_id));
+        end_connection();
+
+        /* An active flow whose initiator rejects the REP */
+        process(CTCM_FROM_HOST, *make_cm_packet(local_ip, remote_ip,
+                CM_REQ_ATTR_ID, local_id, 0, 0x11));
+        process(CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip,
+                CM_REP_ATTR_ID, remote_id, local_id, 0x22));
+        auto rej = make_cm_packet(local_ip, remote_ip, CM_REJ_ATTR_ID,
+                                  local_id, remote_id);
+        rej->hdr.cm_data[8] = CM_MSG_RESPONSE_REP << 6;
+        process(CTCM_FROM_HOST, *rej);
+        end_connection();
+        EXPECT_EQ(0u, query(0, 0x22));
+    }
+}
+
+TEST_F(CTCMSharded, not_cm_or_not_sharded)
+{
+    cm_packet p(local_ip, remote_ip, CM_REQ_ATTR_ID);
+    p.hdr.bth.qpn = htonl(2);
+    ctcm_parse_packet(shards[0], &p.mbuf);
+    EXPECT_EQ(-1, ctcm_shard_of(shards[0], CTCM_FROM_HOST, &p.mbuf));
+
+    ctcm_context *ctcm = ctcm_create();
+    ASSERT_TRUE(ctcm);
+    auto req = make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11);
+    ctcm_parse_packet(ctcm, &req->mbuf);
+    EXPECT_EQ(0, ctcm_shard_of(ctcm, CTCM_FROM_HOST, &req->mbuf));
+    ctcm_destroy(ctcm);
+}
+
+TEST_F(CTCMSharded, invalid_arguments)
+{
+    ctcm_context *more[CTCM_MAX_SHARDS + 1];
+
+    errno = 0;
+    EXPECT_EQ(-1, ctcm_create_sharded(0, 0, more));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, ctcm_create_sharded(0, CTCM_MAX_SHARDS + 1, more));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_EQ(-1, ctcm_create_sharded(CTCM_CREATE_DIRECT_QPN, 2, more));
+    EXPECT_EQ(EINVAL, errno);
+}
@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+static const char local_ip[] = "10.0.0.1";
+static const char remote_ip[] = "10.0.0.2";
+
+/* Count the C++ heap allocations of the library, which contexts created
+ * without a socket use for their tables */
+static std::atomic<bool> counting{false};
+static std::atomic<unsigned long> allocations{0};
+static std::atomic<size_t> allocated{0};
+
+void *operator new(size_t n)
+{
+    if (counting) {
+        ++allocations;
+        allocated += n;
+    }
+    void *p = malloc(n ? n : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t n, std::align_val_t align)
+{
+    if (counting) {
+        ++allocations;
+        allocated += n;
+    }
+    void *p = aligned_alloc(size_t(align), (n + size_t(align) - 1) & ~(size_t(align) - 1));
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+/* glibc's malloc is what the default operator new uses as well */
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { free(p); }
+
+static in_addr_t ip(const char *addr)
+{
+    in_addr a;
+    inet_aton(addr, &a);
+    return a.s_addr;
+}
+
+static ctcm_config config(uint64_t flags, uint32_t max_flows)
+{
+    ctcm_config c = {};
+    c.size = sizeof(c);
+    c.flags = flags;
+    c.socket_id = CTCM_SOCKET_HEAP;
+    c.max_flows = max_flows;
+    return c;
+}
+
+static ctcm_flow_counters flow_counters(ctcm_context *ctcm)
+{
+    ctcm_flow_counters c = {};
+    c.size = sizeof(c);
+    ctcm_get_flow_counters(ctcm, &c);
+    return c;
+}
+
+/* Packets of connections that are set up and torn down, of ones left
+ * established, and of SIDR exchanges */
+static std::vector<std::pair<ctcm_direction, std::unique_ptr<cm_packet>>>
+storm(uint32_t connections)
+{
+    std::vector<std::pair<ctcm_direction, std::unique_ptr<cm_packet>>> packets;
+
+    for (uint32_t i = 0; i < connections; ++i) {
+        uint32_t local_id = 0x1000 + i, remote_id = 0x80000 + i;
+        packets.emplace_back(CTCM_FROM_NET, make_cm_packet(remote_ip, local_ip,
+                             CM_REQ_ATTR_ID, remote_id, 0, 0x10000 + i));
+        packets.emplace_back(CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                             CM_REP_ATTR_ID, local_id, remote_id, 0x100 + i));
+        packets.emplace_back(CTCM_FROM_NET, make_cm_packet(remote_ip, local_ip,
+                             CM_RTU_ATTR_ID, remote_id, local_id));
+        if (i % 2) {
+            packets.emplace_back(CTCM_FROM_NET, make_cm_packet(remote_ip, local_ip,
+                                 CM_DREQ_ATTR_ID, remote_id, local_id));
+            packets.emplace_back(CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                                 CM_DREP_ATTR_ID, local_id, remote_id));
+        }
+        if (i % 8 == 0) {
+            packets.emplace_back(CTCM_FROM_HOST, make_cm_packet(local_ip, remote_ip,
+                                 CM_SIDR_REQ_ATTR_ID, i));
+            auto rep = make_cm_packet(remote_ip, local_ip, CM_SIDR_REP_ATTR_ID,
+                                      i, 0, 0x30000 + i);
+            rep->set32(20, 0x1234);
+            packets.emplace_back(CTCM_FROM_NET, std::move(rep));
+        }
+    }
+    return packets;
+}
+
+TEST_F(CTCM, static_capacity_never_allocates)
+{
+    const uint32_t capacity = 1000;
+    auto packets = storm(4 * capacity);
+
+    ctcm_config c = config(CTCM_CREATE_STATIC, capacity);
+    ctcm_context *fixed = ctcm_create_ex(&c);
+    ASSERT_TRUE(fixed);
+
+    allocations = 0;
+    counting = true;
+    for (auto &p : packets) {
+        ctcm_parse_packet(fixed, &p.second->mbuf);
+        ctcm_process_packet(fixed, p.first, &p.second->mbuf);
+    }
+    counting = false;
+    EXPECT_EQ(0u, allocations.load());
+
+    /* Old connections made room for new ones */
+    auto counters = flow_counters(fixed);
+    EXPECT_EQ(capacity, counters.flows);
+    EXPECT_GT(counters.evicted, 0u);
+    uint32_t last = 4 * capacity - 2;
+    EXPECT_EQ(0x100u + last, ctcm_query_ipv4(fixed, ip(remote_ip), 0x10000 + last));
+    EXPECT_EQ(0u, ctcm_query_ipv4(fixed, ip(remote_ip), 0x10000));
+    ctcm_destroy(fixed);
+}
+
+TEST_F(CTCM, expected_flows)
+{
+    const uint32_t connections = 5000;
+    auto packets = storm(connections);
+
+    ctcm_config c = config(0, 0);
+    c.expected_flows = connections;
+    ctcm_context *sized = ctcm_create_ex(&c);
+    ASSERT_TRUE(sized);
+
+    /* The tables were sized up front, and do not grow */
+    allocations = 0;
+    counting = true;
+    for (auto &p : packets) {
+        ctcm_parse_packet(sized, &p.second->mbuf);
+        ctcm_process_packet(sized, p.first, &p.second->mbuf);
+    }
+    counting = false;
+    EXPECT_EQ(0u, allocations.load());
+
+    for (uint32_t i = 0; i < connections; i += 2)
+        EXPECT_EQ(0x100u + i, ctcm_query_ipv4(sized, ip(remote_ip), 0x10000 + i));
+    ctcm_destroy(sized);
+}
+
+/* Bytes allocated on the heap by creating a context */
+static size_t context_memory(const ctcm_config &c)
+{
+    allocated = 0;
+    counting = true;
+    ctcm_context *ctcm = ctcm_create_ex(&c);
+    counting = false;
+    EXPECT_TRUE(ctcm);
+    ctcm_destroy(ctcm);
+    return allocated;
+}
+
+TEST_F(CTCM, static_concurrent_budget)
+{
+    const uint32_t capacity = 100000;
+
+    /* Queries go to the rte_hash, so the local QPN tables are left out of
+     * the budget: at least 16 and 28 bytes a flow for IPv4 and IPv6 */
+    size_t local = context_memory(config(CTCM_CREATE_STATIC, capacity));
+    size_t concurrent = context_memory(
+        config(CTCM_CREATE_STATIC | CTCM_CREATE_CONCURRENT_QUERY, capacity));
+    EXPECT_LT(concurrent + size_t(capacity) * (16 + 28), local);
+}
+
+TEST_F(CTCM, static_capacity_limits)
+{
+    ctcm_config c = config(CTCM_CREATE_STATIC, 100);
+    c.max_flows_per_host = 10;
+    ctcm_context *fixed = ctcm_create_ex(&c);
+    ASSERT_TRUE(fixed);
+
+    /* Limits may be lowered, but never lifted past the capacity */
+    ctcm_flow_limits limits = {sizeof(limits), 50, 0};
+    EXPECT_EQ(0, ctcm_set_flow_limits(fixed, &limits));
+    limits.max_flows = 100;
+    EXPECT_EQ(0, ctcm_set_flow_limits(fixed, &limits));
+    errno = 0;
+    limits.max_flows = 101;
+    EXPECT_EQ(-1, ctcm_set_flow_limits(fixed, &limits));
+    EXPECT_EQ(EINVAL, errno);
+    limits.max_flows = 0;
+    EXPECT_EQ(-1, ctcm_set_flow_limits(fixed, &limits));
+    EXPECT_EQ(EINVAL, errno);
+    ctcm_destroy(fixed);
+}
+
+TEST_F(CTCM, create_ex_invalid_config)
+{
+    ctcm_config c = config(CTCM_CREATE_STATIC, 0);
+
+    errno = 0;
+    EXPECT_FALSE(ctcm_create_ex(&c));
+    EXPECT_EQ(EINVAL, errno);
+
+    c = config(CTCM_CREATE_STATIC | CTCM_CREATE_DIRECT_QPN, 100);
+    EXPECT_FALSE(ctcm_create_ex(&c));
+    EXPECT_EQ(EINVAL, errno);
+
+    c = config(0, 0);
+    c.size = sizeof(c) - 1;
+    EXPECT_FALSE(ctcm_create_ex(&c));
+    EXPECT_EQ(EINVAL, errno);
+
+    c = config(0, 0);
+    c.socket_id = RTE_MAX_NUMA_NODES;
+    EXPECT_FALSE(ctcm_create_ex(&c));
+    EXPECT_EQ(EINVAL, errno);
+
+    /* Without a capacity to allocate for */
+    EXPECT_FALSE(ctcm_create_flags(CTCM_CREATE_STATIC));
+    EXPECT_EQ(EINVAL, errno);
+    EXPECT_FALSE(ctcm_create_socket(CTCM_CREATE_STATIC, 0));
+    EXPECT_EQ(EINVAL, errno);
+
+    c = config(CTCM_CREATE_CONCURRENT_QUERY, 0);
+    c.socket_id = SOCKET_ID_ANY;
+    c.expected_flows = 1000;
+    ctcm_context *ok = ctcm_create_ex(&c);
+    EXPECT_TRUE(ok);
+    ctcm_destroy(ok);
+}
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "gtest/gtest.h"
+
+#include "timer_wheel.h"
+
+#include <random>
+#include <unordered_map>
+
+TEST(timer_wheel, fires_on_time)
+{
+    timer_wheel wheel(1000);
+    std::unordered_map<flow_handle, uint64_t> expiry;
+    std::mt19937_64 rng(1);
+
+    /* Delays across all the levels, and beyond the wheel's range */
+    for (flow_handle h = 0; h < 2000; ++h) {
+        uint64_t delay = rng() % (1ull << (rng() % 26));
+        expiry[h] = wheel.now() + delay;
+        wheel.schedule(h, expiry[h]);
+    }
+    for (flow_handle h = 0; h < 2000; h += 7) {
+        wheel.cancel(h);
+        expiry.erase(h);
+    }
+    EXPECT_EQ(expiry.size(), wheel.size());
+
+    unsigned fired = 0;
+    uint64_t now = wheel.now();
+    while (!expiry.empty()) {
+        /* Advance in uneven steps, exercising the idle slot skipping */
+        now += rng() % 5000;
+        fired += wheel.advance(now, UINT32_MAX, [&](flow_handle h) {
+            auto it = expiry.find(h);
+            ASSERT_NE(expiry.end(), it);
+            EXPECT_LE(it->second, now);
+            EXPECT_GT(it->second + 5000, now);
+            expiry.erase(it);
+        });
+        for (auto &[h, e] : expiry)
+            ASSERT_GT(e, now) << h;
+    }
+    EXPECT_EQ(2000u - 2000u / 7 - 1, fired);
+    EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(timer_wheel, exact_ticks)
+{
+    timer_wheel wheel;
+    std::vector<uint64_t> expiry{0, 1, 63, 64, 65, 4095, 4096, 4097, 300000};
+
+    for (flow_handle h = 0; h < expiry.size(); ++h)
+        wheel.schedule(h, expiry[h]);
+
+    for (uint64_t now = 0; now <= expiry.back(); ++now)
+        wheel.advance(now, UINT32_MAX, [&](flow_handle h) {
+            EXPECT_EQ(expiry[h], now);
+        });
+    EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(timer_wheel, budget)
+{
+    timer_wheel wheel;
+
+    for (flow_handle h = 0; h < 10; ++h)
+        wheel.schedule(h, 5);
+    wheel.schedule(3, 100);
+    EXPECT_TRUE(wheel.scheduled(3));
+
+    auto expire = [&](flow_handle h) { EXPECT_NE(3u, h); };
+    EXPECT_EQ(4u, wheel.advance(50, 4, expire));
+    EXPECT_EQ(5u, wheel.advance(50, 8, expire));
+    EXPECT_EQ(0u, wheel.advance(99, 8, expire));
+    EXPECT_EQ(1u, wheel.size());
+    EXPECT_EQ(1u, wheel.advance(100, 8, [](flow_handle h) { EXPECT_EQ(3u, h); }));
+    EXPECT_FALSE(wheel.scheduled(3));
+}
@@ -0,0 +1,719 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "ctcm_test.h"
+
+#include <rte_cycles.h>
+
+#include <thread>
+#include <vector>
+
+static const char local_ip[] = "10.0.0.1";
+static const char remote_ip[] = "10.0.0.2";
+
+static in_addr_t ip(const char *addr)
+{
+    in_addr a;
+    inet_aton(addr, &a);
+    return a.s_addr;
+}
+
+template <typename Packet>
+static void process(ctcm_context *ctcm, ctcm_direction dir, Packet &p)
+{
+    ctcm_parse_packet(ctcm, &p.mbuf);
+    ctcm_process_packet(ctcm, dir, &p.mbuf);
+}
+
+TEST_F(CTCM, track_active_connection)
+{
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+TEST_F(CTCM, track_passive_connection)
+{
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REP_ATTR_ID, 0x100, 0x200, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_RTU_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREQ_ATTR_ID, 0x200, 0x100));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREP_ATTR_ID, 0x100, 0x200));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+TEST_F(CTCM, track_split_packets)
+{
+    /* The first segment ends inside the CM message, before the QPNs */
+    const size_t split = sizeof(iphdr) + sizeof(udphdr) + sizeof(rxe_bth) +
+        sizeof(rxe_deth) + sizeof(ib_mad_hdr) + 6;
+    std::vector<std::unique_ptr<cm_packet>> packets;
+
+    packets.push_back(make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    packets.push_back(make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    packets.push_back(make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+    for (auto &p : packets)
+        p->split(split);
+
+    process(ctcm, CTCM_FROM_HOST, *packets[0]);
+    process(ctcm, CTCM_FROM_NET, *packets[1]);
+    rte_mbuf *rtu = &packets[2]->mbuf;
+    EXPECT_EQ(1, ctcm_process_burst(ctcm, CTCM_FROM_HOST, &rtu, 1));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+TEST_F(CTCM, track_overlay_connections)
+{
+    ctcm_context *overlay = ctcm_create_flags(CTCM_CREATE_PARSE_L2);
+    ASSERT_TRUE(overlay);
+
+    /* Two tenants open a connection between the same addresses, with the
+     * same comm IDs and remote QPN, one over VXLAN and one over GENEVE */
+    for (uint32_t vni : {10u, 20u}) {
+        uint16_t dport = vni == 10 ? 4789 : 6081;
+        auto tunnel = [&](auto &&p) {
+            auto frame = std::make_unique<eth_frame>(*p);
+            frame->encapsulate(dport, vni);
+            return frame;
+        };
+        process(overlay, CTCM_FROM_HOST,
+                *tunnel(make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, vni)));
+        process(overlay, CTCM_FROM_NET,
+                *tunnel(make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22)));
+        process(overlay, CTCM_FROM_HOST,
+                *tunnel(make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200)));
+    }
+
+#ifdef CTCM_OVERLAY
+    EXPECT_EQ(10u, ctcm_query_vni_ipv4(overlay, 10, ip(remote_ip), 0x22));
+    EXPECT_EQ(20u, ctcm_query_vni_ipv4(overlay, 20, ip(remote_ip), 0x22));
+    EXPECT_EQ(0u, ctcm_query_ipv4(overlay, ip(remote_ip), 0x22));
+#else
+    /* The second tenant's handshake looks like a retransmission */
+    EXPECT_EQ(10u, ctcm_query_ipv4(overlay, ip(remote_ip), 0x22));
+    EXPECT_EQ(0u, ctcm_query_vni_ipv4(overlay, 10, ip(remote_ip), 0x22));
+#endif
+    EXPECT_EQ(0u, ctcm_query_vni_ipv4(overlay, 30, ip(remote_ip), 0x22));
+
+    ctcm_destroy(overlay);
+}
+
+static const char local_ip6[] = "fd00::1";
+static const char remote_ip6[] = "fd00::2";
+
+static in6_addr ip6(const char *addr)
+{
+    in6_addr a;
+    inet_pton(AF_INET6, addr, &a);
+    return a;
+}
+
+TEST_F(CTCM, track_ipv6_connection)
+{
+    process(ctcm, CTCM_FROM_NET, *make_cm_packet<cm_packet6>(
+            remote_ip6, local_ip6, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST, *make_cm_packet<cm_packet6>(
+            local_ip6, remote_ip6, CM_REP_ATTR_ID, 0x100, 0x200, 0x11));
+    process(ctcm, CTCM_FROM_NET, *make_cm_packet<cm_packet6>(
+            remote_ip6, local_ip6, CM_RTU_ATTR_ID, 0x200, 0x100));
+
+    in6_addr remote = ip6(remote_ip6), other = ip6(local_ip6);
+    EXPECT_EQ(0x11u, ctcm_query_ipv6(ctcm, &remote, 0x22));
+    EXPECT_EQ(0u, ctcm_query_ipv6(ctcm, &other, 0x22));
+
+    in6_addr ips[] = {remote, remote, other};
+    uint32_t dqpns[] = {0x22, 0x23, 0x22}, sqpns[3];
+    EXPECT_EQ(1, ctcm_query_ipv6_bulk(ctcm, ips, dqpns, sqpns, 3));
+    EXPECT_EQ(0x11u, sqpns[0]);
+    EXPECT_EQ(0u, sqpns[1]);
+    EXPECT_EQ(0u, sqpns[2]);
+
+    /* IPv4 flows and IPv4-mapped addresses do not alias */
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    process(ctcm, CTCM_FROM_NET, *make_cm_packet<cm_packet6>(
+            remote_ip6, local_ip6, CM_DREQ_ATTR_ID, 0x200, 0x100));
+    process(ctcm, CTCM_FROM_HOST, *make_cm_packet<cm_packet6>(
+            local_ip6, remote_ip6, CM_DREP_ATTR_ID, 0x100, 0x200));
+    EXPECT_EQ(0u, ctcm_query_ipv6(ctcm, &remote, 0x22));
+}
+
+TEST_F(CTCM, process_burst)
+{
+    const unsigned connections = 100;
+    std::vector<std::unique_ptr<cm_packet>> host, net, rtus;
+
+    /* Interleave the handshakes with RoCE data packets */
+    for (unsigned i = 0; i < connections; ++i) {
+        host.push_back(make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID,
+                                      0x1000 + i, 0, 0x100 + i));
+        host.push_back(make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0));
+        __bth_set_qpn(&host.back()->hdr.bth, 0x100 + i);
+        net.push_back(make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID,
+                                     0x2000 + i, 0x1000 + i, 0x200 + i));
+    }
+    for (unsigned i = 0; i < connections; ++i)
+        rtus.push_back(make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID,
+                                      0x1000 + i, 0x2000 + i));
+
+    auto process_all = [this](ctcm_direction dir, auto &packets) {
+        std::vector<rte_mbuf *> mbufs;
+        for (auto &p : packets)
+            mbufs.push_back(&p->mbuf);
+        return ctcm_process_burst(ctcm, dir, mbufs.data(), uint16_t(mbufs.size()));
+    };
+
+    EXPECT_EQ(int(connections), process_all(CTCM_FROM_HOST, host));
+    EXPECT_EQ(int(connections), process_all(CTCM_FROM_NET, net));
+    EXPECT_EQ(int(connections), process_all(CTCM_FROM_HOST, rtus));
+
+    for (unsigned i = 0; i < connections; ++i)
+        EXPECT_EQ(0x100u + i, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x200 + i));
+
+    /* Query every other flow along with unknown ones */
+    std::vector<in_addr_t> ips;
+    std::vector<uint32_t> dqpns, sqpns(2 * connections, ~0u);
+    for (unsigned i = 0; i < 2 * connections; ++i) {
+        ips.push_back(ip(remote_ip));
+        dqpns.push_back(i % 2 ? 0x300 + i : 0x200 + i / 2);
+    }
+    EXPECT_EQ(int(connections), ctcm_query_ipv4_bulk(ctcm, ips.data(),
+              dqpns.data(), sqpns.data(), unsigned(ips.size())));
+    for (unsigned i = 0; i < 2 * connections; ++i)
+        EXPECT_EQ(i % 2 ? 0 : 0x100 + i / 2, sqpns[i]) << i;
+}
+
+TEST_F(CTCM, numa_socket)
+{
+    errno = 0;
+    EXPECT_FALSE(ctcm_create_socket(0, RTE_MAX_NUMA_NODES));
+    EXPECT_EQ(EINVAL, errno);
+
+    /* Enough connections to add slab chunks and grow the tables */
+    const unsigned connections = 5000;
+    for (uint64_t flags : {0ull, CTCM_CREATE_CONCURRENT_QUERY, CTCM_CREATE_DIRECT_QPN}) {
+        for (int socket : {0, SOCKET_ID_ANY}) {
+            ctcm_context *numa = ctcm_create_socket(flags, socket);
+            ASSERT_TRUE(numa);
+            for (uint32_t i = 0; i < connections; ++i) {
+                process(numa, CTCM_FROM_HOST,
+                        *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x1000 + i, 0, 0x100 + i));
+                process(numa, CTCM_FROM_NET,
+                        *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x8000 + i, 0x1000 + i, 0x20000 + i));
+                process(numa, CTCM_FROM_HOST,
+                        *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x1000 + i, 0x8000 + i));
+            }
+            for (uint32_t i = 0; i < connections; i += 97)
+                EXPECT_EQ(0x100u + i, ctcm_query_ipv4(numa, ip(remote_ip), 0x20000 + i));
+            ctcm_destroy(numa);
+        }
+    }
+}
+
+TEST_F(CTCM, direct_qpn_table)
+{
+    errno = 0;
+    EXPECT_FALSE(ctcm_create_flags(CTCM_CREATE_DIRECT_QPN |
+                                   CTCM_CREATE_CONCURRENT_QUERY));
+    EXPECT_EQ(EINVAL, errno);
+
+    ctcm_context *direct = ctcm_create_flags(CTCM_CREATE_DIRECT_QPN);
+    ASSERT_TRUE(direct);
+
+    /* Remote QPNs in a dense range, and one far from it */
+    const unsigned connections = 100;
+    auto qpn = [](unsigned i) { return i < connections - 1 ? 0x200 + i : 0xf00000; };
+    for (unsigned i = 0; i < connections; ++i) {
+        process(direct, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x1000 + i, 0, 0x100 + i));
+        process(direct, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x2000 + i, 0x1000 + i, qpn(i)));
+        process(direct, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x1000 + i, 0x2000 + i));
+    }
+
+    std::vector<in_addr_t> ips(connections + 1, ip(remote_ip));
+    std::vector<uint32_t> dqpns, sqpns(connections + 1, ~0u);
+    for (unsigned i = 0; i < connections; ++i) {
+        EXPECT_EQ(0x100u + i, ctcm_query_ipv4(direct, ip(remote_ip), qpn(i)));
+        dqpns.push_back(qpn(i));
+    }
+    dqpns.push_back(0x200 + connections);
+    EXPECT_EQ(int(connections), ctcm_query_ipv4_bulk(direct, ips.data(),
+              dqpns.data(), sqpns.data(), unsigned(ips.size())));
+    for (unsigned i = 0; i <= connections; ++i)
+        EXPECT_EQ(i < connections ? 0x100 + i : 0, sqpns[i]) << i;
+    EXPECT_EQ(0u, ctcm_query_ipv4(direct, ip(local_ip), 0x200));
+
+    process(direct, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x1000, 0x2000));
+    process(direct, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x2000, 0x1000));
+    EXPECT_EQ(0u, ctcm_query_ipv4(direct, ip(remote_ip), 0x200));
+    EXPECT_EQ(0x101u, ctcm_query_ipv4(direct, ip(remote_ip), 0x201));
+
+    ctcm_destroy(direct);
+}
+
+/* Advance the flow timers to a TSC reading seconds after start */
+static int poll_at(ctcm_context *ctcm, uint64_t start, double seconds,
+                   unsigned budget = UINT32_MAX)
+{
+    return ctcm_poll(ctcm, start + uint64_t(seconds * double(rte_get_tsc_hz())), budget);
+}
+
+TEST_F(CTCM, stalled_handshake_expires)
+{
+    uint64_t start = rte_rdtsc();
+
+    /* Zero CM timeouts, only the tracker's minimum applies */
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+
+    EXPECT_EQ(0, poll_at(ctcm, start, 0.5));
+    EXPECT_EQ(1, poll_at(ctcm, start, 1.5, 1));
+    EXPECT_EQ(1, poll_at(ctcm, start, 1.5));
+    EXPECT_EQ(0, poll_at(ctcm, start, 1000));
+}
+
+TEST_F(CTCM, req_timeouts)
+{
+    uint64_t start = rte_rdtsc();
+    auto req = make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11);
+
+    /* Remote CM response timeout 4.096us * 2^22 = 17s, three retries */
+    req->hdr.cm_data[43] = 22 << 3;
+    req->hdr.cm_data[51] = 3 << 4;
+    process(ctcm, CTCM_FROM_HOST, *req);
+
+    EXPECT_EQ(0, poll_at(ctcm, start, 60));
+    EXPECT_EQ(1, poll_at(ctcm, start, 80));
+}
+
+TEST_F(CTCM, timewait)
+{
+    uint64_t start = rte_rdtsc();
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+
+    /* Established flows do not expire */
+    EXPECT_EQ(0, poll_at(ctcm, start, 3600));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    EXPECT_EQ(0, poll_at(ctcm, start, 3600.5));
+    EXPECT_EQ(1, poll_at(ctcm, start, 3610));
+}
+
+TEST_F(CTCM, reuse_comm_id_in_timewait)
+{
+    for (uint32_t qpn = 0x11; qpn < 0x14; ++qpn) {
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, qpn));
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+        EXPECT_EQ(qpn, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, CM_DREQ_ATTR_ID, 0x200, 0x100));
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_DREP_ATTR_ID, 0x100, 0x200));
+        EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+    }
+}
+
+static ctcm_flow_counters flow_counters(ctcm_context *ctcm)
+{
+    ctcm_flow_counters counters = {};
+    counters.size = sizeof(counters);
+    EXPECT_EQ(0, ctcm_get_flow_counters(ctcm, &counters));
+    return counters;
+}
+
+TEST_F(CTCM, mra_extends_handshake)
+{
+    uint64_t start = rte_rdtsc();
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+
+    /* Service timeout 4.096us * 2^22 = 17s */
+    auto mra = make_cm_packet(remote_ip, local_ip, CM_MRA_ATTR_ID, 0x200, 0x100);
+    mra->hdr.cm_data[9] = 22 << 3;
+    process(ctcm, CTCM_FROM_NET, *mra);
+    EXPECT_EQ(0, poll_at(ctcm, start, 10));
+
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+TEST_F(CTCM, mra_expires)
+{
+    uint64_t start = rte_rdtsc();
+
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    auto mra = make_cm_packet(local_ip, remote_ip, CM_MRA_ATTR_ID, 0x100, 0x200);
+    mra->hdr.cm_data[9] = 22 << 3;
+    process(ctcm, CTCM_FROM_HOST, *mra);
+
+    EXPECT_EQ(0, poll_at(ctcm, start, 10));
+    EXPECT_EQ(1, poll_at(ctcm, start, 20));
+}
+
+TEST_F(CTCM, passive_mra_and_path_migration)
+{
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_MRA_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REP_ATTR_ID, 0x100, 0x200, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_MRA_ATTR_ID, 0x200, 0x100));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_RTU_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    /* LAP, MRA of the LAP and APR leave the connection established */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_LAP_ATTR_ID, 0x200, 0x100));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_MRA_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_APR_ATTR_ID, 0x100, 0x200));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+    EXPECT_EQ(1u, flow_counters(ctcm).flows);
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+TEST_F(CTCM, req_flood_evicts_half_open_flows)
+{
+    const char attacker_ip[] = "10.0.0.3";
+
+    for (uint32_t i = 0; i < 4; ++i) {
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100 + i, 0, 0x10 + i));
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200 + i, 0x100 + i, 0x20 + i));
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100 + i, 0x200 + i));
+    }
+
+    ctcm_flow_limits limits = {sizeof(limits), 6, 0};
+    ASSERT_EQ(0, ctcm_set_flow_limits(ctcm, &limits));
+
+    for (uint32_t i = 0; i < 100; ++i)
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(attacker_ip, local_ip, CM_REQ_ATTR_ID, 0x5000 + i, 0, 0x30));
+
+    auto counters = flow_counters(ctcm);
+    EXPECT_EQ(6u, counters.flows);
+    EXPECT_EQ(98u, counters.evicted);
+    EXPECT_EQ(0u, counters.refused_full);
+
+    for (uint32_t i = 0; i < 4; ++i)
+        EXPECT_EQ(0x10 + i, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x20 + i));
+}
+
+TEST_F(CTCM, host_quota)
+{
+    const char attacker_ip[] = "10.0.0.3";
+    ctcm_flow_limits limits = {sizeof(limits), 0, 3};
+    ASSERT_EQ(0, ctcm_set_flow_limits(ctcm, &limits));
+
+    for (uint32_t i = 0; i < 5; ++i)
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(attacker_ip, local_ip, CM_REQ_ATTR_ID, 0x5000 + i, 0, 0x30));
+    EXPECT_EQ(2u, flow_counters(ctcm).refused_host_quota);
+
+    /* Other hosts are not affected */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x200, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REP_ATTR_ID, 0x100, 0x200, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_RTU_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+
+    auto counters = flow_counters(ctcm);
+    EXPECT_EQ(4u, counters.flows);
+    EXPECT_EQ(2u, counters.refused_host_quota);
+}
+
+TEST_F(CTCM, host_quota_ignores_local_connections)
+{
+    ctcm_flow_limits limits = {sizeof(limits), 0, 3};
+    ASSERT_EQ(0, ctcm_set_flow_limits(ctcm, &limits));
+
+    /* More local connections to the host than its quota */
+    for (uint32_t i = 0; i < 5; ++i) {
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100 + i, 0, 0x10 + i));
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200 + i, 0x100 + i, 0x20 + i));
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100 + i, 0x200 + i));
+    }
+
+    /* Do not keep the host from connecting */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0x300, 0, 0x30));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REP_ATTR_ID, 0x400, 0x300, 0x40));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_RTU_ATTR_ID, 0x300, 0x400));
+    EXPECT_EQ(0x40u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x30));
+
+    auto counters = flow_counters(ctcm);
+    EXPECT_EQ(6u, counters.flows);
+    EXPECT_EQ(0u, counters.refused_host_quota);
+}
+
+TEST_F(CTCM, conflicting_comm_ids)
+{
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+
+    /* Forged messages: no comm IDs at all, and the remote comm ID paired
+     * with another local one */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REQ_ATTR_ID, 0, 0, 0x33));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREQ_ATTR_ID, 0x200, 0x101));
+    EXPECT_EQ(0x11u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+    EXPECT_EQ(1u, flow_counters(ctcm).flows);
+
+    /* The flow is still torn down by its own IDs */
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x100, 0x200));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x200, 0x100));
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x22));
+}
+
+static int query_sidr(ctcm_context *ctcm, uint32_t qpn, ctcm_sidr_mapping &m)
+{
+    return ctcm_query_sidr_ipv4(ctcm, ip(remote_ip), qpn, &m);
+}
+
+TEST_F(CTCM, sidr_remote_service)
+{
+    uint64_t start = rte_rdtsc();
+    ctcm_sidr_mapping m = {};
+
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_SIDR_REQ_ATTR_ID, 0x5));
+    auto rep = make_cm_packet(remote_ip, local_ip, CM_SIDR_REP_ATTR_ID, 0x5, 0, 0x33);
+    rep->set32(20, 0x1234);
+    process(ctcm, CTCM_FROM_NET, *rep);
+
+    ASSERT_EQ(0, query_sidr(ctcm, 0x33, m));
+    EXPECT_EQ(0x1234u, m.qkey);
+    EXPECT_EQ(0u, m.flags);
+    EXPECT_EQ(1u, flow_counters(ctcm).sidr_mappings);
+
+    /* Mappings are not connections */
+    EXPECT_EQ(0u, flow_counters(ctcm).flows);
+    EXPECT_EQ(0u, ctcm_query_ipv4(ctcm, ip(remote_ip), 0x33));
+
+    poll_at(ctcm, start, 120);
+    EXPECT_EQ(-1, query_sidr(ctcm, 0x33, m));
+    EXPECT_EQ(ENOENT, errno);
+    EXPECT_EQ(0u, flow_counters(ctcm).sidr_mappings);
+}
+
+TEST_F(CTCM, sidr_local_service)
+{
+    ctcm_sidr_mapping m = {};
+
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_SIDR_REQ_ATTR_ID, 0x5));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_SIDR_REP_ATTR_ID, 0x5, 0, 0x11));
+    ASSERT_EQ(0, query_sidr(ctcm, 0x11, m));
+    EXPECT_EQ(CTCM_SIDR_LOCAL_SERVICE, m.flags);
+
+    /* Replies to unknown requests, and rejections, are not mapped */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_SIDR_REP_ATTR_ID, 0x6, 0, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_SIDR_REQ_ATTR_ID, 0x7));
+    auto rej = make_cm_packet(remote_ip, local_ip, CM_SIDR_REP_ATTR_ID, 0x7, 0, 0x23);
+    rej->hdr.cm_data[4] = 1;
+    process(ctcm, CTCM_FROM_NET, *rej);
+
+    EXPECT_EQ(-1, query_sidr(ctcm, 0x22, m));
+    EXPECT_EQ(-1, query_sidr(ctcm, 0x23, m));
+    EXPECT_EQ(1u, flow_counters(ctcm).sidr_mappings);
+}
+
+static ctcm_stats stats(ctcm_context *ctcm)
+{
+    ctcm_stats s = {};
+    s.size = sizeof(s);
+    EXPECT_EQ(0, ctcm_stats_get(ctcm, &s));
+    return s;
+}
+
+static uint64_t packets(const ctcm_stats &s, uint16_t attr_id, ctcm_direction dir)
+{
+    return s.packets[attr_id - CTCM_STATS_ATTR_FIRST][dir];
+}
+
+TEST_F(CTCM, stats)
+{
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_MRA_ATTR_ID, 0x200, 0x100));
+    /* Retransmitted after the MRA */
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_RTU_ATTR_ID, 0x100, 0x200));
+    /* A REP after the RTU, and a message of no flow */
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_REP_ATTR_ID, 0x200, 0x100, 0x22));
+    process(ctcm, CTCM_FROM_NET,
+            *make_cm_packet(remote_ip, local_ip, CM_DREP_ATTR_ID, 0x500, 0x600));
+    process(ctcm, CTCM_FROM_NET, *make_cm_packet(remote_ip, local_ip, 0x0001, 0x1));
+
+    auto s = stats(ctcm);
+    EXPECT_EQ(2u, packets(s, CM_REQ_ATTR_ID, CTCM_FROM_HOST));
+    EXPECT_EQ(0u, packets(s, CM_REQ_ATTR_ID, CTCM_FROM_NET));
+    EXPECT_EQ(1u, packets(s, CM_MRA_ATTR_ID, CTCM_FROM_NET));
+    EXPECT_EQ(2u, packets(s, CM_REP_ATTR_ID, CTCM_FROM_NET));
+    EXPECT_EQ(1u, packets(s, CM_RTU_ATTR_ID, CTCM_FROM_HOST));
+    EXPECT_EQ(1u, packets(s, CM_DREP_ATTR_ID, CTCM_FROM_NET));
+    EXPECT_EQ(1u, s.unknown_attr);
+    EXPECT_EQ(4u, s.transitions);
+    EXPECT_EQ(1u, s.duplicates);
+    EXPECT_EQ(2u, s.unexpected);
+    EXPECT_EQ(0u, s.insert_failures);
+    EXPECT_EQ(2u, s.flows);
+    EXPECT_EQ(2u, s.local_ids);
+    EXPECT_EQ(2u, s.remote_ids);
+    /* Both flows were started locally */
+    EXPECT_EQ(0u, s.remote_hosts);
+    EXPECT_EQ(1u, s.qpns);
+
+    /* Reset restarts the counts, not the occupancy */
+    ctcm_stats_reset(ctcm);
+    process(ctcm, CTCM_FROM_HOST,
+            *make_cm_packet(local_ip, remote_ip, CM_DREQ_ATTR_ID, 0x100, 0x200));
+    s = stats(ctcm);
+    EXPECT_EQ(0u, packets(s, CM_REQ_ATTR_ID, CTCM_FROM_HOST));
+    EXPECT_EQ(1u, packets(s, CM_DREQ_ATTR_ID, CTCM_FROM_HOST));
+    EXPECT_EQ(1u, s.transitions);
+    EXPECT_EQ(0u, s.duplicates);
+    EXPECT_EQ(2u, s.flows);
+    EXPECT_EQ(1u, s.qpns);
+
+    s.size = 4;
+    EXPECT_EQ(-1, ctcm_stats_get(ctcm, &s));
+}
+
+/* Lcores count on their own cache lines, and unregistered threads on a shared
+ * one, all summed on read */
+TEST_F(CTCM, stats_from_many_threads)
+{
+    const unsigned threads = 4, packets = 1000;
+    ctcm_context *v = ctcm_create_flags(CTCM_CREATE_VALIDATE);
+    ASSERT_TRUE(v);
+
+    std::vector<std::thread> parsers;
+    for (unsigned t = 0; t < threads; ++t) {
+        parsers.emplace_back([v, t] {
+            if (t % 2)
+                rte_thread_register();
+            auto p = make_cm_packet(local_ip, remote_ip, CM_REQ_ATTR_ID, 0x100, 0, 0x11);
+            p->seal();
+            p->hdr.ip.saddr ^= 1;
+            for (unsigned i = 0; i < packets; ++i)
+                ctcm_parse_packet(v, &p->mbuf);
+        });
+    }
+    for (auto &parser : parsers)
+        parser.join();
+
+    EXPECT_EQ(threads * packets, stats(v).bad_icrc);
+    ctcm_validation_counters counters = {};
+    counters.size = sizeof(counters);
+    ASSERT_EQ(0, ctcm_get_validation_counters(v, &counters));
+    EXPECT_EQ(threads * packets, counters.bad_icrc);
+
+    ctcm_stats_reset(v);
+    EXPECT_EQ(0u, stats(v).bad_icrc);
+    ctcm_destroy(v);
+}
+
+TEST_F(CTCM, lone_messages_track_both_comm_ids)
+{
+    /* RTU, DREQ and DREP carry both comm IDs. The first message seen of a
+     * connection, e.g. after a restart, tracks the flow by both of them. */
+    uint32_t id = 0x100;
+    for (uint16_t attr : {uint16_t(CM_RTU_ATTR_ID), uint16_t(CM_DREQ_ATTR_ID),
+                          uint16_t(CM_DREP_ATTR_ID)}) {
+        process(ctcm, CTCM_FROM_HOST,
+                *make_cm_packet(local_ip, remote_ip, attr, id, id + 0x1000));
+        process(ctcm, CTCM_FROM_NET,
+                *make_cm_packet(remote_ip, local_ip, attr, id + 0x2000, id + 1));
+        id += 2;
+    }
+
+    auto s = stats(ctcm);
+    EXPECT_EQ(6u, s.flows);
+    EXPECT_EQ(6u, s.local_ids);
+    EXPECT_EQ(6u, s.remote_ids);
+}
@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause
+ * Copyright 2021 Haggai Eran
+ */
+
+#include "gtest/gtest.h"
+
+#include "cm_connection_tracker.h"
+
+#include <map>
+#include <tuple>
+
+using s = flow_state;
+static const auto host = CTCM_FROM_HOST, net = CTCM_FROM_NET;
+
+/* The table is built at compile time, so it can be checked there too */
+static_assert(cm_transitions.get(host, CM_REQ_ATTR_ID, s::IDLE).next == s::REQ_SENT, "");
+static_assert(cm_transitions.get(net, CM_RTU_ATTR_ID, s::REP_SENT).action ==
+              cm_action::establish, "");
+static_assert(cm_transitions.get(host, CM_RTU_ATTR_ID, s::REP_SENT).action ==
+              cm_action::unexpected, "");
+static_assert(!cm_transitions.handles(host, CM_SIDR_REQ_ATTR_ID), "");
+static_assert(!cm_transitions.handles(net, CM_MAX_ATTR_ID), "");
+
+struct expected_transition
+{
+    ctcm_direction dir;
+    uint16_t attr_id;
+    std::initializer_list<s::state_t> from;
+    s::state_t next;
+    cm_action action;
+};
+
+/* Every valid (direction, message, state) of the connection state machine,
+ * written out independently of cm_transition_table */
+static const expected_transition expected[] = {
+    {host, CM_REQ_ATTR_ID, {s::IDLE, s::REQ_SENT}, s::REQ_SENT, cm_action::transition},
+    {host, CM_REQ_ATTR_ID, {s::MRA_REQ_RCVD}, s::MRA_REQ_RCVD, cm_action::duplicate},
+    {net, CM_REQ_ATTR_ID, {s::IDLE, s::REQ_RCVD}, s::REQ_RCVD, cm_action::transition},
+    {net, CM_REQ_ATTR_ID, {s::MRA_REQ_SENT}, s::MRA_REQ_SENT, cm_action::duplicate},
+
+    {host, CM_MRA_ATTR_ID, {s::REQ_RCVD, s::MRA_REQ_SENT}, s::MRA_REQ_SENT, cm_action::transition},
+    {host, CM_MRA_ATTR_ID, {s::REP_RCVD, s::MRA_REP_SENT}, s::MRA_REP_SENT, cm_action::transition},
+    {host, CM_MRA_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+    {net, CM_MRA_ATTR_ID, {s::REQ_SENT, s::MRA_REQ_RCVD}, s::MRA_REQ_RCVD, cm_action::transition},
+    {net, CM_MRA_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD}, s::MRA_REP_RCVD, cm_action::transition},
+    {net, CM_MRA_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+
+    {host, CM_REJ_ATTR_ID, {s::IDLE, s::REQ_RCVD, s::REQ_SENT, s::MRA_REQ_RCVD,
+                            s::MRA_REQ_SENT, s::REP_RCVD, s::MRA_REP_SENT},
+     s::IDLE, cm_action::erase},
+    {host, CM_REJ_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD}, s::TIMEWAIT, cm_action::timewait},
+    {net, CM_REJ_ATTR_ID, {s::IDLE, s::REQ_SENT, s::MRA_REQ_RCVD, s::REP_SENT,
+                           s::MRA_REP_RCVD, s::MRA_REQ_SENT},
+     s::IDLE, cm_action::erase},
+    {net, CM_REJ_ATTR_ID, {s::DREQ_SENT, s::REP_RCVD, s::MRA_REP_SENT, s::ESTABLISHED},
+     s::TIMEWAIT, cm_action::timewait},
+
+    {host, CM_REP_ATTR_ID, {s::REQ_RCVD, s::MRA_REQ_SENT}, s::REP_SENT, cm_action::transition},
+    {host, CM_REP_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD}, s::REP_SENT, cm_action::duplicate},
+    {net, CM_REP_ATTR_ID, {s::REQ_SENT, s::MRA_REQ_RCVD}, s::REP_RCVD, cm_action::transition},
+    {net, CM_REP_ATTR_ID, {s::MRA_REP_SENT}, s::MRA_REP_SENT, cm_action::duplicate},
+
+    {host, CM_RTU_ATTR_ID, {s::REP_RCVD, s::MRA_REP_SENT}, s::ESTABLISHED, cm_action::establish},
+    {net, CM_RTU_ATTR_ID, {s::REP_SENT, s::MRA_REP_RCVD}, s::ESTABLISHED, cm_action::establish},
+
+    {host, CM_DREQ_ATTR_ID, {s::IDLE, s::ESTABLISHED, s::DREQ_SENT, s::DREQ_RCVD},
+     s::DREQ_SENT, cm_action::transition},
+    {net, CM_DREQ_ATTR_ID, {s::REP_SENT, s::DREQ_SENT, s::ESTABLISHED,
+                            s::MRA_REP_RCVD, s::TIMEWAIT, s::DREQ_RCVD},
+     s::DREQ_RCVD, cm_action::transition},
+
+    {host, CM_DREP_ATTR_ID, {s::DREQ_SENT, s::DREQ_RCVD}, s::TIMEWAIT, cm_action::timewait},
+    {net, CM_DREP_ATTR_ID, {s::DREQ_SENT, s::DREQ_RCVD}, s::TIMEWAIT, cm_action::timewait},
+
+    {host, CM_LAP_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+    {host, CM_APR_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+    {net, CM_LAP_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+    {net, CM_APR_ATTR_ID, {s::ESTABLISHED}, s::ESTABLISHED, cm_action::track},
+};
+
+TEST(cm_transitions, every_entry)
+{
+    std::map<std::tuple<int, unsigned, unsigned>, cm_transition> valid;
+    std::map<std::pair<int, unsigned>, bool> handled;
+
+    for (auto &e : expected) {
+        handled[{e.dir, e.attr_id}] = true;
+        for (auto state : e.from)
+            valid[{e.dir, e.attr_id, state}] = cm_transition{e.next, e.action};
+    }
+
+    for (auto dir : {host, net}) {
+        for (unsigned attr = 0; attr < CM_MAX_ATTR_ID; ++attr) {
+            uint16_t attr_id = uint16_t(attr);
+            EXPECT_EQ(handled.count({dir, attr}) != 0,
+                      cm_transitions.handles(dir, attr_id)) << dir << " " << attr;
+            for (unsigned state = 0; state < cm_transition_table::num_states; ++state) {
+                auto t = cm_transitions.get(dir, attr_id, s::state_t(state));
+                auto it = valid.find({dir, attr, state});
+                if (it == valid.end()) {
+                    EXPECT_EQ(cm_action::unexpected, t.action)
+                        << dir << " " << attr << " " << state;
+                    continue;
+                }
+                EXPECT_EQ(it->second.next, t.next)
+                    << dir << " " << attr << " " << state;
+                EXPECT_EQ(it->second.action, t.action)
+                    << dir << " " << attr << " " << state;
+            }
+        }
+    }
+}
+
+/* Run messages through the table alone, from IDLE */
+static s::state_t walk(std::initializer_list<std::pair<ctcm_direction, uint16_t>> messages)
+{
+    s::state_t state = s::IDLE;
+
+    for (auto &m : messages) {
+        auto t = cm_transitions.get(m.first, m.second, state);
+        EXPECT_NE(cm_action::unexpected, t.action) << state;
+        state = t.next;
+    }
+    return state;
+}
+
+TEST(cm_transitions, handshakes)
+{
+    /* Active and passive sides, with MRAs delaying the replies */
+    EXPECT_EQ(s::ESTABLISHED, walk({{host, CM_REQ_ATTR_ID}, {net, CM_MRA_ATTR_ID},
+                                    {host, CM_REQ_ATTR_ID}, {net, CM_REP_ATTR_ID},
+                                    {host, CM_MRA_ATTR_ID}, {net, CM_REP_ATTR_ID},
+                                    {host, CM_RTU_ATTR_ID}}));
+    EXPECT_EQ(s::ESTABLISHED, walk({{net, CM_REQ_ATTR_ID}, {host, CM_MRA_ATTR_ID},
+                                    {host, CM_REP_ATTR_ID}, {net, CM_MRA_ATTR_ID},
+                                    {net, CM_RTU_ATTR_ID}}));
+
+    /* Disconnection from either side, and rejection */
+    EXPECT_EQ(s::TIMEWAIT, walk({{net, CM_REQ_ATTR_ID}, {host, CM_REP_ATTR_ID},
+                                 {net, CM_RTU_ATTR_ID}, {host, CM_LAP_ATTR_ID},
+                                 {net, CM_APR_ATTR_ID}, {host, CM_DREQ_ATTR_ID},
+                                 {net, CM_DREP_ATTR_ID}}));
+    EXPECT_EQ(s::TIMEWAIT, walk({{host, CM_REQ_ATTR_ID}, {net, CM_REP_ATTR_ID},
+                                 {host, CM_RTU_ATTR_ID}, {net, CM_DREQ_ATTR_ID},
+                                 {host, CM_DREP_ATTR_ID}}));
+    EXPECT_EQ(s::IDLE, walk({{host, CM_REQ_ATTR_ID}, {net, CM_REJ_ATTR_ID}}));
+}